@@ -0,0 +1,441 @@
+#include "clustercat-brown.h"
+
+// Agglomerative clustering of Peter F. Brown, Peter V. deSouza, Robert L. Mercer, Vincent J. Della Pietra, Jenifer C. Lai. 1992. Class-Based n-gram Models of Natural Language.
+// Computational Linguistics 18(4).  This is the windowed version of Percy Liang. 2005. Semi-Supervised Learning for Natural Language. MIT thesis.
+// Words are added in order of frequency.  Only num_classes+1 clusters are active at a time, so whenever a word is added, the pair of clusters whose merge loses the
+// least mutual information between adjacent clusters gets merged.  Once all words are in, the last num_classes clusters are merged down to one, which gives the
+// binary tree that the bitstrings come from.  The merge loss of every pair of active clusters is kept, and updated in constant time per pair after each change,
+// so clustering takes O(V * num_classes^2) time.
+// With --class-algo exchange-then-brown, the same merges build just the tree, over the exchange algorithm's classes and their bigram counts.
+
+typedef struct { // The active clusters.  Slots are reused, so a slot's cluster changes as words are added and clusters are merged
+	double * restrict counts;     // counts[a * size + b]:  how often a word in cluster a is followed by one in cluster b
+	double * restrict quality;    // quality[a * size + b]:  the mutual information terms between a and b, in both directions
+	double * restrict losses;     // losses[a * size + b], for a < b:  how much mutual information is lost by merging a and b
+	double * restrict unigrams;
+	double * restrict row_best_loss; // The smallest loss in each row, and where it is
+	unsigned int * restrict row_best;
+	unsigned int * restrict active;  // Slots in use, in increasing order
+	unsigned int num_active;
+	unsigned int size;
+	double total;                 // Bigram tokens
+	double * restrict new_row;    // Scratch space for the merged cluster's counts and quality
+	double * restrict new_col;
+	double * restrict new_quality;
+} struct_brown_clusters;
+
+static inline double brown_q(const double count, const double count_1, const double count_2, const double total) { // One direction's term of the mutual information
+	return count > 0 ? count / total * log(count * total / (count_1 * count_2)) : 0.0;
+}
+
+static inline double brown_pair_q(const double count_12, const double count_21, const double count_1, const double count_2, const double total) {
+	return brown_q(count_12, count_1, count_2, total) + brown_q(count_21, count_2, count_1, total);
+}
+
+static void init_brown_clusters(struct_brown_clusters * restrict clusters, const unsigned int size, const double total) {
+	const size_t cells = (size_t)size * size;
+	*clusters = (struct_brown_clusters){ .size = size, .total = total };
+	clusters->counts        = calloc(cells, sizeof(double));
+	clusters->quality       = calloc(cells, sizeof(double));
+	clusters->losses        = calloc(cells, sizeof(double));
+	clusters->unigrams      = calloc(size, sizeof(double));
+	clusters->row_best_loss = calloc(size, sizeof(double));
+	clusters->row_best      = calloc(size, sizeof(unsigned int));
+	clusters->active        = calloc(size, sizeof(unsigned int));
+	clusters->new_row       = calloc(size, sizeof(double));
+	clusters->new_col       = calloc(size, sizeof(double));
+	clusters->new_quality   = calloc(size, sizeof(double));
+	if (clusters->counts == NULL || clusters->quality == NULL || clusters->losses == NULL || clusters->unigrams == NULL || clusters->row_best_loss == NULL || clusters->row_best == NULL || clusters->active == NULL || clusters->new_row == NULL || clusters->new_col == NULL || clusters->new_quality == NULL) {
+		const size_t bytes = 3 * cells * sizeof(double)  +  size * (5 * sizeof(double) + 2 * sizeof(unsigned int));
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for Brown clustering.  %'.1f MB needed.  Reduce --num-classes\n", argv_0_basename, bytes / (double)1048576); fflush(stderr);
+		exit(13);
+	}
+}
+
+static void free_brown_clusters(struct_brown_clusters * restrict clusters) {
+	free(clusters->counts);
+	free(clusters->quality);
+	free(clusters->losses);
+	free(clusters->unigrams);
+	free(clusters->row_best_loss);
+	free(clusters->row_best);
+	free(clusters->active);
+	free(clusters->new_row);
+	free(clusters->new_col);
+	free(clusters->new_quality);
+}
+
+static double merge_loss(const struct_brown_clusters * restrict clusters, const unsigned int a, const unsigned int b) { // From scratch, in O(num_active) time
+	const size_t size = clusters->size;
+	const double * restrict counts = clusters->counts, * restrict quality = clusters->quality;
+	const double unigram_ab = clusters->unigrams[a] + clusters->unigrams[b];
+	const double self_ab = counts[a*size + a] + counts[a*size + b] + counts[b*size + a] + counts[b*size + b];
+	double lost  = quality[a*size + a] + quality[b*size + b] + quality[a*size + b];
+	double added = brown_q(self_ab, unigram_ab, unigram_ab, clusters->total);
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int d = clusters->active[i];
+		if (d == a  ||  d == b)
+			continue;
+		lost  += quality[a*size + d] + quality[b*size + d];
+		added += brown_pair_q(counts[a*size + d] + counts[b*size + d], counts[d*size + a] + counts[d*size + b], unigram_ab, clusters->unigrams[d], clusters->total);
+	}
+	return lost - added;
+}
+
+static void set_quality(struct_brown_clusters * restrict clusters, const unsigned int slot) { // The mutual information terms between slot and every active cluster
+	const size_t size = clusters->size;
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int d = clusters->active[i];
+		const double q = d == slot ? brown_q(clusters->counts[slot*size + slot], clusters->unigrams[slot], clusters->unigrams[slot], clusters->total)
+		                           : brown_pair_q(clusters->counts[slot*size + d], clusters->counts[d*size + slot], clusters->unigrams[slot], clusters->unigrams[d], clusters->total);
+		clusters->quality[slot*size + d] = clusters->quality[d*size + slot] = q;
+	}
+}
+
+static void set_losses(struct_brown_clusters * restrict clusters, const unsigned int slot, const unsigned int num_threads) { // Every pair with slot, from scratch
+	const size_t size = clusters->size;
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 8)
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int d = clusters->active[i];
+		if (d != slot)
+			clusters->losses[d < slot ? d*size + slot : slot*size + d] = merge_loss(clusters, d < slot ? d : slot, d < slot ? slot : d);
+	}
+}
+
+static void set_row_best(struct_brown_clusters * restrict clusters, const unsigned int i) { // Ties go to the lowest slot, so the result doesn't depend on --jobs
+	const unsigned int a = clusters->active[i];
+	const double * restrict row = clusters->losses + (size_t)a * clusters->size;
+	double best_loss = HUGE_VAL;
+	unsigned int best = a;
+	for (unsigned int j = i+1; j < clusters->num_active; j++) {
+		const unsigned int b = clusters->active[j];
+		if (row[b] < best_loss) {
+			best_loss = row[b];
+			best = b;
+		}
+	}
+	clusters->row_best_loss[a] = best_loss;
+	clusters->row_best[a] = best;
+}
+
+static void activate_slot(struct_brown_clusters * restrict clusters, const unsigned int slot) { // Keeps active in increasing order
+	unsigned int i = clusters->num_active++;
+	for (; i > 0  &&  clusters->active[i-1] > slot; i--)
+		clusters->active[i] = clusters->active[i-1];
+	clusters->active[i] = slot;
+}
+
+static void deactivate_slot(struct_brown_clusters * restrict clusters, const unsigned int slot) {
+	unsigned int i = 0;
+	while (clusters->active[i] != slot)
+		i++;
+	clusters->num_active--;
+	memmove(clusters->active + i, clusters->active + i + 1, sizeof(unsigned int) * (clusters->num_active - i));
+}
+
+static void add_cluster(struct_brown_clusters * restrict clusters, const unsigned int slot, const unsigned int num_threads) {
+	// The slot's counts and unigram count are already filled in.  A new cluster adds terms for itself to every other pair's merge loss
+	const size_t size = clusters->size;
+	activate_slot(clusters, slot);
+	set_quality(clusters, slot);
+	set_losses(clusters, slot, num_threads);
+
+	const double * restrict counts = clusters->counts, * restrict quality = clusters->quality, * restrict unigrams = clusters->unigrams;
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 8)
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int a = clusters->active[i];
+		if (a != slot) {
+			for (unsigned int j = i+1; j < clusters->num_active; j++) {
+				const unsigned int b = clusters->active[j];
+				if (b == slot)
+					continue;
+				clusters->losses[a*size + b] += quality[a*size + slot] + quality[b*size + slot]
+					- brown_pair_q(counts[a*size + slot] + counts[b*size + slot], counts[slot*size + a] + counts[slot*size + b], unigrams[a] + unigrams[b], unigrams[slot], clusters->total);
+			}
+		}
+		set_row_best(clusters, i);
+	}
+}
+
+static void best_merge(const struct_brown_clusters * restrict clusters, unsigned int * restrict s, unsigned int * restrict t) {
+	double best_loss = HUGE_VAL;
+	*s = clusters->active[0];
+	*t = clusters->row_best[*s];
+	for (unsigned int i = 0; i+1 < clusters->num_active; i++) {
+		const unsigned int a = clusters->active[i];
+		if (clusters->row_best_loss[a] < best_loss) {
+			best_loss = clusters->row_best_loss[a];
+			*s = a;
+			*t = clusters->row_best[a];
+		}
+	}
+}
+
+static void merge_clusters(struct_brown_clusters * restrict clusters, const unsigned int s, const unsigned int t, const unsigned int num_threads) {
+	// Merges t into s, and frees t's slot.  The other pairs' losses are updated for s and t being replaced by their union
+	const size_t size = clusters->size;
+	double * restrict counts = clusters->counts, * restrict quality = clusters->quality, * restrict unigrams = clusters->unigrams;
+	double * restrict new_row = clusters->new_row, * restrict new_col = clusters->new_col, * restrict new_quality = clusters->new_quality;
+	const double unigram_st = unigrams[s] + unigrams[t];
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int d = clusters->active[i];
+		new_row[d] = counts[s*size + d] + counts[t*size + d];
+		new_col[d] = counts[d*size + s] + counts[d*size + t];
+		new_quality[d] = brown_pair_q(new_row[d], new_col[d], unigram_st, unigrams[d], clusters->total);
+	}
+
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 8)
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int a = clusters->active[i];
+		if (a == s  ||  a == t)
+			continue;
+		for (unsigned int j = i+1; j < clusters->num_active; j++) {
+			const unsigned int b = clusters->active[j];
+			if (b == s  ||  b == t)
+				continue;
+			const double unigram_ab = unigrams[a] + unigrams[b];
+			clusters->losses[a*size + b] += new_quality[a] + new_quality[b] - quality[a*size + s] - quality[a*size + t] - quality[b*size + s] - quality[b*size + t]
+				+ brown_pair_q(counts[a*size + s] + counts[b*size + s], counts[s*size + a] + counts[s*size + b], unigram_ab, unigrams[s], clusters->total)
+				+ brown_pair_q(counts[a*size + t] + counts[b*size + t], counts[t*size + a] + counts[t*size + b], unigram_ab, unigrams[t], clusters->total)
+				- brown_pair_q(new_col[a] + new_col[b], new_row[a] + new_row[b], unigram_ab, unigram_st, clusters->total);
+		}
+	}
+
+	const double self_st = counts[s*size + s] + counts[s*size + t] + counts[t*size + s] + counts[t*size + t];
+	for (unsigned int i = 0; i < clusters->num_active; i++) {
+		const unsigned int d = clusters->active[i];
+		counts[s*size + d]  = new_row[d];
+		counts[d*size + s]  = new_col[d];
+		quality[s*size + d] = quality[d*size + s] = new_quality[d];
+	}
+	counts[s*size + s] = self_st;
+	unigrams[s] = unigram_st;
+	quality[s*size + s] = brown_q(self_st, unigram_st, unigram_st, clusters->total);
+	deactivate_slot(clusters, t);
+	set_losses(clusters, s, num_threads);
+
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 8)
+	for (unsigned int i = 0; i < clusters->num_active; i++)
+		set_row_best(clusters, i);
+}
+
+static const word_count_t * sort_word_counts; // For qsort(), which doesn't pass an argument through
+
+static int compare_words_by_count(const void * a, const void * b) { // Descending, then by word id
+	const word_id_t x = *(const word_id_t *)a, y = *(const word_id_t *)b;
+	if (sort_word_counts[x] != sort_word_counts[y])
+		return sort_word_counts[x] < sort_word_counts[y] ? 1 : -1;
+	return (x > y) - (x < y);
+}
+
+static word_id_t find_cluster(word_id_t * restrict parent, word_id_t word) { // Union-find, with path halving
+	while (parent[word] != word) {
+		parent[word] = parent[parent[word]];
+		word = parent[word];
+	}
+	return word;
+}
+
+static void set_bitstrings(const wclass_t num_classes, const unsigned int children[const][2], const unsigned int root, unsigned int leaf_class[restrict], char * class_bitstrings[restrict]) {
+	// Walks the tree with 0 for the first child and 1 for the second.  Leaves are numbered in the order they're reached, so classes sort like their bitstrings
+	struct { unsigned int node, depth; char bit; } * stack = malloc(sizeof(*stack) * (2 * (size_t)num_classes + 1));
+	char * restrict path = malloc((size_t)num_classes + 1);
+	size_t stack_size = 0;
+	wclass_t next_class = 0;
+	stack[stack_size].node = root, stack[stack_size].depth = 0, stack[stack_size++].bit = '\0';
+	while (stack_size) {
+		const unsigned int node = stack[--stack_size].node, depth = stack[stack_size].depth;
+		if (depth)
+			path[depth-1] = stack[stack_size].bit;
+		if (node < num_classes) { // A leaf
+			leaf_class[node] = next_class;
+			class_bitstrings[next_class] = malloc(depth + 1);
+			memcpy(class_bitstrings[next_class], path, depth);
+			class_bitstrings[next_class++][depth] = '\0';
+		} else {
+			stack[stack_size].node = children[node - num_classes][1], stack[stack_size].depth = depth + 1, stack[stack_size++].bit = '1';
+			stack[stack_size].node = children[node - num_classes][0], stack[stack_size].depth = depth + 1, stack[stack_size++].bit = '0';
+		}
+	}
+	free(path);
+	free(stack);
+}
+
+static void merge_into_tree(struct_brown_clusters * restrict clusters, const wclass_t num_classes, const unsigned int num_threads, wclass_t slot_class[restrict], char * class_bitstrings[restrict]) {
+	// Merges the num_classes active clusters down to one.  slot_class gives each of their slots its class, numbered in the order of the bitstrings
+	unsigned int (* children)[2] = malloc(sizeof(*children) * num_classes);
+	unsigned int * restrict slot_node = malloc(sizeof(unsigned int) * clusters->size);
+	unsigned int * restrict slot_leaf = malloc(sizeof(unsigned int) * clusters->size);
+	for (unsigned int i = 0; i < clusters->num_active; i++) // The leaves are numbered in order of their slots, and the merges come after them
+		slot_node[clusters->active[i]] = slot_leaf[clusters->active[i]] = i;
+	unsigned int * restrict leaf_slot = malloc(sizeof(unsigned int) * num_classes);
+	memcpy(leaf_slot, clusters->active, sizeof(unsigned int) * num_classes);
+
+	unsigned int root = 0;
+	for (unsigned int merge = 0; clusters->num_active > 1; merge++) {
+		unsigned int s, t;
+		best_merge(clusters, &s, &t);
+		merge_clusters(clusters, s, t, num_threads);
+		children[merge][0] = slot_node[s];
+		children[merge][1] = slot_node[t];
+		root = slot_node[s] = num_classes + merge;
+	}
+
+	unsigned int * restrict leaf_class = malloc(sizeof(unsigned int) * num_classes);
+	set_bitstrings(num_classes, (const unsigned int (*)[2])children, root, leaf_class, class_bitstrings);
+	for (wclass_t leaf = 0; leaf < num_classes; leaf++)
+		slot_class[leaf_slot[leaf]] = leaf_class[leaf];
+
+	free(leaf_class);
+	free(leaf_slot);
+	free(slot_leaf);
+	free(slot_node);
+	free(children);
+}
+
+void brown_cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_count_t word_counts[const], wclass_t word2class[restrict], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, char * class_bitstrings[restrict]) {
+	// Sets word2class, and class_bitstrings[class] for each of the num_classes classes
+	const word_id_t type_count = model_metadata.type_count;
+	const wclass_t num_classes = cmd_args.num_classes;
+	const unsigned int num_threads = cmd_args.num_threads ? cmd_args.num_threads : 1;
+	double total = 0;
+	for (word_id_t word = 0; word < type_count; word++) {
+		const struct_word_bigram_cell * restrict cells = word_bigram_cells(word_bigrams, word);
+		const size_t length = word_bigram_length(word_bigrams, word);
+		for (size_t i = 0; i < length; i++)
+			total += cells[i].count;
+	}
+
+	word_id_t * restrict order = malloc(sizeof(word_id_t) * type_count);
+	for (word_id_t word = 0; word < type_count; word++)
+		order[word] = word;
+	sort_word_counts = word_counts; // Word ids are already by frequency, unless --reorder-words changed them
+	qsort(order, type_count, sizeof(word_id_t), compare_words_by_count);
+
+	// Each word points to another in its cluster, or to itself if it's the one that stands for the cluster
+	word_id_t * restrict parent = malloc(sizeof(word_id_t) * type_count);
+	unsigned int * restrict word_slot = malloc(sizeof(unsigned int) * type_count); // Of the word that stands for a cluster
+	word_id_t * restrict slot_word = malloc(sizeof(word_id_t) * ((size_t)num_classes + 1));
+	bool * restrict added = calloc(type_count, sizeof(bool));
+
+	struct_brown_clusters clusters;
+	init_brown_clusters(&clusters, (unsigned int)num_classes + 1, total);
+	const size_t size = clusters.size;
+	unsigned int free_slot = 0;
+	for (word_id_t word_i = 0; word_i < type_count; word_i++) {
+		const word_id_t word = order[word_i];
+		const unsigned int slot = free_slot;
+		parent[word] = word;
+		word_slot[word] = slot;
+		slot_word[slot] = word;
+		added[word] = true;
+		for (unsigned int i = 0; i < clusters.num_active; i++) {
+			clusters.counts[slot*size + clusters.active[i]] = 0;
+			clusters.counts[clusters.active[i]*size + slot] = 0;
+		}
+		clusters.counts[slot*size + slot] = 0;
+		clusters.unigrams[slot] = word_counts[word];
+
+		// Bigrams with the words already added.  One with itself is a predecessor and a successor, so it's only counted from the predecessors
+		const struct_word_bigram_cell * restrict cells = word_bigram_cells(word_bigrams, word);
+		size_t length = word_bigram_length(word_bigrams, word);
+		for (size_t i = 0; i < length; i++)
+			if (added[cells[i].word])
+				clusters.counts[word_slot[find_cluster(parent, cells[i].word)]*size + slot] += cells[i].count;
+		cells  = word_bigram_cells(word_bigrams_rev, word);
+		length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < length; i++)
+			if (added[cells[i].word]  &&  cells[i].word != word)
+				clusters.counts[slot*size + word_slot[find_cluster(parent, cells[i].word)]] += cells[i].count;
+
+		add_cluster(&clusters, slot, num_threads);
+		free_slot++;
+		if (clusters.num_active > num_classes) { // The window is full
+			unsigned int s, t;
+			best_merge(&clusters, &s, &t);
+			merge_clusters(&clusters, s, t, num_threads);
+			const word_id_t word_s = slot_word[s], word_t = slot_word[t];
+			parent[word_t] = word_s;
+			free_slot = t;
+		}
+		if (cmd_args.verbose >= 1  &&  (word_i+1) % 1000 == 0) {
+			fprintf(stderr, "%s: Brown clustering: added %'u of %'u words\n", argv_0_basename, word_i+1, type_count); fflush(stderr);
+		}
+	}
+
+	wclass_t * restrict slot_class = malloc(sizeof(wclass_t) * size);
+	merge_into_tree(&clusters, num_classes, num_threads, slot_class, class_bitstrings);
+	for (word_id_t word = 0; word < type_count; word++)
+		word2class[word] = slot_class[word_slot[find_cluster(parent, word)]];
+	if (cmd_args.verbose >= -1) {
+		fprintf(stderr, "%s: Brown clustering merged %'u words into %'u classes, with %'u merges for the tree over them\n", argv_0_basename, type_count, num_classes, num_classes - 1); fflush(stderr);
+	}
+
+	free(slot_class);
+	free_brown_clusters(&clusters);
+	free(added);
+	free(slot_word);
+	free(word_slot);
+	free(parent);
+	free(order);
+}
+
+typedef struct {
+	const char * word;
+	word_count_t count;
+	wclass_t class;
+} struct_bitstring_line;
+
+static int compare_bitstring_lines(const void * a, const void * b) { // By class, which sorts like its bitstring, then by count (descending), then by word
+	const struct_bitstring_line * const x = a, * const y = b;
+	if (x->class != y->class)
+		return x->class < y->class ? -1 : 1;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return strcmp(x->word, y->word);
+}
+
+void print_words_and_bitstrings(FILE * out_file, const word_id_t type_count, char * word_list[const], const word_count_t word_counts[const], const wclass_t word2class[const], char * class_bitstrings[const]) {
+	// Like the paths file of Liang's wcluster:  bitstring, word, and count, tab-separated
+	struct_bitstring_line * restrict lines = malloc(sizeof(struct_bitstring_line) * type_count);
+	for (word_id_t word = 0; word < type_count; word++)
+		lines[word] = (struct_bitstring_line){ .word = word_list[word], .count = word_counts[word], .class = word2class[word] };
+	qsort(lines, type_count, sizeof(struct_bitstring_line), compare_bitstring_lines);
+	for (word_id_t i = 0; i < type_count; i++)
+		fprintf(out_file, "%s\t%s\t%lu\n", class_bitstrings[lines[i].class], lines[i].word, (unsigned long)lines[i].count);
+	free(lines);
+}
+
+void brown_merge_classes(const struct cmd_args cmd_args, const double class_bigrams[const], const double class_counts[const], wclass_t class_order[restrict], char * class_bitstrings[restrict]) {
+	// Builds the tree over finished classes, from their bigram counts, class_bigrams[c_1 * num_classes + c_2].  class_order gives each class' new number, in the order of the bitstrings
+	const wclass_t num_classes = cmd_args.num_classes;
+	const unsigned int num_threads = cmd_args.num_threads ? cmd_args.num_threads : 1;
+	double total = 0;
+	for (size_t i = 0; i < (size_t)num_classes * num_classes; i++)
+		total += class_bigrams[i];
+
+	struct_brown_clusters clusters;
+	init_brown_clusters(&clusters, num_classes, total);
+	memcpy(clusters.counts, class_bigrams, sizeof(double) * num_classes * num_classes);
+	memcpy(clusters.unigrams, class_counts, sizeof(double) * num_classes);
+	for (wclass_t class = 0; class < num_classes; class++)
+		clusters.active[class] = class;
+	clusters.num_active = num_classes;
+
+	const size_t size = clusters.size;
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 8)
+	for (unsigned int a = 0; a < size; a++) {
+		for (unsigned int b = a; b < size; b++)
+			clusters.quality[a*size + b] = clusters.quality[b*size + a] = a == b ? brown_q(clusters.counts[a*size + a], clusters.unigrams[a], clusters.unigrams[a], total)
+			                                                                      : brown_pair_q(clusters.counts[a*size + b], clusters.counts[b*size + a], clusters.unigrams[a], clusters.unigrams[b], total);
+	}
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 8)
+	for (unsigned int a = 0; a < size; a++) {
+		for (unsigned int b = a+1; b < size; b++)
+			clusters.losses[a*size + b] = merge_loss(&clusters, a, b);
+		set_row_best(&clusters, a);
+	}
+
+	merge_into_tree(&clusters, num_classes, num_threads, class_order, class_bitstrings);
+	free_brown_clusters(&clusters);
+}
@@ -0,0 +1,10 @@
+#ifndef INCLUDE_CLUSTERCAT_BROWN_HEADER
+#define INCLUDE_CLUSTERCAT_BROWN_HEADER
+
+#include "clustercat.h"
+
+void brown_cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_count_t word_counts[const], wclass_t word2class[restrict], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, char * class_bitstrings[restrict]);
+void brown_merge_classes(const struct cmd_args cmd_args, const double class_bigrams[const], const double class_counts[const], wclass_t class_order[restrict], char * class_bitstrings[restrict]);
+void print_words_and_bitstrings(FILE * out_file, const word_id_t type_count, char * word_list[const], const word_count_t word_counts[const], const wclass_t word2class[const], char * class_bitstrings[const]);
+
+#endif // INCLUDE_HEADER
@@ -0,0 +1,352 @@
+#define _POSIX_C_SOURCE 200112L // mmap(), fstat()
+#include <stdio.h>
+#include <fcntl.h>		// open()
+#include <unistd.h>		// close()
+#include <sys/mman.h>	// mmap()
+#include <sys/stat.h>	// fstat()
+#include "clustercat.h"
+#include "clustercat-map.h"
+#include "clustercat-cache.h"
+
+#define CACHE_HASH_CHUNK (1 << 24) // Bytes of the corpus that each thread hashes at a time
+
+static uint64_t cache_type_sizes(void) {
+	return (uint64_t)sizeof(word_id_t) | (uint64_t)sizeof(word_count_t) << 8 | (uint64_t)sizeof(word_bigram_count_t) << 16 | (uint64_t)sizeof(sentlen_t) << 24 | (uint64_t)sizeof(size_t) << 32;
+}
+
+static uint64_t hash_bytes(const unsigned char * restrict data, size_t length, uint64_t hash) { // Just for noticing a changed corpus, not for hash tables
+	for (; length >= 8; data += 8, length -= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
+	}
+	for (; length; data++, length--)
+		hash = (hash ^ *data) * 0x100000001B3ULL;
+	return hash;
+}
+
+static bool stat_input_file(const char * restrict file_name, const unsigned int num_threads, uint64_t * restrict size, int64_t * restrict mtime, uint64_t * restrict hash) {
+	// Fills in the corpus file's size and modification time, and if hash isn't NULL, a hash of its contents.  Each chunk is hashed by itself, so the chunks can be
+	// hashed in parallel, and the chunk hashes are then hashed in order.  Returns false if the file can't be read, or isn't a regular file
+	const int fd = open(file_name, O_RDONLY);
+	struct stat file_stat;
+	if (fd < 0  ||  fstat(fd, &file_stat)  ||  !S_ISREG(file_stat.st_mode)) {
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	*size  = file_stat.st_size;
+	*mtime = file_stat.st_mtime;
+	if (hash == NULL  ||  *size == 0) {
+		if (hash)
+			*hash = 0;
+		close(fd);
+		return true;
+	}
+
+	const unsigned char * restrict data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ((void *)data == MAP_FAILED)
+		return false;
+	const size_t num_chunks = (*size + CACHE_HASH_CHUNK - 1) / CACHE_HASH_CHUNK;
+	uint64_t * restrict chunk_hashes = malloc(sizeof(uint64_t) * num_chunks);
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+	for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+		const size_t start = chunk * CACHE_HASH_CHUNK;
+		const size_t length = *size - start < CACHE_HASH_CHUNK ? *size - start : CACHE_HASH_CHUNK;
+		chunk_hashes[chunk] = hash_bytes(data + start, length, chunk);
+	}
+	*hash = hash_bytes((const unsigned char *)chunk_hashes, sizeof(uint64_t) * num_chunks, *size);
+	free(chunk_hashes);
+	munmap((void *)data, *size);
+	return true;
+}
+
+static bool stat_input(const struct_corpus_files * restrict files, const unsigned int num_threads, uint64_t * restrict size, int64_t * restrict mtime, uint64_t * restrict hash) {
+	// Like stat_input_file(), for all the corpus files:  their total size, the newest modification time, and a hash of their hashes, in order.  A single file's
+	// are just its own.  Several files are hashed in parallel, each by one thread
+	if (files->num_files == 1)
+		return stat_input_file(files->names[0], num_threads, size, mtime, hash);
+
+	uint64_t * restrict file_hashes = malloc(sizeof(uint64_t) * 2 * files->num_files); // Each file's size and hash
+	int64_t newest = 0;
+	bool readable = true;
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1) reduction(max:newest) reduction(&&:readable)
+	for (size_t file_i = 0; file_i < files->num_files; file_i++) {
+		int64_t file_mtime = 0;
+		file_hashes[2*file_i+1] = 0;
+		readable = stat_input_file(files->names[file_i], 1, &file_hashes[2*file_i], &file_mtime, hash ? &file_hashes[2*file_i+1] : NULL)  &&  readable;
+		newest = file_mtime > newest ? file_mtime : newest;
+	}
+	*size = 0;
+	for (size_t file_i = 0; file_i < files->num_files; file_i++)
+		*size += file_hashes[2*file_i];
+	*mtime = newest;
+	if (hash)
+		*hash = hash_bytes((const unsigned char *)file_hashes, sizeof(uint64_t) * 2 * files->num_files, files->num_files);
+	free(file_hashes);
+	return readable;
+}
+
+static void cache_notice(const char * restrict cache_file_name, const char * restrict reason) {
+	fprintf(stderr, "%s: Notice: Not using the cache in \"%s\": %s.  Reading the corpus instead\n", argv_0_basename, cache_file_name, reason); fflush(stderr);
+}
+
+bool load_corpus_cache(const char * restrict cache_file_name, const struct_corpus_files * restrict in_files, const struct cmd_args cmd_args, struct_corpus_cache * restrict cache) {
+	// Maps the cache file, and checks it against the corpus and the command-line arguments.  Returns false, with a notice saying why, if it can't be used
+	*cache = (struct_corpus_cache){0};
+	const int fd = open(cache_file_name, O_RDONLY);
+	struct stat file_stat;
+	if (fd < 0  ||  fstat(fd, &file_stat)) {
+		if (fd >= 0)
+			close(fd);
+		cache_notice(cache_file_name, "it can't be opened");
+		return false;
+	}
+	if ((size_t)file_stat.st_size < sizeof(struct_corpus_cache_header)) {
+		close(fd);
+		cache_notice(cache_file_name, "it's too short");
+		return false;
+	}
+	cache->mapping_length = file_stat.st_size;
+	cache->mapping = mmap(NULL, cache->mapping_length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->mapping == MAP_FAILED) {
+		cache->mapping = NULL;
+		cache_notice(cache_file_name, "it can't be mapped");
+		return false;
+	}
+
+	const struct_corpus_cache_header * restrict header = cache->header = cache->mapping;
+	const char * reason = NULL;
+	if (memcmp(header->magic, CORPUS_CACHE_MAGIC, sizeof(header->magic)))
+		reason = "it isn't a clustercat cache file";
+	else if (header->version != CORPUS_CACHE_VERSION  ||  header->type_sizes != cache_type_sizes())
+		reason = "it's from an incompatible version or build of clustercat";
+	for (int section = 0; reason == NULL  &&  section < CACHE_NUM_SECTIONS; section++)
+		if (header->section_offsets[section] > cache->mapping_length  ||  header->section_lengths[section] > cache->mapping_length - header->section_offsets[section])
+			reason = "it's truncated";
+	const bool whole_corpus = header->line_count < header->max_tune_sents  &&  header->line_count < cmd_args.max_tune_sents; // Then --tune-sents didn't matter
+	if (reason == NULL  &&  header->max_tune_sents != cmd_args.max_tune_sents  &&  !whole_corpus)
+		reason = "it was saved with a different --tune-sents";
+	cache->has_sents = header->section_lengths[CACHE_SENT_WORDS] > 0;
+	if (reason == NULL  &&  !cache->has_sents  &&  header->min_count != cmd_args.min_count)
+		reason = "it was saved with --stream, so it has no sentences for rebuilding the bigrams with a different --min-count";
+	if (reason == NULL  &&  !cache->has_sents  &&  cmd_args.verify_every)
+		reason = "it was saved with --stream, so it has no sentences for --verify-every";
+
+	uint64_t size, hash;
+	int64_t mtime;
+	if (reason == NULL  &&  !stat_input(in_files, 1, &size, &mtime, NULL))
+		reason = "a corpus file can't be read";
+	else if (reason == NULL  &&  (size != header->input_size  ||  mtime != header->input_mtime))
+		reason = "the corpus files' size or modification time has changed";
+	else if (reason == NULL  &&  (!stat_input(in_files, cmd_args.num_threads ? cmd_args.num_threads : 1, &size, &mtime, &hash)  ||  hash != header->input_hash))
+		reason = "the corpus files' contents have changed";
+	if (reason) {
+		cache_notice(cache_file_name, reason);
+		close_corpus_cache(cache);
+		return false;
+	}
+
+	const char * restrict base = cache->mapping;
+	cache->vocab_counts      = (const word_count_t *)(base + header->section_offsets[CACHE_VOCAB_COUNTS]);
+	cache->vocab_key_offsets = (const uint64_t *)(base + header->section_offsets[CACHE_VOCAB_KEY_OFFSETS]);
+	cache->vocab_keys        = base + header->section_offsets[CACHE_VOCAB_KEYS];
+	cache->sent_lengths      = (const sentlen_t *)(base + header->section_offsets[CACHE_SENT_LENGTHS]);
+	cache->sent_words        = (const word_id_t *)(base + header->section_offsets[CACHE_SENT_WORDS]);
+	cache->word_bigrams = (struct_word_bigram_listing){ .offsets = (size_t *)(base + header->section_offsets[CACHE_BIGRAM_OFFSETS]), .cells = (struct_word_bigram_cell *)(base + header->section_offsets[CACHE_BIGRAM_CELLS]), .block = NULL, .num_cells = header->num_bigrams, .num_words = header->type_count };
+	cache->word_bigrams_rev = (struct_word_bigram_listing){ .offsets = (size_t *)(base + header->section_offsets[CACHE_BIGRAM_REV_OFFSETS]), .cells = (struct_word_bigram_cell *)(base + header->section_offsets[CACHE_BIGRAM_REV_CELLS]), .block = NULL, .num_cells = header->num_bigrams, .num_words = header->type_count };
+	posix_madvise(cache->mapping, cache->mapping_length, POSIX_MADV_WILLNEED);
+	return true;
+}
+
+void cache_vocab_to_map(const struct_corpus_cache * restrict cache, struct_map_word_table * restrict map) { // In the same order that parse_corpus() added the words
+	for (word_id_t word = 0; word < cache->header->vocab_size; word++)
+		map_add_entry(map, cache->vocab_keys + cache->vocab_key_offsets[word], cache->vocab_counts[word]);
+}
+
+size_t cache_sent_store(const struct_corpus_cache * restrict cache, const struct_map_word_table * restrict map, const unsigned int num_threads, struct_sent_int_info * restrict * sent_store_int) {
+	// Builds a sentence store with the word ids from map, which has been filtered and has its word ids by now.  Returns its memusage
+	const unsigned long line_count = cache->header->line_count;
+	const size_t num_words = cache->header->section_lengths[CACHE_SENT_WORDS] / sizeof(word_id_t);
+	word_id_t * restrict cache2map = malloc(sizeof(word_id_t) * (cache->header->vocab_size ? cache->header->vocab_size : 1));
+	const word_id_t unk_id = map_find_int(map, UNKNOWN_WORD);
+	for (word_id_t word = 0; word < cache->header->vocab_size; word++) {
+		const char * restrict key = cache->vocab_keys + cache->vocab_key_offsets[word];
+		const size_t key_len = strlen(key);
+		const struct_map_word * restrict entry = map_lookup(map, key, key_len, map_hash(key, key_len));
+		cache2map[word] = entry ? entry->word_id : unk_id; // Filtered words become <unk>
+	}
+
+	struct_sent_int_info * restrict sents = malloc(sizeof(struct_sent_int_info) * (line_count ? line_count : 1));
+	word_id_t * restrict words = malloc(sizeof(word_id_t) * (num_words ? num_words : 1));
+	if (sents == NULL  ||  words == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for sent_store_int.  Reduce --tune-sents (current value: %lu), or use --stream\n", argv_0_basename, (unsigned long)cache->header->max_tune_sents); fflush(stderr);
+		exit(8);
+	}
+	size_t pos = 0;
+	for (unsigned long line = 0; line < line_count; line++) {
+		sents[line].sent   = words + pos;
+		sents[line].length = cache->sent_lengths[line];
+		pos += sents[line].length;
+	}
+
+	#pragma omp parallel for num_threads(num_threads) schedule(static)
+	for (size_t i = 0; i < num_words; i++)
+		words[i] = cache2map[cache->sent_words[i]];
+
+	free(cache2map);
+	*sent_store_int = sents;
+	return sizeof(struct_sent_int_info) * line_count + sizeof(word_id_t) * num_words;
+}
+
+void close_corpus_cache(struct_corpus_cache * restrict cache) {
+	if (cache->mapping)
+		munmap(cache->mapping, cache->mapping_length);
+	*cache = (struct_corpus_cache){0};
+}
+
+
+static void write_cache_section(struct_corpus_cache_writer * restrict writer, const int section, const void * restrict data, const size_t length) {
+	static const char padding[64] = {0};
+	long offset = ftell(writer->file);
+	if (offset % 64)
+		offset += fwrite(padding, 1, 64 - offset % 64, writer->file);
+	writer->header.section_offsets[section] = offset;
+	writer->header.section_lengths[section] = length;
+	if (length  &&  fwrite(data, 1, length, writer->file) != length) {
+		fprintf(stderr,  "%s: Error: Unable to write cache file \"%s\"\n", argv_0_basename, writer->temp_file_name); fflush(stderr);
+		exit(15);
+	}
+}
+
+void begin_corpus_cache(struct_corpus_cache_writer * restrict writer, const char * restrict cache_file_name, const struct_corpus_files * restrict in_files, const struct cmd_args cmd_args) {
+	// The cache is written to a temporary file next to it, which replaces any old cache once it's complete
+	*writer = (struct_corpus_cache_writer){0};
+	memcpy(writer->header.magic, CORPUS_CACHE_MAGIC, sizeof(writer->header.magic));
+	writer->header.version        = CORPUS_CACHE_VERSION;
+	writer->header.type_sizes     = cache_type_sizes();
+	writer->header.max_tune_sents = cmd_args.max_tune_sents;
+	if (!stat_input(in_files, cmd_args.num_threads ? cmd_args.num_threads : 1, &writer->header.input_size, &writer->header.input_mtime, &writer->header.input_hash)) {
+		fprintf(stderr,  "%s: Error: --save-cache needs the corpus to be regular files, but \"%s\"%s isn't\n", argv_0_basename, in_files->names[0], in_files->num_files > 1 ? " or another --in file" : ""); fflush(stderr);
+		exit(15);
+	}
+
+	writer->file_name = malloc(strlen(cache_file_name) + 1);
+	strcpy(writer->file_name, cache_file_name);
+	writer->temp_file_name = malloc(strlen(cache_file_name) + 5);
+	sprintf(writer->temp_file_name, "%s.tmp", cache_file_name);
+	if ((writer->file = fopen(writer->temp_file_name, "wb")) == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to create cache file \"%s\"\n", argv_0_basename, writer->temp_file_name); fflush(stderr);
+		exit(15);
+	}
+	fwrite(&writer->header, sizeof(writer->header), 1, writer->file); // Filled in at the end
+}
+
+void save_cache_corpus(struct_corpus_cache_writer * restrict writer, struct_map_word_table * restrict map, const struct_sent_int_info sent_store_int[const], struct_corpus_shard shards[const], const unsigned int num_shards, const struct_model_metadata model_metadata) {
+	// Writes the vocabulary as it is before filtering, in insertion order, then the sentence store (if there is one) in terms of that vocabulary.
+	// Call this right after parse_corpus(), while the sentences still have the shards' local word ids.  This sets map's word ids to vocabulary positions
+	const word_id_t vocab_size = map_count(map);
+	word_count_t * restrict counts = malloc(sizeof(word_count_t) * (vocab_size ? vocab_size : 1));
+	uint64_t * restrict key_offsets = malloc(sizeof(uint64_t) * ((size_t)vocab_size + 1));
+	key_offsets[0] = 0;
+	word_id_t word = 0;
+	for (word_id_t i = 0; i < map->num_entries; i++) {
+		struct_map_word * restrict entry = &map->entries[i];
+		if (entry->deleted)
+			continue;
+		entry->word_id = word;
+		counts[word] = entry->count;
+		key_offsets[word+1] = key_offsets[word] + entry->key_len + 1;
+		word++;
+	}
+	char * restrict keys = malloc(key_offsets[vocab_size] ? key_offsets[vocab_size] : 1);
+	word = 0;
+	for (word_id_t i = 0; i < map->num_entries; i++) {
+		if (map->entries[i].deleted)
+			continue;
+		memcpy(keys + key_offsets[word], map->entries[i].key, map->entries[i].key_len + 1);
+		word++;
+	}
+	writer->header.vocab_size  = vocab_size;
+	writer->header.line_count  = model_metadata.line_count;
+	writer->header.token_count = model_metadata.token_count;
+	write_cache_section(writer, CACHE_VOCAB_COUNTS, counts, sizeof(word_count_t) * vocab_size);
+	write_cache_section(writer, CACHE_VOCAB_KEY_OFFSETS, key_offsets, sizeof(uint64_t) * ((size_t)vocab_size + 1));
+	write_cache_section(writer, CACHE_VOCAB_KEYS, keys, key_offsets[vocab_size]);
+	free(counts);
+	free(key_offsets);
+	free(keys);
+
+	if (sent_store_int == NULL) { // --stream
+		write_cache_section(writer, CACHE_SENT_LENGTHS, NULL, 0);
+		write_cache_section(writer, CACHE_SENT_WORDS, NULL, 0);
+		return;
+	}
+
+	const unsigned long line_count = model_metadata.line_count;
+	sentlen_t * restrict lengths = malloc(sizeof(sentlen_t) * (line_count ? line_count : 1));
+	size_t * restrict line_offsets = malloc(sizeof(size_t) * (line_count + 1));
+	line_offsets[0] = 0;
+	for (unsigned long line = 0; line < line_count; line++) {
+		lengths[line] = sent_store_int[line].length;
+		line_offsets[line+1] = line_offsets[line] + lengths[line];
+	}
+	word_id_t * restrict words = malloc(sizeof(word_id_t) * (line_offsets[line_count] ? line_offsets[line_count] : 1));
+	if (words == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for saving the sentence store to the cache\n", argv_0_basename); fflush(stderr);
+		exit(8);
+	}
+	const word_id_t start_id = map_find_int(map, "<s>");
+	const word_id_t end_id   = map_find_int(map, "</s>");
+
+	#pragma omp parallel for num_threads(num_shards)
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+		const struct_corpus_shard * restrict shard = &shards[shard_i];
+		word_id_t * restrict local2cache = malloc(sizeof(word_id_t) * (shard->num_types ? shard->num_types : 1));
+		for (word_id_t local_id = 0; local_id < shard->vocab.num_entries; local_id++) {
+			const struct_map_word * restrict local_entry = &shard->vocab.entries[local_id];
+			local2cache[local_id] = map_lookup(map, local_entry->key, local_entry->key_len, local_entry->hash)->word_id;
+		}
+
+		for (unsigned long line = shard->line_start; line < shard->line_end; line++) {
+			const word_id_t * restrict sent = sent_store_int[line].sent;
+			word_id_t * restrict cached = words + line_offsets[line];
+			const sentlen_t sent_length = sent_store_int[line].length;
+			cached[0] = start_id;
+			for (sentlen_t w_i = 1; w_i < sent_length - 1; w_i++)
+				cached[w_i] = local2cache[sent[w_i]];
+			cached[sent_length-1] = end_id;
+		}
+		free(local2cache);
+	}
+
+	write_cache_section(writer, CACHE_SENT_LENGTHS, lengths, sizeof(sentlen_t) * line_count);
+	write_cache_section(writer, CACHE_SENT_WORDS, words, sizeof(word_id_t) * line_offsets[line_count]);
+	free(lengths);
+	free(line_offsets);
+	free(words);
+}
+
+void save_cache_bigrams(struct_corpus_cache_writer * restrict writer, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const unsigned int min_count) {
+	// Writes the bigram listings, both of which are needed, and finishes the cache file
+	writer->header.min_count   = min_count;
+	writer->header.type_count  = word_bigrams->num_words;
+	writer->header.num_bigrams = word_bigrams->num_cells;
+	write_cache_section(writer, CACHE_BIGRAM_OFFSETS, word_bigrams->offsets, sizeof(size_t) * ((size_t)word_bigrams->num_words + 1));
+	write_cache_section(writer, CACHE_BIGRAM_CELLS, word_bigrams->cells, sizeof(struct_word_bigram_cell) * word_bigrams->num_cells);
+	write_cache_section(writer, CACHE_BIGRAM_REV_OFFSETS, word_bigrams_rev->offsets, sizeof(size_t) * ((size_t)word_bigrams_rev->num_words + 1));
+	write_cache_section(writer, CACHE_BIGRAM_REV_CELLS, word_bigrams_rev->cells, sizeof(struct_word_bigram_cell) * word_bigrams_rev->num_cells);
+
+	rewind(writer->file);
+	fwrite(&writer->header, sizeof(writer->header), 1, writer->file);
+	if (fclose(writer->file)  ||  rename(writer->temp_file_name, writer->file_name)) {
+		fprintf(stderr,  "%s: Error: Unable to write cache file \"%s\"\n", argv_0_basename, writer->file_name); fflush(stderr);
+		exit(15);
+	}
+	free(writer->file_name);
+	free(writer->temp_file_name);
+	*writer = (struct_corpus_cache_writer){0};
+}
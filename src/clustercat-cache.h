@@ -0,0 +1,66 @@
+#ifndef INCLUDE_CLUSTERCAT_CACHE
+#define INCLUDE_CLUSTERCAT_CACHE
+
+#include <stdio.h>
+#include <stdint.h>
+#include "clustercat.h"
+
+// A preprocessed corpus, so that later runs over the same corpus can skip reading, tokenizing, and counting it.  The file is memory-mapped when it's loaded, and
+// every section starts on a 64-byte boundary, so the bigram listings are used straight from the page cache.  The vocabulary and sentences are from before
+// --min-count filtering, so a cache also works for other --min-count values.  The bigram listings are for the --min-count the cache was saved with.
+// The file is in the machine's own byte order and type sizes, which the header records.
+
+#define CORPUS_CACHE_MAGIC   "CCATCACH"
+#define CORPUS_CACHE_VERSION 1
+
+enum { CACHE_VOCAB_COUNTS, CACHE_VOCAB_KEY_OFFSETS, CACHE_VOCAB_KEYS, CACHE_SENT_LENGTHS, CACHE_SENT_WORDS, CACHE_BIGRAM_OFFSETS, CACHE_BIGRAM_CELLS, CACHE_BIGRAM_REV_OFFSETS, CACHE_BIGRAM_REV_CELLS, CACHE_NUM_SECTIONS };
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t min_count;         // That the bigram listings were built with
+	uint64_t type_sizes;        // sizeof() word_id_t, word_count_t, word_bigram_count_t, sentlen_t, and size_t, a byte each
+	uint64_t input_size;        // Of the corpus file that the cache was made from
+	int64_t  input_mtime;
+	uint64_t input_hash;
+	uint64_t max_tune_sents;
+	uint64_t line_count;
+	uint64_t token_count;
+	uint64_t num_bigrams;
+	uint32_t vocab_size;        // Before filtering.  The sentences' word ids are positions in this vocabulary
+	uint32_t type_count;        // After filtering, for the bigram listings
+	uint64_t section_offsets[CACHE_NUM_SECTIONS];
+	uint64_t section_lengths[CACHE_NUM_SECTIONS]; // Bytes.  The sentence sections are empty if the cache was saved with --stream
+} struct_corpus_cache_header;
+
+typedef struct {
+	const struct_corpus_cache_header * header;
+	void * mapping;
+	size_t mapping_length;
+	const word_count_t * vocab_counts;
+	const uint64_t * vocab_key_offsets;  // vocab_size + 1 of these
+	const char * vocab_keys;             // Null-terminated
+	const sentlen_t * sent_lengths;
+	const word_id_t * sent_words;
+	struct_word_bigram_listing word_bigrams;     // These point into the mapping
+	struct_word_bigram_listing word_bigrams_rev;
+	bool has_sents;                      // Not if it was saved with --stream.  Then the run goes like one with --stream
+} struct_corpus_cache;
+
+typedef struct {
+	FILE * file;
+	char * file_name;
+	char * temp_file_name;      // Renamed to file_name once it's all written
+	struct_corpus_cache_header header;
+} struct_corpus_cache_writer;
+
+bool load_corpus_cache(const char * restrict cache_file_name, const struct_corpus_files * restrict in_files, const struct cmd_args cmd_args, struct_corpus_cache * restrict cache);
+void cache_vocab_to_map(const struct_corpus_cache * restrict cache, struct_map_word_table * restrict map);
+size_t cache_sent_store(const struct_corpus_cache * restrict cache, const struct_map_word_table * restrict map, const unsigned int num_threads, struct_sent_int_info * restrict * sent_store_int);
+void close_corpus_cache(struct_corpus_cache * restrict cache);
+
+void begin_corpus_cache(struct_corpus_cache_writer * restrict writer, const char * restrict cache_file_name, const struct_corpus_files * restrict in_files, const struct cmd_args cmd_args);
+void save_cache_corpus(struct_corpus_cache_writer * restrict writer, struct_map_word_table * restrict map, const struct_sent_int_info sent_store_int[const], struct_corpus_shard shards[const], const unsigned int num_shards, const struct_model_metadata model_metadata);
+void save_cache_bigrams(struct_corpus_cache_writer * restrict writer, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const unsigned int min_count);
+
+#endif // INCLUDE_HEADER
@@ -1,22 +1,72 @@
 #include <time.h>				// clock_t, clock(), CLOCKS_PER_SEC, etc.
 #include "clustercat-cluster.h"
 #include "clustercat-array.h"
+#include "clustercat-brown.h"
 
-float entropy_term(const float entropy_terms[const], const unsigned int i);
-double pex_remove_word(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const wclass_t from_class, wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move);
-double pex_move_word(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t to_class, wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move);
+static inline float entropy_term(const float entropy_terms[const], const unsigned int i);
+double pex_remove_word(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const wclass_t from_class, wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move);
+double pex_move_word(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t to_class, wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move);
+void pex_score_word_classes(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const wclass_t class_start, const wclass_t class_end, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double scores[restrict]);
+double pex_objective(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double * restrict log_prob);
+double pex_objective_move(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t from_class, const wclass_t to_class, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double * restrict log_prob);
+double class_bigram_log_prob(const struct_model_metadata model_metadata, const unsigned int word_counts[const], const wclass_t word2class[const], const count_array_t count_array, const double log_prob);
+size_t pex_word_cost(const struct cmd_args cmd_args, const word_id_t word, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev);
+size_t pex_candidate_bound(const struct cmd_args cmd_args, const word_id_t word, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts);
+bool pex_score_candidate_classes(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], wclass_t * restrict best_class, double * restrict best_score);
+double pex_score_word_class(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t class, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const]);
+bool pex_score_classes_bounded(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], wclass_t * restrict best_class, double * restrict best_score, unsigned long * restrict pruned);
+void pex_score_word_classes_tasks(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double scores[restrict]);
+word_id_t exchange_word_blocks(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const unsigned short cycle, const bool is_nonreversed_cycle, unsigned long * restrict steps, unsigned long * restrict pruned, double * restrict objective, double * restrict log_prob);
 
-inline float entropy_term(const float entropy_terms[const], const unsigned int i) {
-	if (i < ENTROPY_TERMS_MAX)
+static bool entropy_terms_full = false; // Set in build_entropy_terms().  Otherwise the table only has ENTROPY_TERMS_SMALL entries
+
+static inline float fast_n_log2_n(const unsigned int n) {
+	// n * log2(n), with n = m * 2^e and m in [sqrt(1/2),sqrt(2)).  Then log2(m) = 2/ln(2) * atanh(t), where t = (m-1)/(m+1) and |t| < 0.172,
+	// so five terms of the atanh series are plenty for float precision.  No branches or table lookups, so loops using this vectorize.
+	const float x = (float)n;
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	const bool high = (bits & 0x007FFFFF) > 0x003504F3; // mantissa > sqrt(2)
+	const int e = (int)(bits >> 23) - 127 + high;
+	bits = (bits & 0x007FFFFF) | (high ? 0x3F000000 : 0x3F800000);
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+	const double t  = (m - 1.0) / (m + 1.0);
+	const double t2 = t * t;
+	const double log2_m = 2.8853900817779268 * t * (1.0 + t2 * (1.0/3 + t2 * (1.0/5 + t2 * (1.0/7 + t2 * (1.0/9)))));
+	return x * (float)(e + log2_m);
+}
+
+static inline float entropy_term_compact(const float entropy_terms[const], const unsigned int i) { // Vectorizable version of entropy_term() for the compact table
+	const float computed = fast_n_log2_n(i);
+	return i < ENTROPY_TERMS_SMALL ? entropy_terms[i & (ENTROPY_TERMS_SMALL-1)] : computed;
+}
+
+static inline word_class_count_t row_max(const word_class_count_t row[const], const wclass_t class_start, const wclass_t class_end) {
+	word_class_count_t row_max = 0;
+	#pragma omp simd reduction(max:row_max)
+	for (wclass_t class = class_start; class < class_end; class++)
+		row_max = row[class] > row_max ? row[class] : row_max;
+	return row_max;
+}
+
+static inline float entropy_term(const float entropy_terms[const], const unsigned int i) {
+	if (i < ENTROPY_TERMS_SMALL  ||  (entropy_terms_full && i < ENTROPY_TERMS_MAX))
 		return entropy_terms[i];
-	else
+	else if (entropy_terms_full)
 		return i * log2f(i);
+	else
+		return fast_n_log2_n(i);
 }
 
-inline double pex_remove_word(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const wclass_t from_class, wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move) {
+double pex_remove_word(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const wclass_t from_class, wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move) {
 	// See Procedure MoveWord on page 758 of Uszkoreit & Brants (2008):  https://www.aclweb.org/anthology/P/P08/P08-1086.pdf
 	register double delta = 0.0;
 	const unsigned int count_class = count_array[from_class];
+	if (count_class < word_count) { // Shouldn't happen:  the class counts and word_counts[] are tallied from the same tokens
+		fprintf(stderr, "%s: Error: count(class %u)=%u < count(word %u)=%u, so moving the word out would wrap the class count\n", argv_0_basename, from_class, count_class, word, word_count); fflush(stderr);
+		exit(5);
+	}
 	if (count_class > 1)
 		delta = entropy_term(entropy_terms, count_class);
 	const unsigned int new_count_class = count_class - word_count;
@@ -27,51 +77,56 @@ inline double pex_remove_word(const struct cmd_args cmd_args, const struct_model
 	if (! is_tentative_move)
 		count_array[from_class] = new_count_class;
 
-	for (unsigned int i = 0; i < word_bigrams[word].length; i++) {
-		word_id_t prev_word = word_bigrams[word].words[i];
-		//printf(" rm43: i=%u, len=%u, word=%u, offset=%u (prev_word=%u + num_classes=%u * from_class=%u)\n", i, word_bigrams[word].length, word,  (prev_word * cmd_args.num_classes + from_class), prev_word, cmd_args.num_classes, from_class); fflush(stdout);
-		const unsigned int word_class_count = word_class_counts[prev_word * cmd_args.num_classes + from_class];
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	for (size_t i = 0; i < prev_length; i++) {
+		word_id_t prev_word = prev_cells[i].word;
+		//printf(" rm43: i=%u, len=%u, word=%u, offset=%u (prev_word=%u + num_classes=%u * from_class=%u)\n", i, prev_length, word,  (prev_word * cmd_args.num_classes + from_class), prev_word, cmd_args.num_classes, from_class); fflush(stdout);
+		const unsigned int word_class_count = word_class_count_find(word_class_counts, prev_word, from_class);
 		if (word_class_count > 1) // Can't do log(0); no need for 1
 			delta -= entropy_term(entropy_terms, word_class_count);
-		const unsigned int new_word_class_count = word_class_count - word_bigrams[word].counts[i];
+		const unsigned int new_word_class_count = word_class_count - prev_cells[i].count;
 		delta += entropy_term(entropy_terms, new_word_class_count);
-		//printf(" rm45: word=%u (#=%u), prev_word=%u, #(<v,w>)=%u, from_class=%u, i=%u, count_class=%u, new_count_class=%u, <v,c>=<%u,%u>, #(<v,c>)=%u, new_#(<v,c>)=%u (w-c - %u), delta=%g\n", word, word_count, prev_word, word_bigrams[word].counts[i], from_class, i, count_class, new_count_class, prev_word, from_class, word_class_count, new_word_class_count, word_bigrams[word].counts[i], delta); fflush(stdout);
+		//printf(" rm45: word=%u (#=%u), prev_word=%u, #(<v,w>)=%u, from_class=%u, i=%u, count_class=%u, new_count_class=%u, <v,c>=<%u,%u>, #(<v,c>)=%u, new_#(<v,c>)=%u (w-c - %u), delta=%g\n", word, word_count, prev_word, prev_cells[i].count, from_class, i, count_class, new_count_class, prev_word, from_class, word_class_count, new_word_class_count, prev_cells[i].count, delta); fflush(stdout);
 		//print_word_class_counts(cmd_args, model_metadata, word_class_counts);
 		if (! is_tentative_move)
-			word_class_counts[prev_word * cmd_args.num_classes + from_class] = new_word_class_count;
+			word_class_count_set(word_class_counts, prev_word, from_class, new_word_class_count);
 
 	}
 
 	if (cmd_args.rev_alternate && (!is_tentative_move)) { // also update reversed word-class counts
-		for (unsigned int i = 0; i < word_bigrams_rev[word].length; i++) {
-			const word_id_t next_word = word_bigrams_rev[word].words[i];
-			const unsigned int word_class_rev_count = word_class_rev_counts[next_word * cmd_args.num_classes + from_class];
-			const unsigned int new_word_class_rev_count = word_class_rev_count - word_bigrams_rev[word].counts[i];
+		const struct_word_bigram_cell * restrict next_cells = word_bigram_cells(word_bigrams_rev, word);
+		const size_t next_length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < next_length; i++) {
+			const word_id_t next_word = next_cells[i].word;
+			const unsigned int word_class_rev_count = word_class_count_find(word_class_rev_counts, next_word, from_class);
+			const unsigned int new_word_class_rev_count = word_class_rev_count - next_cells[i].count;
 			//printf(" rm47: rev_next_word=%u, rev_#(<v,c>)=%u, rev_new_#(<v,c>)=%u\n", next_word, word_class_rev_count, new_word_class_rev_count); fflush(stdout);
 			//print_word_class_counts(cmd_args, model_metadata, word_class_rev_counts);
-			word_class_rev_counts[next_word * cmd_args.num_classes + from_class] = new_word_class_rev_count;
+			word_class_count_set(word_class_rev_counts, next_word, from_class, new_word_class_rev_count);
 		}
 	}
 
 	return delta;
 }
 
-inline double pex_move_word(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t to_class, wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move) {
+double pex_move_word(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t to_class, wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const bool is_tentative_move) {
 	// See Procedure MoveWord on page 758 of Uszkoreit & Brants (2008):  https://www.aclweb.org/anthology/P/P08/P08-1086.pdf
-	unsigned int count_class = count_array[to_class];
-	if (!count_class) // class is empty
-		count_class = 1;
+	const unsigned int count_class = count_array[to_class];
 	const unsigned int new_count_class = count_class + word_count; // Differs from paper: replace "-" with "+"
-	register double delta = entropy_term(entropy_terms, count_class)  -  entropy_term(entropy_terms, new_count_class);
+	const unsigned int scored_count_class = count_class ? count_class : 1; // An empty class is scored as if it held one token, but the count itself stays exact
+	register double delta = entropy_term(entropy_terms, scored_count_class)  -  entropy_term(entropy_terms, scored_count_class + word_count);
 	//printf("mv42: word=%u, word_count=%u, to_class=%u, count_class=%u, new_count_class=%u, delta=%g, is_tentative_move=%d\n", word, word_count, to_class, count_class, new_count_class, delta, is_tentative_move); fflush(stdout);
 
 	if (! is_tentative_move)
 		count_array[to_class] = new_count_class;
 
-	for (unsigned int i = 0; i < word_bigrams[word].length; i++) {
-		word_id_t prev_word = word_bigrams[word].words[i];
-		//printf(" mv43: i=%u, len=%u, word=%u, offset=%u (prev_word=%u + num_classes=%u * to_class=%u)\n", i, word_bigrams[word].length, word,  (prev_word * cmd_args.num_classes + to_class), prev_word, cmd_args.num_classes, to_class); fflush(stdout);
-		const unsigned int word_class_count = word_class_counts[prev_word * cmd_args.num_classes + to_class];
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	for (size_t i = 0; i < prev_length; i++) {
+		word_id_t prev_word = prev_cells[i].word;
+		//printf(" mv43: i=%u, len=%u, word=%u, offset=%u (prev_word=%u + num_classes=%u * to_class=%u)\n", i, prev_length, word,  (prev_word * cmd_args.num_classes + to_class), prev_word, cmd_args.num_classes, to_class); fflush(stdout);
+		const unsigned int word_class_count = word_class_count_find(word_class_counts, prev_word, to_class);
 		if (word_class_count > 1) { // Can't do log(0); no need for 1
 			if (cmd_args.unidirectional) {
 				delta -= entropy_term(entropy_terms, word_class_count);
@@ -79,7 +134,7 @@ inline double pex_move_word(const struct cmd_args cmd_args, const word_id_t word
 				delta -= entropy_term(entropy_terms, word_class_count) * 0.6;
 			}
 		}
-		const unsigned int new_word_class_count = word_class_count + word_bigrams[word].counts[i]; // Differs from paper: replace "-" with "+"
+		const unsigned int new_word_class_count = word_class_count + prev_cells[i].count; // Differs from paper: replace "-" with "+"
 		if (new_word_class_count > 1) { // Can't do log(0)
 			if (cmd_args.unidirectional) {
 				delta += entropy_term(entropy_terms, new_word_class_count);
@@ -89,262 +144,917 @@ inline double pex_move_word(const struct cmd_args cmd_args, const word_id_t word
 		}
 		//printf(" mv45: word=%u; prev_word=%u, to_class=%u, i=%u, word_count=%u, count_class=%u, new_count_class=%u, <v,c>=<%u,%hu>, #(<v,c>)=%u, new_#(<v,c>)=%u, delta=%g\n", word, prev_word, to_class, i, word_count, count_class, new_count_class, prev_word, to_class, word_class_count, new_word_class_count, delta); fflush(stdout);
 		if (! is_tentative_move)
-			word_class_counts[prev_word * cmd_args.num_classes + to_class] = new_word_class_count;
+			word_class_count_set(word_class_counts, prev_word, to_class, new_word_class_count);
 
 	}
 
 	if (cmd_args.rev_alternate) { // also update reversed word-class counts; reversed order of conditionals since the first clause here is more common in this function
-		for (unsigned int i = 0; i < word_bigrams_rev[word].length; i++) {
-			const word_id_t next_word = word_bigrams_rev[word].words[i];
-			const unsigned int word_class_rev_count = word_class_rev_counts[next_word * cmd_args.num_classes + to_class];
+		const struct_word_bigram_cell * restrict next_cells = word_bigram_cells(word_bigrams_rev, word);
+		const size_t next_length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < next_length; i++) {
+			const word_id_t next_word = next_cells[i].word;
+			const unsigned int word_class_rev_count = word_class_count_find(word_class_rev_counts, next_word, to_class);
 			if (word_class_rev_count > 1) // Can't do log(0); no need for 1
 				if (!cmd_args.unidirectional)
 					delta -= entropy_term(entropy_terms, word_class_rev_count) * 0.4;
 
-			const unsigned int new_word_class_rev_count = word_class_rev_count + word_bigrams_rev[word].counts[i];
+			const unsigned int new_word_class_rev_count = word_class_rev_count + next_cells[i].count;
 			if (new_word_class_rev_count > 1) // Can't do log(0); no need for 1
 				if (!cmd_args.unidirectional)
 					//delta += entropy_term(entropy_terms, word_class_rev_count) * 0.4;
 					delta += entropy_term(entropy_terms, new_word_class_rev_count) * 0.4;
 			//printf("word=%u, word_class_rev_count=%u, new_word_class_rev_count=%u, delta=%g\n", word, word_class_rev_count, new_word_class_rev_count, delta);
 			if (!is_tentative_move)
-				word_class_rev_counts[next_word * cmd_args.num_classes + to_class] = new_word_class_rev_count;
+				word_class_count_set(word_class_rev_counts, next_word, to_class, new_word_class_rev_count);
 		}
 	}
 
 	return delta;
 }
 
-void cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts) {
-	unsigned long steps = 0;
+static bool score_sparse_row(const struct_word_class_counts * restrict wcc, const word_id_t word, const unsigned int bigram_count, const double weight, const wclass_t class_start, const wclass_t class_end, const float entropy_terms[const], word_class_count_t row_buffer[restrict], double scores[restrict]) {
+	// A class that's not in word's sparse <v,c> row just gets the n*log2(n) term of bigram_count, so the row only needs its own classes scored one by one.
+	// Those are worked out before the shared term is added to every class, then put back, which keeps the additions for every class the same as in the full loop.
+	// Returns false, doing nothing, for dense rows and for sparse rows that aren't much shorter than the class range
+	const struct_word_class_row row = wcc->rows[word];
+	if (row.dense  ||  (size_t)row.length * CANDIDATE_CLASSES_SHARE > (size_t)(class_end - class_start))
+		return false;
 
-	if (cmd_args.class_algo == EXCHANGE  ||  cmd_args.class_algo == EXCHANGE_BROWN) { // Exchange algorithm: See Sven Martin, Jörg Liermann, Hermann Ney. 1998. Algorithms For Bigram And Trigram Word Clustering. Speech Communication 24. 19-37. http://citeseerx.ist.psu.edu/viewdoc/summary?doi=10.1.1.53.2354
-		// Get initial logprob
-		count_arrays_t count_arrays = malloc(cmd_args.max_array * sizeof(void *));
-		init_count_arrays(cmd_args, count_arrays);
-		tally_class_counts_in_store(cmd_args, sent_store_int, model_metadata, word2class, count_arrays);
+	const wclass_t * restrict classes = wcc->sparse_classes + row.offset;
+	const wclass_t length = word_class_row_values(wcc, word, row_buffer);
+	double row_scores[length + 1];
+	for (wclass_t i = 0; i < length; i++) {
+		const wclass_t class = classes[i];
+		if (class >= class_start  &&  class < class_end)
+			row_scores[i] = (scores[class] - entropy_term(entropy_terms, row_buffer[i]) * weight) + entropy_term(entropy_terms, row_buffer[i] + bigram_count) * weight;
+	}
+	const double shared_term = entropy_term(entropy_terms, bigram_count) * weight;
+	#pragma omp simd
+	for (wclass_t class = class_start; class < class_end; class++)
+		scores[class] += shared_term;
+	for (wclass_t i = 0; i < length; i++) {
+		const wclass_t class = classes[i];
+		if (class >= class_start  &&  class < class_end)
+			scores[class] = row_scores[i];
+	}
+	return true;
+}
 
-		// Build precomputed entropy terms
-		float * restrict entropy_terms = malloc(ENTROPY_TERMS_MAX * sizeof(float));
-		build_entropy_terms(cmd_args, entropy_terms, ENTROPY_TERMS_MAX);
+void pex_score_word_classes(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const wclass_t class_start, const wclass_t class_end, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double scores[restrict]) {
+	// Same as calling pex_move_word(..., is_tentative_move=true) for each class in [class_start,class_end), with the same order of additions per class, so the scores are identical.
+	// But here each predecessor list is walked only once, and its row of <v,c> counts (contiguous across classes) is scored for all classes at a time.
+	// The "> 1" checks in pex_move_word() are dropped, since entropy_terms[0] and entropy_terms[1] are both 0.
+	// Each <v,c> row is first widened from its narrow (or sparse) cells into row_buffer, so that every row is scored the same way.
+	const double weight     = cmd_args.unidirectional ? 1.0 : 0.6;
+	const double weight_rev = 0.4;
+	const bool compact      = !cmd_args.entropy_table;
+	const bool fits_table   = model_metadata.token_count < ENTROPY_TERMS_MAX; // No <v,c> count can be bigger than the number of tokens, so we can skip the range check in entropy_term()
+	word_class_count_t row_buffer[cmd_args.num_classes];
 
-		if (cmd_args.verbose > 3) {
-			printf("cluster(): 42: "); long unsigned int class_sum=0; for (wclass_t i = 0; i < cmd_args.num_classes; i++) {
-				printf("c_%u=%u, ", i, count_arrays[0][i]);
-				class_sum += count_arrays[0][i];
-			} printf("\nClass Sum=%lu; Corpus Tokens=%lu\n", class_sum, model_metadata.token_count); fflush(stdout);
+	for (wclass_t class = class_start; class < class_end; class++) {
+		unsigned int count_class = count_array[class];
+		if (!count_class) // class is empty
+			count_class = 1;
+		scores[class] = entropy_term(entropy_terms, count_class)  -  entropy_term(entropy_terms, count_class + word_count);
+	}
+
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	for (size_t i = 0; i < prev_length; i++) {
+		const word_id_t prev_word = prev_cells[i].word;
+		const unsigned int bigram_count = prev_cells[i].count;
+		if (score_sparse_row(word_class_counts, prev_word, bigram_count, weight, class_start, class_end, entropy_terms, row_buffer, scores))
+			continue;
+		const word_class_count_t * restrict row = word_class_row_expand(word_class_counts, prev_word, class_start, class_end, row_buffer);
+		if (compact  &&  row_max(row, class_start, class_end) + bigram_count >= ENTROPY_TERMS_SMALL) {
+			#pragma omp simd
+			for (wclass_t class = class_start; class < class_end; class++) {
+				scores[class] -= entropy_term_compact(entropy_terms, row[class]) * weight;
+				scores[class] += entropy_term_compact(entropy_terms, row[class] + bigram_count) * weight;
+			}
+		} else if (fits_table || compact) { // All of this row's terms are in the table
+			#pragma omp simd
+			for (wclass_t class = class_start; class < class_end; class++) {
+				scores[class] -= entropy_terms[row[class]] * weight;
+				scores[class] += entropy_terms[row[class] + bigram_count] * weight;
+			}
+		} else {
+			for (wclass_t class = class_start; class < class_end; class++) {
+				scores[class] -= entropy_term(entropy_terms, row[class]) * weight;
+				scores[class] += entropy_term(entropy_terms, row[class] + bigram_count) * weight;
+			}
 		}
-		double best_log_prob = query_int_sents_in_store(cmd_args, sent_store_int, model_metadata, word_counts, word2class, word_list, count_arrays, -1, 1);
-
-		if (cmd_args.verbose >= -1)
-			fprintf(stderr, "%s: Expected Steps:  %'lu (%'u word types x %'u classes x %'u cycles);  initial logprob=%g, PP=%g\n", argv_0_basename, (unsigned long)model_metadata.type_count * cmd_args.num_classes * cmd_args.tune_cycles, model_metadata.type_count, cmd_args.num_classes, cmd_args.tune_cycles, best_log_prob, perplexity(best_log_prob, (model_metadata.token_count - model_metadata.line_count))); fflush(stderr);
-
-		time_t time_start_cycles;
-		time(&time_start_cycles);
-		unsigned short cycle = 1; // Keep this around afterwards to print out number of actually-completed cycles
-		word_id_t moved_count = 0;
-		count_arrays_t temp_count_arrays = malloc(cmd_args.max_array * sizeof(void *));
-		init_count_arrays(cmd_args, temp_count_arrays);
-		for (; cycle <= cmd_args.tune_cycles; cycle++) {
-			const bool is_nonreversed_cycle = (cmd_args.rev_alternate == 0) || (cycle % (cmd_args.rev_alternate+1)); // Only do a reverse predictive exchange (using <c,v>) after every cmd_arg.rev_alternate cycles; if rev_alternate==0 then always do this part.
-
-			clear_count_arrays(cmd_args, temp_count_arrays);
-			tally_class_counts_in_store(cmd_args, sent_store_int, model_metadata, word2class, temp_count_arrays);
-			double queried_log_prob = query_int_sents_in_store(cmd_args, sent_store_int, model_metadata, word_counts, word2class, word_list, temp_count_arrays, -1, 1);
-
-			// ETA stuff
-			const time_t time_this_cycle = time(NULL);
-			const double time_elapsed = difftime(time_this_cycle, time_start_cycles) + 2.0; // a little is added since early cycles tend to be too optimistic
-			const double time_avg_per_cycle = (time_elapsed / ((double)cycle-1));
-			const unsigned int remaining_cycles = cmd_args.tune_cycles - cycle + 1;
-			const double time_remaining = ( time_avg_per_cycle * remaining_cycles);
-			const time_t eta = time_this_cycle + time_remaining;
+	}
 
-			if (cmd_args.verbose >= -1) {
-				if (is_nonreversed_cycle)
-					fprintf(stderr, "ccat: Normal cycle %-2u", cycle);
-				else
-					fprintf(stderr, "ccat: Rev cycle    %-2u", cycle);
-				if (cycle > 1) {
-					fprintf(stderr, "  Words moved last cycle: %.2g%% (%u/%u). LL=%.3g PP=%g", (100 * (moved_count / (float)model_metadata.type_count)), moved_count, model_metadata.type_count, queried_log_prob, perplexity(queried_log_prob,(model_metadata.token_count - model_metadata.line_count)));
-					fprintf(stderr, "  Time left: %lim %lis. ETA: %s", (long)time_remaining/60, ((long)time_remaining % 60), ctime(&eta)); // ctime() adds a newline
+	if (cmd_args.rev_alternate && !cmd_args.unidirectional) {
+		const struct_word_bigram_cell * restrict next_cells = word_bigram_cells(word_bigrams_rev, word);
+		const size_t next_length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < next_length; i++) {
+			const word_id_t next_word = next_cells[i].word;
+			const unsigned int bigram_count = next_cells[i].count;
+			if (score_sparse_row(word_class_rev_counts, next_word, bigram_count, weight_rev, class_start, class_end, entropy_terms, row_buffer, scores))
+				continue;
+			const word_class_count_t * restrict row = word_class_row_expand(word_class_rev_counts, next_word, class_start, class_end, row_buffer);
+			if (compact  &&  row_max(row, class_start, class_end) + bigram_count >= ENTROPY_TERMS_SMALL) {
+				#pragma omp simd
+				for (wclass_t class = class_start; class < class_end; class++) {
+					scores[class] -= entropy_term_compact(entropy_terms, row[class]) * weight_rev;
+					scores[class] += entropy_term_compact(entropy_terms, row[class] + bigram_count) * weight_rev;
+				}
+			} else if (fits_table || compact) {
+				#pragma omp simd
+				for (wclass_t class = class_start; class < class_end; class++) {
+					scores[class] -= entropy_terms[row[class]] * weight_rev;
+					scores[class] += entropy_terms[row[class] + bigram_count] * weight_rev;
 				}
+			} else {
+				for (wclass_t class = class_start; class < class_end; class++) {
+					scores[class] -= entropy_term(entropy_terms, row[class]) * weight_rev;
+					scores[class] += entropy_term(entropy_terms, row[class] + bigram_count) * weight_rev;
+				}
+			}
+		}
+	}
+}
+
+double pex_objective(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double * restrict log_prob) {
+	// The predictive exchange objective, with the same weights as pex_move_word():  weight * sum_{v,c} N(v,c) log N(v,c)  +  weight_rev * sum_{c,v} N(c,v) log N(c,v)  -  sum_c N(c) log N(c)
+	// Reversed cycles swap the listings and counts, but a committed move leaves both sets of counts the same either way, so this is always taken from the non-reversed side.
+	// log_prob gets the unweighted forward part, sum_{v,c} N(v,c) log N(v,c)  -  sum_c N(c) log N(c), which class_bigram_log_prob() turns into a log-likelihood
+	const double weight     = cmd_args.unidirectional ? 1.0 : 0.6;
+	const double weight_rev = 0.4;
+	word_class_count_t row_buffer[cmd_args.num_classes];
+	double class_terms = 0.0, row_terms = 0.0;
+
+	for (wclass_t class = 0; class < cmd_args.num_classes; class++)
+		class_terms += entropy_term(entropy_terms, count_array[class]);
+
+	for (word_id_t word = 0; word < model_metadata.type_count; word++) {
+		const wclass_t length = word_class_row_values(word_class_counts, word, row_buffer);
+		for (wclass_t i = 0; i < length; i++)
+			row_terms += entropy_term(entropy_terms, row_buffer[i]);
+	}
+	*log_prob = row_terms - class_terms;
+	double objective = row_terms * weight - class_terms;
+
+	if (cmd_args.rev_alternate && !cmd_args.unidirectional) {
+		for (word_id_t word = 0; word < model_metadata.type_count; word++) {
+			const wclass_t length = word_class_row_values(word_class_rev_counts, word, row_buffer);
+			for (wclass_t i = 0; i < length; i++)
+				objective += entropy_term(entropy_terms, row_buffer[i]) * weight_rev;
+		}
+	}
+	return objective;
+}
+
+double pex_objective_move(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t from_class, const wclass_t to_class, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double * restrict log_prob) {
+	// How much pex_objective() changes when word moves from from_class to to_class, adding the change in its forward part to log_prob.  Call this before committing the move.
+	// Only the cells <v,from_class> and <v,to_class> of word's neighbors v change, and each neighbor is listed once, so their terms can be updated one at a time
+	const double weight     = cmd_args.unidirectional ? 1.0 : 0.6;
+	const double weight_rev = 0.4;
+	const unsigned int count_from = count_array[from_class];
+	const unsigned int count_to   = count_array[to_class];
+	const double class_delta = entropy_term(entropy_terms, count_from) - entropy_term(entropy_terms, count_from - word_count) + entropy_term(entropy_terms, count_to) - entropy_term(entropy_terms, count_to + word_count);
+	double row_delta = 0.0;
+
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	for (size_t i = 0; i < prev_length; i++) {
+		const word_id_t prev_word = prev_cells[i].word;
+		const unsigned int bigram_count = prev_cells[i].count;
+		const unsigned int from_count = word_class_count_find(word_class_counts, prev_word, from_class);
+		const unsigned int to_count   = word_class_count_find(word_class_counts, prev_word, to_class);
+		row_delta += entropy_term(entropy_terms, from_count - bigram_count) - entropy_term(entropy_terms, from_count) + entropy_term(entropy_terms, to_count + bigram_count) - entropy_term(entropy_terms, to_count);
+	}
+	*log_prob += class_delta + row_delta;
+	double delta = class_delta + row_delta * weight;
+
+	if (cmd_args.rev_alternate && !cmd_args.unidirectional) {
+		const struct_word_bigram_cell * restrict next_cells = word_bigram_cells(word_bigrams_rev, word);
+		const size_t next_length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < next_length; i++) {
+			const word_id_t next_word = next_cells[i].word;
+			const unsigned int bigram_count = next_cells[i].count;
+			const unsigned int from_count = word_class_count_find(word_class_rev_counts, next_word, from_class);
+			const unsigned int to_count   = word_class_count_find(word_class_rev_counts, next_word, to_class);
+			delta += (entropy_term(entropy_terms, from_count - bigram_count) - entropy_term(entropy_terms, from_count) + entropy_term(entropy_terms, to_count + bigram_count) - entropy_term(entropy_terms, to_count)) * weight_rev;
+		}
+	}
+	return delta;
+}
+
+double class_bigram_log_prob(const struct_model_metadata model_metadata, const unsigned int word_counts[const], const wclass_t word2class[const], const count_array_t count_array, const double log_prob) {
+	// Log-likelihood of the corpus under the predictive class bigram model P(w|v) = N(v,c(w))/N(v) * N(w)/N(c(w)), from the forward part of pex_objective().
+	// Every token but </s> predicts the next one and every token but <s> is predicted, so the sum_v N(v) log N(v) and sum_w N(w) log N(w) terms cancel,
+	// except that <s> is counted in its class without being predicted
+	const unsigned int start_count = word_counts[model_metadata.start_sent_id];
+	return log_prob + start_count * log2((double)count_array[word2class[model_metadata.start_sent_id]]);
+}
+
+size_t pex_word_cost(const struct cmd_args cmd_args, const word_id_t word, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev) { // Work per class when scoring a word
+	size_t cost = 1 + word_bigram_length(word_bigrams, word);
+	if (cmd_args.rev_alternate && !cmd_args.unidirectional)
+		cost += word_bigram_length(word_bigrams_rev, word);
+	return cost;
+}
+
+size_t pex_candidate_bound(const struct cmd_args cmd_args, const word_id_t word, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts) {
+	// At least as many as the distinct classes in the <v,c> rows of word's neighbors v, or num_classes if one of those rows is dense
+	size_t bound = 0;
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	for (size_t i = 0; i < prev_length; i++) {
+		const struct_word_class_row row = word_class_counts->rows[prev_cells[i].word];
+		if (row.dense)
+			return cmd_args.num_classes;
+		bound += row.length;
+	}
+
+	if (cmd_args.rev_alternate && !cmd_args.unidirectional) {
+		const struct_word_bigram_cell * restrict next_cells = word_bigram_cells(word_bigrams_rev, word);
+		const size_t next_length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < next_length; i++) {
+			const struct_word_class_row row = word_class_rev_counts->rows[next_cells[i].word];
+			if (row.dense)
+				return cmd_args.num_classes;
+			bound += row.length;
+		}
+	}
+	return bound < cmd_args.num_classes ? bound : cmd_args.num_classes;
+}
+
+static wclass_t add_candidate_classes(const struct_word_class_counts * restrict wcc, const struct_word_bigram_cell cells[const], const size_t length, wclass_t candidate_slot[restrict], wclass_t candidates[restrict], wclass_t num_candidates) {
+	for (size_t i = 0; i < length; i++) {
+		const struct_word_class_row row = wcc->rows[cells[i].word];
+		const wclass_t * restrict classes = wcc->sparse_classes + row.offset;
+		for (wclass_t j = 0; j < row.length; j++) {
+			if (candidate_slot[classes[j]] != (wclass_t)-1)
+				continue;
+			candidate_slot[classes[j]] = num_candidates;
+			candidates[num_candidates++] = classes[j];
+		}
+	}
+	return num_candidates;
+}
+
+static void score_candidate_rows(const struct_word_class_counts * restrict wcc, const struct_word_bigram_cell cells[const], const size_t length, const double weight, const float entropy_terms[const], const wclass_t candidate_slot[const], const wclass_t num_candidates, word_class_count_t row_buffer[restrict], word_class_count_t candidate_counts[restrict], double candidate_scores[restrict]) {
+	// One row at a time, like pex_score_word_classes(), so each candidate gets its terms added in the same order
+	for (size_t i = 0; i < length; i++) {
+		const word_id_t word = cells[i].word;
+		const wclass_t * restrict classes = wcc->sparse_classes + wcc->rows[word].offset;
+		const wclass_t row_length = word_class_row_values(wcc, word, row_buffer);
+		memset(candidate_counts, 0, sizeof(word_class_count_t) * num_candidates);
+		for (wclass_t j = 0; j < row_length; j++)
+			candidate_counts[candidate_slot[classes[j]]] = row_buffer[j];
+
+		const unsigned int bigram_count = cells[i].count;
+		for (wclass_t n = 0; n < num_candidates; n++) {
+			candidate_scores[n] -= entropy_term(entropy_terms, candidate_counts[n]) * weight;
+			candidate_scores[n] += entropy_term(entropy_terms, candidate_counts[n] + bigram_count) * weight;
+		}
+	}
+}
+
+bool pex_score_candidate_classes(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], wclass_t * restrict best_class, double * restrict best_score) {
+	// Finds the best class of pex_score_word_classes() without scoring all num_classes of them.  A class that none of word's neighbors v has a <v,c> count for
+	// scores base(c) plus a sum over word's bigram counts that's the same for all such classes, and base(c) only depends on count_array[c].
+	// So just the candidates (the classes in the neighbors' rows) are scored in full, and of the rest only the one with the best base(c).
+	// The additions are in the same order as in pex_score_word_classes(), so the scores are identical.  The only difference is which class wins if two of
+	// the rest with different base(c) end up tied after rounding, which would need base(c) values within an ulp of the full score of each other.
+	// Returns false without choosing a class if the neighbors' rows cover too many classes for this to pay off
+	const size_t bound = pex_candidate_bound(cmd_args, word, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts);
+	if (bound * CANDIDATE_CLASSES_SHARE > cmd_args.num_classes)
+		return false;
+
+	const double weight     = cmd_args.unidirectional ? 1.0 : 0.6;
+	const double weight_rev = 0.4;
+	const bool use_rev      = cmd_args.rev_alternate && !cmd_args.unidirectional;
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	const struct_word_bigram_cell * restrict next_cells = use_rev ? word_bigram_cells(word_bigrams_rev, word) : NULL;
+	const size_t next_length = use_rev ? word_bigram_length(word_bigrams_rev, word) : 0;
+
+	wclass_t candidate_slot[cmd_args.num_classes]; // Position in candidates, or -1
+	wclass_t candidates[bound + 1];
+	memset(candidate_slot, 0xFF, sizeof(candidate_slot));
+	wclass_t num_candidates = add_candidate_classes(word_class_counts, prev_cells, prev_length, candidate_slot, candidates, 0);
+	num_candidates = add_candidate_classes(word_class_rev_counts, next_cells, next_length, candidate_slot, candidates, num_candidates);
+
+	double candidate_scores[bound + 1];
+	for (wclass_t n = 0; n < num_candidates; n++) {
+		unsigned int count_class = count_array[candidates[n]];
+		if (!count_class) // class is empty
+			count_class = 1;
+		candidate_scores[n] = entropy_term(entropy_terms, count_class)  -  entropy_term(entropy_terms, count_class + word_count);
+	}
+	word_class_count_t row_buffer[bound + 1];
+	word_class_count_t candidate_counts[bound + 1];
+	score_candidate_rows(word_class_counts, prev_cells, prev_length, weight, entropy_terms, candidate_slot, num_candidates, row_buffer, candidate_counts, candidate_scores);
+	score_candidate_rows(word_class_rev_counts, next_cells, next_length, weight_rev, entropy_terms, candidate_slot, num_candidates, row_buffer, candidate_counts, candidate_scores);
+
+	// The best of the rest.  Adding the same terms in the same order can't reverse the order of two scores, so this is the one with the best base(c)
+	wclass_t rest_class = 0;
+	double rest_score = 0.0;
+	bool have_rest = false;
+	for (wclass_t class = 0; class < cmd_args.num_classes; class++) {
+		if (candidate_slot[class] != (wclass_t)-1)
+			continue;
+		unsigned int count_class = count_array[class];
+		if (!count_class)
+			count_class = 1;
+		const double base = entropy_term(entropy_terms, count_class)  -  entropy_term(entropy_terms, count_class + word_count);
+		if (!have_rest  ||  base > rest_score) {
+			rest_class = class;
+			rest_score = base;
+			have_rest  = true;
+		}
+	}
+	if (have_rest) {
+		for (size_t i = 0; i < prev_length; i++)
+			rest_score += entropy_term(entropy_terms, prev_cells[i].count) * weight;
+		for (size_t i = 0; i < next_length; i++)
+			rest_score += entropy_term(entropy_terms, next_cells[i].count) * weight_rev;
+	}
+
+	// Ties go to the lowest class, like which_max()
+	*best_class = rest_class;
+	*best_score = rest_score;
+	bool have_best = have_rest;
+	for (wclass_t n = 0; n < num_candidates; n++) {
+		if (!have_best  ||  candidate_scores[n] > *best_score  ||  (candidate_scores[n] == *best_score  &&  candidates[n] < *best_class)) {
+			*best_class = candidates[n];
+			*best_score = candidate_scores[n];
+			have_best   = true;
+		}
+	}
+	return true;
+}
+
+double pex_score_word_class(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const wclass_t class, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const]) {
+	// One class' score from pex_score_word_classes(), with the same additions in the same order, so it's identical
+	const double weight     = cmd_args.unidirectional ? 1.0 : 0.6;
+	const double weight_rev = 0.4;
+	unsigned int count_class = count_array[class];
+	if (!count_class) // class is empty
+		count_class = 1;
+	double score = entropy_term(entropy_terms, count_class)  -  entropy_term(entropy_terms, count_class + word_count);
+
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	for (size_t i = 0; i < prev_length; i++) {
+		const unsigned int row_count = word_class_count_find(word_class_counts, prev_cells[i].word, class);
+		score -= entropy_term(entropy_terms, row_count) * weight;
+		score += entropy_term(entropy_terms, row_count + prev_cells[i].count) * weight;
+	}
+
+	if (cmd_args.rev_alternate && !cmd_args.unidirectional) {
+		const struct_word_bigram_cell * restrict next_cells = word_bigram_cells(word_bigrams_rev, word);
+		const size_t next_length = word_bigram_length(word_bigrams_rev, word);
+		for (size_t i = 0; i < next_length; i++) {
+			const unsigned int row_count = word_class_count_find(word_class_rev_counts, next_cells[i].word, class);
+			score -= entropy_term(entropy_terms, row_count) * weight_rev;
+			score += entropy_term(entropy_terms, row_count + next_cells[i].count) * weight_rev;
+		}
+	}
+	return score;
+}
+
+static struct_bound_row * bound_rows = NULL; // Scratch space for pex_score_classes_bounded(), one per thread.  It only grows, so the per-word path doesn't allocate
+static size_t bound_rows_size = 0;
+#pragma omp threadprivate(bound_rows, bound_rows_size)
+
+static void free_bound_rows(void) { // This thread's scratch space, once nothing is scored on it anymore
+	free(bound_rows);
+	bound_rows = NULL;
+	bound_rows_size = 0;
+}
+
+static int compare_bound_rows(const void * a, const void * b) { // Widest first
+	const double width_a = ((const struct_bound_row *)a)->width;
+	const double width_b = ((const struct_bound_row *)b)->width;
+	return (width_a < width_b) - (width_a > width_b);
+}
+
+bool pex_score_classes_bounded(const struct cmd_args cmd_args, const word_id_t word, const unsigned int word_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], wclass_t * restrict best_class, double * restrict best_score, unsigned long * restrict pruned) {
+	// Branch and bound over the classes.  A neighbor v adds weight * (T(N(v,c) + N(v,w)) - T(N(v,c))) to the score of class c, with T(n) = n*log2(n).
+	// That's at least weight * T(N(v,w)), when N(v,c) = 0, and at most that plus the row's width, from the biggest count in v's row.
+	// So the neighbors are added up widest first, for all the classes still in the running, and each class' score so far plus the width of the rows left
+	// is an upper bound on its full score, while the best score so far plus the rest of the minimums is a lower bound on the best full score.
+	// A class whose upper bound is below the best lower bound can't win, so it's pruned.  The few classes left at the end (usually one) are scored in full with
+	// pex_score_word_class(), which adds things up in the same order as pex_score_word_classes(), so the chosen class is the one which_max() would choose.
+	// Returns false without choosing a class if the word has too few neighbors for this to be worth it
+	const double weight     = cmd_args.unidirectional ? 1.0 : 0.6;
+	const double weight_rev = 0.4;
+	const bool use_rev      = cmd_args.rev_alternate && !cmd_args.unidirectional;
+	const struct_word_bigram_cell * restrict prev_cells = word_bigram_cells(word_bigrams, word);
+	const size_t prev_length = word_bigram_length(word_bigrams, word);
+	const struct_word_bigram_cell * restrict next_cells = use_rev ? word_bigram_cells(word_bigrams_rev, word) : NULL;
+	const size_t next_length = use_rev ? word_bigram_length(word_bigrams_rev, word) : 0;
+	const size_t num_rows = prev_length + next_length;
+	if (num_rows < 2)
+		return false;
+
+	if (num_rows > bound_rows_size) {
+		free(bound_rows);
+		bound_rows_size = 2 * num_rows;
+		bound_rows = malloc(sizeof(struct_bound_row) * bound_rows_size);
+		if (bound_rows == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the rows of word %u's neighbors\n", argv_0_basename, word); fflush(stderr);
+			exit(8);
+		}
+	}
+	struct_bound_row * restrict rows = bound_rows;
+	double width_left = 0.0;
+	double term_mass  = 0.0; // For the slack
+	for (size_t i = 0; i < num_rows; i++) {
+		const bool is_rev = i >= prev_length;
+		const struct_word_bigram_cell cell = is_rev ? next_cells[i - prev_length] : prev_cells[i];
+		const word_class_count_t row_max = word_class_row_max(is_rev ? word_class_rev_counts : word_class_counts, cell.word);
+		rows[i].word         = cell.word;
+		rows[i].bigram_count = cell.count;
+		rows[i].is_rev       = is_rev;
+		rows[i].weight       = is_rev ? weight_rev : weight;
+		rows[i].floor        = entropy_term(entropy_terms, cell.count) * rows[i].weight;
+		rows[i].width        = (entropy_term(entropy_terms, row_max + cell.count) - entropy_term(entropy_terms, row_max)) * rows[i].weight - rows[i].floor;
+		if (rows[i].width < 0.0) // Only from rounding
+			rows[i].width = 0.0;
+		width_left += rows[i].width;
+		term_mass  += entropy_term(entropy_terms, row_max + cell.count) * rows[i].weight;
+	}
+	qsort(rows, num_rows, sizeof(struct_bound_row), compare_bound_rows);
+
+	// The n*log2(n) terms are floats, good to about 2^-23 relative, so they aren't quite monotonic.  And a full score adds up 2 * num_rows + 1 doubles
+	word_count_t max_class_size = 0;
+	for (wclass_t class = 0; class < cmd_args.num_classes; class++)
+		max_class_size = count_array[class] > max_class_size ? count_array[class] : max_class_size;
+	const double slack = 1e-5 * term_mass  +  1e-15 * (2.0 * num_rows + 2) * (term_mass + entropy_term(entropy_terms, max_class_size + word_count));
+
+	double floor_left = 0.0; // Sum of the minimums of the rows not added yet
+	for (size_t i = 0; i < num_rows; i++)
+		floor_left += rows[i].floor;
+
+	double partial_scores[cmd_args.num_classes];
+	wclass_t classes_left[cmd_args.num_classes];
+	wclass_t num_left = cmd_args.num_classes;
+	for (wclass_t class = 0; class < cmd_args.num_classes; class++) {
+		unsigned int count_class = count_array[class];
+		if (!count_class) // class is empty
+			count_class = 1;
+		partial_scores[class] = entropy_term(entropy_terms, count_class)  -  entropy_term(entropy_terms, count_class + word_count);
+		classes_left[class] = class;
+	}
+
+	word_class_count_t row_buffer[cmd_args.num_classes];
+	for (size_t i = 0; i < num_rows  &&  num_left > 1; i++) {
+		const struct_word_class_counts * restrict counts = rows[i].is_rev ? word_class_rev_counts : word_class_counts;
+		const unsigned int bigram_count = rows[i].bigram_count;
+		const double row_weight = rows[i].weight;
+		double best_partial = -INFINITY;
+		if (num_left * CANDIDATE_CLASSES_SHARE > cmd_args.num_classes) { // Cheaper to widen the whole row
+			const word_class_count_t * restrict row = word_class_row_expand(counts, rows[i].word, 0, cmd_args.num_classes, row_buffer);
+			for (wclass_t j = 0; j < num_left; j++) {
+				const wclass_t class = classes_left[j];
+				partial_scores[class] += (entropy_term(entropy_terms, row[class] + bigram_count) - entropy_term(entropy_terms, row[class])) * row_weight;
+				best_partial = partial_scores[class] > best_partial ? partial_scores[class] : best_partial;
+			}
+		} else {
+			for (wclass_t j = 0; j < num_left; j++) {
+				const wclass_t class = classes_left[j];
+				const unsigned int row_count = word_class_count_find(counts, rows[i].word, class);
+				partial_scores[class] += (entropy_term(entropy_terms, row_count + bigram_count) - entropy_term(entropy_terms, row_count)) * row_weight;
+				best_partial = partial_scores[class] > best_partial ? partial_scores[class] : best_partial;
+			}
+		}
+		floor_left -= rows[i].floor;
+		width_left -= rows[i].width;
+
+		// Upper bound:  partial + floor_left + width_left.  Lower bound on the best:  best_partial + floor_left.  So floor_left drops out
+		const double cutoff = best_partial - width_left - slack;
+		wclass_t kept = 0;
+		for (wclass_t j = 0; j < num_left; j++)
+			if (partial_scores[classes_left[j]] >= cutoff)
+				classes_left[kept++] = classes_left[j];
+		num_left = kept;
+	}
+
+	// Ties go to the lowest class, like which_max(), and classes_left is still in order
+	*best_score = -INFINITY;
+	for (wclass_t j = 0; j < num_left; j++) {
+		const wclass_t class = classes_left[j];
+		const double score = pex_score_word_class(cmd_args, word, word_count, class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_array, entropy_terms);
+		if (score > *best_score) {
+			*best_class = class;
+			*best_score = score;
+		}
+	}
+	#pragma omp atomic
+	*pruned += cmd_args.num_classes - num_left;
+	return true;
+}
+
+void pex_score_word_classes_tasks(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t word, const unsigned int word_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, const struct_word_class_counts * restrict word_class_counts, const struct_word_class_counts * restrict word_class_rev_counts, const count_array_t count_array, const float entropy_terms[const], double scores[restrict]) {
+	// Scores all classes for one word.  Rare words are cheap, so they're scored right here rather than paying for handing out work.
+	// Otherwise the classes are split into ranges of about equal cost, which the thread team picks up as tasks.
+	const size_t cost = pex_word_cost(cmd_args, word, word_bigrams, word_bigrams_rev) * cmd_args.num_classes;
+	if (cmd_args.num_threads < 2  ||  cost < 2 * TASK_MIN_COST) {
+		pex_score_word_classes(cmd_args, model_metadata, word, word_count, 0, cmd_args.num_classes, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_array, entropy_terms, scores);
+		return;
+	}
+
+	unsigned long num_chunks = cost / TASK_MIN_COST;
+	if (num_chunks > 4 * (unsigned long)cmd_args.num_threads)
+		num_chunks = 4 * (unsigned long)cmd_args.num_threads;
+	if (num_chunks > cmd_args.num_classes)
+		num_chunks = cmd_args.num_classes;
+
+	#pragma omp taskloop
+	for (unsigned long chunk = 0; chunk < num_chunks; chunk++) {
+		const wclass_t class_start = (wclass_t)((cmd_args.num_classes * chunk) / num_chunks);
+		const wclass_t class_end   = (wclass_t)((cmd_args.num_classes * (chunk+1)) / num_chunks);
+		pex_score_word_classes(cmd_args, model_metadata, word, word_count, class_start, class_end, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_array, entropy_terms, scores);
+	}
+}
+
+word_id_t exchange_word_blocks(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, count_array_t count_array, const float entropy_terms[const], const unsigned short cycle, const bool is_nonreversed_cycle, unsigned long * restrict steps, unsigned long * restrict pruned, double * restrict objective, double * restrict log_prob) {
+	// Each block of words is first scored in parallel.  Nothing is written during scoring, so every word in the block sees the same frozen snapshot of word_class_counts and count_array.
+	// Then the proposed moves are re-checked and committed serially in word order.  Neither phase depends on the number of threads, so the output doesn't either.
+	// The reversed cycle just swaps the forward and reverse listings & counts, like in cluster()
+	const struct_word_bigram_listing * restrict bigrams     = is_nonreversed_cycle ? word_bigrams : word_bigrams_rev;
+	const struct_word_bigram_listing * restrict bigrams_rev = is_nonreversed_cycle ? word_bigrams_rev : word_bigrams;
+	struct_word_class_counts * restrict counts     = is_nonreversed_cycle ? word_class_counts : word_class_rev_counts;
+	struct_word_class_counts * restrict counts_rev = is_nonreversed_cycle ? word_class_rev_counts : word_class_counts;
+
+	const word_id_t block_size = cmd_args.word_block;
+	wclass_t * restrict block_best_class = malloc(sizeof(wclass_t) * block_size);
+	double * restrict block_best_score   = malloc(sizeof(double) * block_size);
+	word_id_t moved_count = 0;
+	unsigned long local_steps = 0;
+
+	for (word_id_t block_start = 0; block_start < model_metadata.type_count; block_start += block_size) {
+		const word_id_t block_end = (model_metadata.type_count - block_start > block_size) ? block_start + block_size : model_metadata.type_count;
+
+		// Hand out runs of consecutive words of about equal cost to the thread team
+		word_id_t chunk_start = block_start;
+		size_t chunk_cost = 0;
+		for (word_id_t word_i = block_start; word_i < block_end; word_i++) {
+			block_best_class[word_i - block_start] = word2class[word_i];
+			const bool is_scored = !(cycle < 3 && word_i < cmd_args.num_classes); // don't move high-frequency words in the first (few) iteration(s)
+			if (is_scored) {
+				local_steps += cmd_args.num_classes;
+				const size_t bound = pex_candidate_bound(cmd_args, word_i, bigrams, bigrams_rev, counts, counts_rev);
+				if (bound * CANDIDATE_CLASSES_SHARE > cmd_args.num_classes)
+					chunk_cost += pex_word_cost(cmd_args, word_i, bigrams, bigrams_rev) * cmd_args.num_classes;
 				else
-					fprintf(stderr, "\n");
-				fflush(stderr);
+					chunk_cost += pex_word_cost(cmd_args, word_i, bigrams, bigrams_rev) * bound + cmd_args.num_classes;
 			}
-			moved_count = 0;
+			if (chunk_cost < TASK_MIN_COST  &&  word_i < block_end-1)
+				continue;
 
-			//#pragma omp parallel for num_threads(cmd_args.num_threads) reduction(+:steps) // non-determinism
-			for (word_id_t word_i = 0; word_i < model_metadata.type_count; word_i++) {
-			//for (word_id_t word_i = model_metadata.type_count-1; word_i != -1; word_i--) {
-				if (cycle < 3 && word_i < cmd_args.num_classes) // don't move high-frequency words in the first (few) iteration(s)
+			const word_id_t chunk_end = word_i + 1;
+			#pragma omp task firstprivate(chunk_start) if(chunk_cost)
+			for (word_id_t word_j = chunk_start; word_j < chunk_end; word_j++) {
+				if (cycle < 3 && word_j < cmd_args.num_classes)
 					continue;
-				const unsigned int word_i_count = word_counts[word_i];
-				const wclass_t old_class = word2class[word_i];
-				double scores[cmd_args.num_classes]; // This doesn't need to be private in the OMP parallelization since each thead is writing to different element in the array
-				//const double delta_remove_word = pex_remove_word(cmd_args, word_i, word_i_count, old_class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays, true);
-				//const double delta_remove_word = 0.0;  // Not really necessary
-				//const double delta_remove_word_rev = 0.0;  // Not really necessary
-
-				//printf("cluster(): 43: "); long unsigned int class_sum=0; for (wclass_t i = 0; i < cmd_args.num_classes; i++) {
-				//	printf("c_%u=%u, ", i, count_arrays[0][i]);
-				//	class_sum += count_arrays[0][i];
-				//} printf("\nClass Sum=%lu; Corpus Tokens=%lu\n", class_sum, model_metadata.token_count); fflush(stdout);
-
-				#pragma omp parallel for num_threads(cmd_args.num_threads) reduction(+:steps)
-				for (wclass_t class = 0; class < cmd_args.num_classes; class++) { // class values range from 0 to cmd_args.num_classes-1
-					if (is_nonreversed_cycle) {
-						scores[class] = pex_move_word(cmd_args, word_i, word_i_count, class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, true);
-					} else { // This is the reversed one
-						scores[class] = pex_move_word(cmd_args, word_i, word_i_count, class, word2class, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, true);
+				if (pex_score_candidate_classes(cmd_args, word_j, word_counts[word_j], bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, &block_best_class[word_j - block_start], &block_best_score[word_j - block_start]))
+					continue;
+				if (pex_score_classes_bounded(cmd_args, word_j, word_counts[word_j], bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, &block_best_class[word_j - block_start], &block_best_score[word_j - block_start], pruned))
+					continue;
+				double scores[cmd_args.num_classes];
+				pex_score_word_classes(cmd_args, model_metadata, word_j, word_counts[word_j], 0, cmd_args.num_classes, bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, scores);
+				block_best_class[word_j - block_start] = which_max(scores, cmd_args.num_classes);
+				block_best_score[word_j - block_start] = max(scores, cmd_args.num_classes);
+			}
+			chunk_start = chunk_end;
+			chunk_cost  = 0;
+		}
+		#pragma omp taskwait
+
+		for (word_id_t word_i = block_start; word_i < block_end; word_i++) { // Commit in order
+			const wclass_t old_class = word2class[word_i];
+			const wclass_t new_class = block_best_class[word_i - block_start];
+			if (old_class == new_class)
+				continue;
+
+			// Earlier moves in this block may have changed things, so make sure the move is still an improvement
+			const unsigned int word_i_count = word_counts[word_i];
+			const double old_score = pex_move_word(cmd_args, word_i, word_i_count, old_class, word2class, bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, true);
+			const double new_score = pex_move_word(cmd_args, word_i, word_i_count, new_class, word2class, bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, true);
+			if (! (new_score > old_score))
+				continue;
+
+			moved_count++;
+			if (cmd_args.verbose > 0) {
+				fprintf(stderr, " Moving id=%-7u count=%-7u %-18s %u -> %u\t(%g -> %g; snapshot %g)\n", word_i, word_i_count, word_list[word_i], old_class, new_class, old_score, new_score, block_best_score[word_i - block_start]); fflush(stderr);
+			}
+			if (isnan(new_score)) { // shouldn't happen
+				fprintf(stderr, "Error: new_score=%g :-(\n", new_score); fflush(stderr);
+				exit(5);
+			}
+			*objective += pex_objective_move(cmd_args, word_i, word_i_count, old_class, new_class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_array, entropy_terms, log_prob);
+
+			word2class[word_i] = new_class;
+			pex_remove_word(cmd_args, model_metadata, word_i, word_i_count, old_class, word2class, bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, false);
+			pex_move_word(cmd_args, word_i, word_i_count, new_class, word2class, bigrams, bigrams_rev, counts, counts_rev, count_array, entropy_terms, false);
+		}
+	}
+
+	*steps += local_steps;
+	free(block_best_class);
+	free(block_best_score);
+	return moved_count;
+}
+
+void cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, const float entropy_terms[const], char * class_bitstrings[restrict]) {
+	unsigned long steps = 0;
+	unsigned long pruned = 0; // Classes skipped by pex_score_classes_bounded()
+
+	if (cmd_args.class_algo == EXCHANGE  ||  cmd_args.class_algo == EXCHANGE_BROWN) { // Exchange algorithm: See Sven Martin, Jörg Liermann, Hermann Ney. 1998. Algorithms For Bigram And Trigram Word Clustering. Speech Communication 24. 19-37. http://citeseerx.ist.psu.edu/viewdoc/summary?doi=10.1.1.53.2354
+		#pragma omp parallel num_threads(cmd_args.num_threads)
+		#pragma omp single
+		{ // One team of threads lives for the whole exchange phase.  This thread drives the cycles, and all of them (this one too, when it waits) pick up the tasks it hands out.
+			// The entropy table, the post-exchange Brown merges and the word vectors each run once, outside this team, in parallel regions of their own
+			// Get initial logprob
+			count_arrays_t count_arrays = malloc(cmd_args.max_array * sizeof(void *));
+			init_count_arrays(cmd_args, count_arrays);
+			if (sent_store_int)
+				tally_class_counts_in_store(cmd_args, sent_store_int, model_metadata, word2class, count_arrays);
+			else // --stream
+				tally_class_counts_in_listing(cmd_args, word_bigrams, model_metadata, word2class, count_arrays);
+
+			if (cmd_args.verbose > 3) {
+				printf("cluster(): 42: "); long unsigned int class_sum=0; for (wclass_t i = 0; i < cmd_args.num_classes; i++) {
+					printf("c_%u=%u, ", i, count_arrays[0][i]);
+					class_sum += count_arrays[0][i];
+				} printf("\nClass Sum=%lu; Corpus Tokens=%lu\n", class_sum, model_metadata.token_count); fflush(stdout);
+			}
+			// Re-tallying and re-querying the whole corpus every cycle just to report progress costs about as much as a cycle itself.
+			// So instead we keep track of the exchange objective, updating it with each committed move, and only do the full query every --verify-every cycles
+			double log_prob = 0.0;
+			double objective = pex_objective(cmd_args, model_metadata, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, &log_prob);
+
+			if (cmd_args.verbose >= -1  &&  sent_store_int) {
+				const double best_log_prob = query_int_sents_in_store(cmd_args, sent_store_int, model_metadata, word_counts, word2class, word_list, count_arrays, -1, 1);
+				fprintf(stderr, "%s: Expected Steps:  %'lu (%'u word types x %'u classes x %'u cycles);  initial logprob=%g, PP=%g\n", argv_0_basename, (unsigned long)model_metadata.type_count * cmd_args.num_classes * cmd_args.tune_cycles, model_metadata.type_count, cmd_args.num_classes, cmd_args.tune_cycles, best_log_prob, perplexity(best_log_prob, (model_metadata.token_count - model_metadata.line_count))); fflush(stderr);
+			} else if (cmd_args.verbose >= -1) { // There's no corpus to query with --stream, just the aggregated counts
+				fprintf(stderr, "%s: Expected Steps:  %'lu (%'u word types x %'u classes x %'u cycles);  initial objective=%g\n", argv_0_basename, (unsigned long)model_metadata.type_count * cmd_args.num_classes * cmd_args.tune_cycles, model_metadata.type_count, cmd_args.num_classes, cmd_args.tune_cycles, objective); fflush(stderr);
+			}
+			double last_objective = objective;
+
+			time_t time_start_cycles;
+			time(&time_start_cycles);
+			unsigned short cycle = 1; // Keep this around afterwards to print out number of actually-completed cycles
+			word_id_t moved_count = 0;
+			unsigned long cycle_steps = 0, cycle_pruned = 0; // For the pruned share of last cycle
+			count_arrays_t temp_count_arrays = NULL;
+			if (cmd_args.verify_every) {
+				temp_count_arrays = malloc(cmd_args.max_array * sizeof(void *));
+				init_count_arrays(cmd_args, temp_count_arrays);
+			}
+			for (; cycle <= cmd_args.tune_cycles; cycle++) {
+				const bool is_nonreversed_cycle = (cmd_args.rev_alternate == 0) || (cycle % (cmd_args.rev_alternate+1)); // Only do a reverse predictive exchange (using <c,v>) after every cmd_arg.rev_alternate cycles; if rev_alternate==0 then always do this part.
+
+				const bool is_verify_cycle = cmd_args.verify_every  &&  cycle > 1  &&  !((cycle-1) % cmd_args.verify_every);
+				double queried_log_prob = 0.0;
+				if (is_verify_cycle) {
+					clear_count_arrays(cmd_args, temp_count_arrays);
+					tally_class_counts_in_store(cmd_args, sent_store_int, model_metadata, word2class, temp_count_arrays);
+					queried_log_prob = query_int_sents_in_store(cmd_args, sent_store_int, model_metadata, word_counts, word2class, word_list, temp_count_arrays, -1, 1);
+					double recomputed_log_prob = 0.0;
+					const double recomputed_objective = pex_objective(cmd_args, model_metadata, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, &recomputed_log_prob);
+					// Each move's change is summed from single-precision entropy terms, so the tracked values drift a little, but nowhere near this much
+					if (fabs(objective - recomputed_objective) > 1e-6 * fabs(recomputed_objective) + 1.0  ||  fabs(log_prob - recomputed_log_prob) > 1e-6 * fabs(recomputed_log_prob) + 1.0) {
+						fprintf(stderr, "%s: Error: In cycle %u the tracked objective=%.10g and log_prob=%.10g don't match the recomputed objective=%.10g and log_prob=%.10g\n", argv_0_basename, cycle, objective, log_prob, recomputed_objective, recomputed_log_prob); fflush(stderr);
+						exit(5);
 					}
-					steps++;
+					objective = recomputed_objective; // Start over from the recomputed values, so the drift doesn't add up
+					log_prob  = recomputed_log_prob;
 				}
 
-				const wclass_t best_hypothesis_class = which_max(scores, cmd_args.num_classes);
-				const double best_hypothesis_score = max(scores, cmd_args.num_classes);
+				// ETA stuff
+				const time_t time_this_cycle = time(NULL);
+				const double time_elapsed = difftime(time_this_cycle, time_start_cycles) + 2.0; // a little is added since early cycles tend to be too optimistic
+				const double time_avg_per_cycle = (time_elapsed / ((double)cycle-1));
+				const unsigned int remaining_cycles = cmd_args.tune_cycles - cycle + 1;
+				const double time_remaining = ( time_avg_per_cycle * remaining_cycles);
+				const time_t eta = time_this_cycle + time_remaining;
 
-				if (cmd_args.verbose > 1) {
-					printf("Orig score for word w_«%u» using class «%hu» is %g;  Hypos %u-%u: ", word_i, old_class, scores[old_class], 1, cmd_args.num_classes);
-					fprint_array(stdout, scores, cmd_args.num_classes, ","); fflush(stdout);
-					//if (best_hypothesis_score > 0) { // Shouldn't happen
-					//	fprintf(stderr, "Error: best_hypothesis_score=%g for class %hu > 0\n", best_hypothesis_score, best_hypothesis_class); fflush(stderr);
-					//	exit(9);
-					//}
+				if (cmd_args.verbose >= -1) {
+					if (is_nonreversed_cycle)
+						fprintf(stderr, "ccat: Normal cycle %-2u", cycle);
+					else
+						fprintf(stderr, "ccat: Rev cycle    %-2u", cycle);
+					if (cycle > 1) {
+						const double class_log_prob = class_bigram_log_prob(model_metadata, word_counts, word2class, count_arrays[0], log_prob);
+						fprintf(stderr, "  Words moved last cycle: %.2g%% (%u/%u). classLL=%.3g classPP=%g Objective=%.6g (%+.3g)", (100 * (moved_count / (float)model_metadata.type_count)), moved_count, model_metadata.type_count, class_log_prob, perplexity(class_log_prob,(model_metadata.token_count - model_metadata.line_count)), objective, objective - last_objective);
+						if (cmd_args.verbose > 0  &&  steps > cycle_steps)
+							fprintf(stderr, " Pruned %.3g%% of classes", 100.0 * (pruned - cycle_pruned) / (steps - cycle_steps));
+						if (is_verify_cycle)
+							fprintf(stderr, " LL=%.3g PP=%g", queried_log_prob, perplexity(queried_log_prob,(model_metadata.token_count - model_metadata.line_count)));
+						fprintf(stderr, "  Time left: %lim %lis. ETA: %s", (long)time_remaining/60, ((long)time_remaining % 60), ctime(&eta)); // ctime() adds a newline
+					}
+					else
+						fprintf(stderr, "\n");
+					fflush(stderr);
 				}
+				moved_count = 0;
+				cycle_steps  = steps;
+				cycle_pruned = pruned;
+				last_objective = objective;
 
-				if (old_class != best_hypothesis_class) { // We've improved
-					moved_count++;
+				if (cmd_args.word_block) { // Deterministic parallel exchange over blocks of words; same output for any number of threads
+					moved_count = exchange_word_blocks(cmd_args, model_metadata, word_counts, word_list, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, cycle, is_nonreversed_cycle, &steps, &pruned, &objective, &log_prob);
+				} else {
+					for (word_id_t word_i = 0; word_i < model_metadata.type_count; word_i++) {
+					//for (word_id_t word_i = model_metadata.type_count-1; word_i != -1; word_i--) {
+						if (cycle < 3 && word_i < cmd_args.num_classes) // don't move high-frequency words in the first (few) iteration(s)
+							continue;
+						const unsigned int word_i_count = word_counts[word_i];
+						const wclass_t old_class = word2class[word_i];
+						double scores[cmd_args.num_classes]; // This doesn't need to be private in the OMP parallelization since each thead is writing to different element in the array
+						//const double delta_remove_word = pex_remove_word(cmd_args, word_i, word_i_count, old_class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays, true);
+						//const double delta_remove_word = 0.0;  // Not really necessary
+						//const double delta_remove_word_rev = 0.0;  // Not really necessary
 
-					if (cmd_args.verbose > 0)
-						fprintf(stderr, " Moving id=%-7u count=%-7u %-18s %u -> %u\t(%g -> %g)\n", word_i, word_counts[word_i], word_list[word_i], old_class, best_hypothesis_class, scores[old_class], best_hypothesis_score); fflush(stderr);
-					//word2class[word_i] = best_hypothesis_class;
-					word2class[word_i] = best_hypothesis_class;
-					if (isnan(best_hypothesis_score)) { // shouldn't happen
-						fprintf(stderr, "Error: best_hypothesis_score=%g :-(\n", best_hypothesis_score); fflush(stderr);
-						exit(5);
-					} else {
-						best_log_prob += best_hypothesis_score;
-					}
+						//printf("cluster(): 43: "); long unsigned int class_sum=0; for (wclass_t i = 0; i < cmd_args.num_classes; i++) {
+						//	printf("c_%u=%u, ", i, count_arrays[0][i]);
+						//	class_sum += count_arrays[0][i];
+						//} printf("\nClass Sum=%lu; Corpus Tokens=%lu\n", class_sum, model_metadata.token_count); fflush(stdout);
 
-					if (is_nonreversed_cycle) {
-						pex_remove_word(cmd_args, model_metadata, word_i, word_i_count, old_class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, false);
-						pex_move_word(cmd_args, word_i, word_i_count, best_hypothesis_class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, false);
-					} else { // This is the reversed one
-						pex_remove_word(cmd_args, model_metadata, word_i, word_i_count, old_class, word2class, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, false);
-						pex_move_word(cmd_args, word_i, word_i_count, best_hypothesis_class, word2class, word_bigrams_rev, word_bigrams,  word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, false);
+						// Rare words only need their candidate classes scored, and most classes can be pruned for the rest.  Printing all the scores needs every class scored
+						wclass_t best_hypothesis_class = old_class;
+						double best_hypothesis_score = 0.0;
+						bool is_candidate_scored = false;
+						if (cmd_args.verbose < 2) {
+							if (is_nonreversed_cycle)
+								is_candidate_scored = pex_score_candidate_classes(cmd_args, word_i, word_i_count, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, &best_hypothesis_class, &best_hypothesis_score)
+								                   || pex_score_classes_bounded(cmd_args, word_i, word_i_count, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, &best_hypothesis_class, &best_hypothesis_score, &pruned);
+							else
+								is_candidate_scored = pex_score_candidate_classes(cmd_args, word_i, word_i_count, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, &best_hypothesis_class, &best_hypothesis_score)
+								                   || pex_score_classes_bounded(cmd_args, word_i, word_i_count, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, &best_hypothesis_class, &best_hypothesis_score, &pruned);
+						}
+						if (!is_candidate_scored) {
+							if (is_nonreversed_cycle) {
+								pex_score_word_classes_tasks(cmd_args, model_metadata, word_i, word_i_count, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, scores);
+							} else { // This is the reversed one
+								pex_score_word_classes_tasks(cmd_args, model_metadata, word_i, word_i_count, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, scores);
+							}
+							best_hypothesis_class = which_max(scores, cmd_args.num_classes);
+							best_hypothesis_score = max(scores, cmd_args.num_classes);
+						}
+						steps += cmd_args.num_classes;
+
+						if (cmd_args.verbose > 1) {
+							printf("Orig score for word w_«%u» using class «%hu» is %g;  Hypos %u-%u: ", word_i, old_class, scores[old_class], 1, cmd_args.num_classes);
+							fprint_array(stdout, scores, cmd_args.num_classes, ","); fflush(stdout);
+							//if (best_hypothesis_score > 0) { // Shouldn't happen
+							//	fprintf(stderr, "Error: best_hypothesis_score=%g for class %hu > 0\n", best_hypothesis_score, best_hypothesis_class); fflush(stderr);
+							//	exit(9);
+							//}
+						}
+
+						if (old_class != best_hypothesis_class) { // We've improved
+							moved_count++;
+
+							if (cmd_args.verbose > 0) {
+								const double old_score = !is_candidate_scored ? scores[old_class] : is_nonreversed_cycle
+									? pex_score_word_class(cmd_args, word_i, word_i_count, old_class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms)
+									: pex_score_word_class(cmd_args, word_i, word_i_count, old_class, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms);
+								fprintf(stderr, " Moving id=%-7u count=%-7u %-18s %u -> %u\t(%g -> %g)\n", word_i, word_counts[word_i], word_list[word_i], old_class, best_hypothesis_class, old_score, best_hypothesis_score); fflush(stderr);
+							}
+							//word2class[word_i] = best_hypothesis_class;
+							word2class[word_i] = best_hypothesis_class;
+							if (isnan(best_hypothesis_score)) { // shouldn't happen
+								fprintf(stderr, "Error: best_hypothesis_score=%g :-(\n", best_hypothesis_score); fflush(stderr);
+								exit(5);
+							}
+							objective += pex_objective_move(cmd_args, word_i, word_i_count, old_class, best_hypothesis_class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, &log_prob);
+
+							if (is_nonreversed_cycle) {
+								pex_remove_word(cmd_args, model_metadata, word_i, word_i_count, old_class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, false);
+								pex_move_word(cmd_args, word_i, word_i_count, best_hypothesis_class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, false);
+							} else { // This is the reversed one
+								pex_remove_word(cmd_args, model_metadata, word_i, word_i_count, old_class, word2class, word_bigrams_rev, word_bigrams, word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, false);
+								pex_move_word(cmd_args, word_i, word_i_count, best_hypothesis_class, word2class, word_bigrams_rev, word_bigrams,  word_class_rev_counts, word_class_counts, count_arrays[0], entropy_terms, false);
+							}
+						}
 					}
 				}
+
+				// In principle if there's no improvement in the determinitistic exchange algo, we can stop cycling; there will be no more gains
+				if (!moved_count) // Nothing moved in last cycle, so that's it
+					break;
 			}
 
-			// In principle if there's no improvement in the determinitistic exchange algo, we can stop cycling; there will be no more gains
-			if (!moved_count) // Nothing moved in last cycle, so that's it
-				break;
-		}
+			if (cmd_args.verbose >= -1) {
+				fprintf(stderr, "%s: Completed steps: %'lu (%'u word types x %'u classes x %'u cycles);\n", argv_0_basename, steps, model_metadata.type_count, cmd_args.num_classes, cycle-1); fflush(stderr);
+			}
+				//fprintf(stderr, "%s: Completed steps: %'lu (%'u word types x %'u classes x %'u cycles);     best logprob=%g, PP=%g\n", argv_0_basename, steps, model_metadata.type_count, cmd_args.num_classes, cycle-1, best_log_prob, perplexity(best_log_prob,(model_metadata.token_count - model_metadata.line_count))); fflush(stderr);
 
-		if (cmd_args.verbose >= -1)
-			fprintf(stderr, "%s: Completed steps: %'lu (%'u word types x %'u classes x %'u cycles);\n", argv_0_basename, steps, model_metadata.type_count, cmd_args.num_classes, cycle-1); fflush(stderr);
-			//fprintf(stderr, "%s: Completed steps: %'lu (%'u word types x %'u classes x %'u cycles);     best logprob=%g, PP=%g\n", argv_0_basename, steps, model_metadata.type_count, cmd_args.num_classes, cycle-1, best_log_prob, perplexity(best_log_prob,(model_metadata.token_count - model_metadata.line_count))); fflush(stderr);
-
-		if (cmd_args.class_algo == EXCHANGE_BROWN)
-			post_exchange_brown_cluster(cmd_args, model_metadata, word_counts, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays);
-
-		free_count_arrays(cmd_args, temp_count_arrays);
-		free(temp_count_arrays);
-		free_count_arrays(cmd_args, count_arrays);
-		free(count_arrays);
-		free(entropy_terms);
-
-	} else if (cmd_args.class_algo == BROWN) { // Agglomerative clustering.  Stops when the number of current clusters is equal to the desired number in cmd_args.num_classes
-		// "Things equal to nothing else are equal to each other." --Anon
-		for (unsigned long current_num_classes = model_metadata.type_count; current_num_classes > cmd_args.num_classes; current_num_classes--) {
-			for (word_id_t word_i = 0; word_i < model_metadata.type_count; word_i++) {
-				float log_probs[cmd_args.num_classes];
-				//#pragma omp parallel for num_threads(cmd_args.num_threads)
-				for (wclass_t class = 0; class < cmd_args.num_classes; class++, steps++) {
-					// Get log prob
-					log_probs[class] = -1 * (class+1); // Dummy predicate
-				}
-				wclass_t best_class = which_maxf(log_probs, cmd_args.num_classes);
-				printf("Moving w_%u to class %u\n", word_i, best_class);
+			if (temp_count_arrays) {
+				free_count_arrays(cmd_args, temp_count_arrays);
+				free(temp_count_arrays);
 			}
+			free_count_arrays(cmd_args, count_arrays);
+			free(count_arrays);
 		}
+
+		// Threadprivate copies carry over to the next parallel region with as many threads, so each of the exchange team's threads frees its own scratch rows here
+		#pragma omp parallel num_threads(cmd_args.num_threads)
+		free_bound_rows();
+
+		if (cmd_args.class_algo == EXCHANGE_BROWN) // Outside the exchange team, so the merge stage's parallel loops aren't nested regions, which run on one thread
+			post_exchange_brown_cluster(cmd_args, model_metadata, word_counts, word2class, word_bigrams, class_bitstrings);
+
+	} else if (cmd_args.class_algo == BROWN) { // Agglomerative clustering, down to cmd_args.num_classes clusters and then on to a binary tree over them
+		brown_cluster(cmd_args, model_metadata, word_counts, word2class, word_bigrams, word_bigrams_rev, class_bitstrings);
 	}
 }
 
-void print_words_and_vectors(FILE * out_file, const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts) {
+void print_words_and_vectors(FILE * out_file, const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, const float entropy_terms[const], const word_id_t print_order[const]) {
+	// Words are printed in order of print_order, which gives the word id for each line.  If it's NULL they're printed in order of word id
 	count_arrays_t count_arrays = malloc(cmd_args.max_array * sizeof(void *));
 	init_count_arrays(cmd_args, count_arrays);
-	tally_class_counts_in_store(cmd_args, sent_store_int, model_metadata, word2class, count_arrays);
-
-	// Build precomputed entropy terms
-	float * restrict entropy_terms = malloc(ENTROPY_TERMS_MAX * sizeof(float));
-	build_entropy_terms(cmd_args, entropy_terms, ENTROPY_TERMS_MAX);
+	if (sent_store_int)
+		tally_class_counts_in_store(cmd_args, sent_store_int, model_metadata, word2class, count_arrays);
+	else // --stream
+		tally_class_counts_in_listing(cmd_args, word_bigrams, model_metadata, word2class, count_arrays);
 
 	fprintf(out_file, "%lu %u\n", (long unsigned)model_metadata.type_count, cmd_args.num_classes); // Like output in word2vec
 
-	for (word_id_t word_i = 0; word_i < model_metadata.type_count; word_i++) {
-		const unsigned int word_i_count = word_counts[word_i];
-		float scores[cmd_args.num_classes]; // This doesn't need to be private in the OMP parallelization since each thead is writing to different element in the array.  We use a float here to be compatible with word2vec
+	// Vectors are built for a block of words at a time by a thread team of this function's own, since cluster()'s is gone by now, then printed in order.  We use floats here to be compatible with word2vec
+	const word_id_t block_size = 1024;
+	float * restrict block_vectors = malloc(sizeof(float) * block_size * cmd_args.num_classes);
 
-		#pragma omp parallel for num_threads(cmd_args.num_threads)
-		for (wclass_t class = 0; class < cmd_args.num_classes; class++) { // class values range from 0 to cmd_args.num_classes-1
-			scores[class] = -(float)pex_move_word(cmd_args, word_i, word_i_count, class, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, true);
-		}
+	#pragma omp parallel num_threads(cmd_args.num_threads)
+	#pragma omp single
+	{ // One thread hands out tasks, and the whole team picks them up
+		for (word_id_t block_start = 0; block_start < model_metadata.type_count; block_start += block_size) {
+			const word_id_t block_end = (model_metadata.type_count - block_start > block_size) ? block_start + block_size : model_metadata.type_count;
+
+			word_id_t chunk_start = block_start;
+			size_t chunk_cost = 0;
+			for (word_id_t word_i = block_start; word_i < block_end; word_i++) { // Hand out runs of consecutive words of about equal cost
+				chunk_cost += pex_word_cost(cmd_args, print_order ? print_order[word_i] : word_i, word_bigrams, word_bigrams_rev) * cmd_args.num_classes;
+				if (chunk_cost < TASK_MIN_COST  &&  word_i < block_end-1)
+					continue;
 
-		fprintf(out_file, "%s ", word_list[word_i]);
-		if (cmd_args.print_word_vectors == TEXT_VEC)
-			fprint_arrayf(out_file, scores, cmd_args.num_classes, " ");
-		else
-			fwrite(scores, sizeof(float), cmd_args.num_classes, out_file);
+				const word_id_t chunk_end = word_i + 1;
+				#pragma omp task firstprivate(chunk_start)
+				for (word_id_t word_j = chunk_start; word_j < chunk_end; word_j++) {
+					const word_id_t word = print_order ? print_order[word_j] : word_j;
+					double scores[cmd_args.num_classes];
+					pex_score_word_classes(cmd_args, model_metadata, word, word_counts[word], 0, cmd_args.num_classes, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, scores);
+					float * restrict vector = block_vectors + (size_t)(word_j - block_start) * cmd_args.num_classes;
+					for (wclass_t class = 0; class < cmd_args.num_classes; class++)
+						vector[class] = -(float)scores[class];
+				}
+				chunk_start = chunk_end;
+				chunk_cost  = 0;
+			}
+			#pragma omp taskwait
+
+			for (word_id_t word_i = block_start; word_i < block_end; word_i++) {
+				const float * restrict vector = block_vectors + (size_t)(word_i - block_start) * cmd_args.num_classes;
+				fprintf(out_file, "%s ", word_list[print_order ? print_order[word_i] : word_i]);
+				if (cmd_args.print_word_vectors == TEXT_VEC)
+					fprint_arrayf(out_file, vector, cmd_args.num_classes, " ");
+				else
+					fwrite(vector, sizeof(float), cmd_args.num_classes, out_file);
+			}
+		}
 	}
 
+	free(block_vectors);
 	free_count_arrays(cmd_args, count_arrays);
 	free(count_arrays);
-	free(entropy_terms);
 }
 
-void post_exchange_brown_cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const unsigned int word_counts[const], wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts, count_arrays_t count_arrays) {
-
-	// Build precomputed entropy terms
-	float * restrict entropy_terms = malloc(ENTROPY_TERMS_MAX * sizeof(float));
-	build_entropy_terms(cmd_args, entropy_terms, ENTROPY_TERMS_MAX);
-
-	// Convert word2class to an array of classes pointing to arrays of words, which will successively get merged together
-	struct_class_listing class2words[cmd_args.num_classes];
-	memset(class2words, 0, sizeof(struct_class_listing) * cmd_args.num_classes);
-	get_class_listing(cmd_args, model_metadata, word2class, class2words); // invert word2class array so that we know what words are associated with a given class
-
-	// Loop through classes, finding best pair of classes to merge.  Use pex_move_word() to find best pairs. Record merges separately to reduce overhead.
-	for (wclass_t total_merges = 0; total_merges < cmd_args.num_classes-1; total_merges++) {
-		// The scores arrays don't need to be private in the OMP parallelization, since each thread is writing to different elements in the array
-		wclass_t scores_1_which[cmd_args.num_classes];
-		double scores_1_val[cmd_args.num_classes];
-		memset(scores_1_which, 0, sizeof(wclass_t) * cmd_args.num_classes);
-		memset(scores_1_val, 0, sizeof(double) * cmd_args.num_classes);
-
-		#pragma omp parallel for num_threads(cmd_args.num_threads)
-		for (wclass_t class_1 = 0; class_1 < cmd_args.num_classes-1; class_1++) {
-			const size_t scores_2_length = cmd_args.num_classes - class_1;
-			double scores_2[scores_2_length];
-			memset(scores_2, 0, sizeof(double) * scores_2_length);
-
-			for (wclass_t class_2 = class_1+1; class_2 < cmd_args.num_classes; class_2++) {
-				for (size_t word_offset = 0; word_offset < class2words[class_2].length; word_offset++) { // Sum of all words
-					const word_id_t word = class2words[class_2].words[word_offset];
-					scores_2[class_2] += pex_move_word(cmd_args, word, word_counts[word], class_1, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, count_arrays[0], entropy_terms, true);
-				}
-				scores_1_which[class_1] = which_max(scores_2, scores_2_length);
-				scores_1_val[class_1]   = max(scores_2, scores_2_length);
+void post_exchange_brown_cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const unsigned int word_counts[const], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, char * class_bitstrings[restrict]) {
+	// Collapses the exchange algorithm's classes into a num_classes x num_classes matrix of class bigram counts, once, and builds the tree of Brown merges over it.
+	// The classes are then renumbered in the order of their bitstrings
+	const size_t num_classes = cmd_args.num_classes;
+	double * restrict class_bigrams = calloc(num_classes * num_classes, sizeof(double));
+	double * restrict class_counts  = calloc(num_classes, sizeof(double));
+	for (word_id_t word_2 = 0; word_2 < model_metadata.type_count; word_2++) {
+		const struct_word_bigram_cell * restrict cells = word_bigram_cells(word_bigrams, word_2);
+		const size_t length = word_bigram_length(word_bigrams, word_2);
+		double * restrict column = class_bigrams + word2class[word_2];
+		for (size_t i = 0; i < length; i++)
+			column[word2class[cells[i].word] * num_classes] += cells[i].count;
+		class_counts[word2class[word_2]] += word_counts[word_2];
+	}
 
-			}
-			//const double best_pairing_val = max(scores_1_val, cmd_args.num_classes);
-		}
+	wclass_t * restrict class_order = malloc(sizeof(wclass_t) * num_classes);
+	brown_merge_classes(cmd_args, class_bigrams, class_counts, class_order, class_bitstrings);
+	for (word_id_t word = 0; word < model_metadata.type_count; word++)
+		word2class[word] = class_order[word2class[word]];
+	if (cmd_args.verbose >= -1) {
+		fprintf(stderr, "%s: Merged the %'zu classes into a binary tree\n", argv_0_basename, num_classes); fflush(stderr);
 	}
 
-	free_class_listing(cmd_args, class2words);
-	free(entropy_terms);
+	free(class_order);
+	free(class_counts);
+	free(class_bigrams);
 }
 
 
@@ -376,9 +1086,17 @@ void free_class_listing(const struct cmd_args cmd_args, struct_class_listing * r
 		free(class2words[class].words);
 }
 
-void build_entropy_terms(const struct cmd_args cmd_args, float * restrict entropy_terms, const unsigned int entropy_terms_max) {
+float * build_entropy_terms(const struct cmd_args cmd_args) {
+	// Precomputed n*log2(n) terms, built once and shared by everything that scores moves.  With --entropy-table this is the original 40 MB table of
+	// ENTROPY_TERMS_MAX terms.  Otherwise it's just the first ENTROPY_TERMS_SMALL terms, which stay in cache, and bigger ones are computed by fast_n_log2_n()
+	entropy_terms_full = cmd_args.entropy_table;
+	const unsigned long entropy_terms_len = entropy_terms_full ? ENTROPY_TERMS_MAX : ENTROPY_TERMS_SMALL;
+	float * restrict entropy_terms = malloc(entropy_terms_len * sizeof(float));
+
 	entropy_terms[0] = 0.0;
-	#pragma omp parallel for num_threads(cmd_args.num_threads)
-	for (unsigned long i = 1; i < entropy_terms_max; i++)
+	// This runs before cluster() starts its team, so it gets one of its own.  The small table isn't worth threads
+	#pragma omp parallel for num_threads(cmd_args.num_threads) if(entropy_terms_full)
+	for (unsigned long i = 1; i < entropy_terms_len; i++)
 		entropy_terms[i] = i * log2f(i);
+	return entropy_terms;
 }
@@ -8,13 +8,22 @@ typedef struct { // This is for an array pointing to this struct having a pointe
 	unsigned int length;
 } struct_class_listing;
 
-void cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts);
+typedef struct { // A neighbor's <v,c> row, for the bounds in pex_score_classes_bounded()
+	double weight;
+	double floor;  // Least this row can add to a class' score
+	double width;  // Most it can add beyond that
+	word_id_t word;
+	unsigned int bigram_count;
+	bool is_rev;
+} struct_bound_row;
 
-void print_words_and_vectors(FILE * out_file, const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts);
+void cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, const float entropy_terms[const], char * class_bitstrings[restrict]);
 
-void post_exchange_brown_cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const unsigned int word_counts[const], wclass_t word2class[], struct_word_bigram_entry * restrict word_bigrams, struct_word_bigram_entry * restrict word_bigrams_rev, unsigned int * restrict word_class_counts, unsigned int * restrict word_class_rev_counts, count_arrays_t count_arrays);
+void print_words_and_vectors(FILE * out_file, const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_sent_int_info * const sent_store_int, const unsigned int word_counts[const], char * word_list[restrict], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev, struct_word_class_counts * restrict word_class_counts, struct_word_class_counts * restrict word_class_rev_counts, const float entropy_terms[const], const word_id_t print_order[const]);
 
-void build_entropy_terms(const struct cmd_args cmd_args, float * restrict entropy_terms, const unsigned int entropy_terms_max);
+void post_exchange_brown_cluster(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const unsigned int word_counts[const], wclass_t word2class[], const struct_word_bigram_listing * restrict word_bigrams, char * class_bitstrings[restrict]);
+
+float * build_entropy_terms(const struct cmd_args cmd_args);
 
 void get_class_listing(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const wclass_t word2class[const], struct_class_listing * restrict class2words);
 void free_class_listing(const struct cmd_args cmd_args, struct_class_listing * restrict class2words);
@@ -41,10 +41,10 @@
 #endif
 
 typedef struct {
-	struct_map_word *word_map;
-	struct_map_word *word_word_map;
-	struct_map_word *ngram_map;
-	struct_map_word *class_map;
+	struct_map_word_table *word_map;
+	struct_map_word_table *word_word_map;
+	struct_map_word_table *ngram_map;
+	struct_map_word_table *class_map;
 	char **unique_words;
 } struct_model_maps;
 
@@ -3,8 +3,8 @@
 
 #include "clustercat.h"
 
-void print_word_class_counts(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_class_count_t * restrict word_class_counts);
+void print_word_class_counts(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_word_class_counts * restrict word_class_counts);
 
-void print_word_bigrams(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_word_bigram_entry * restrict word_bigrams);
+void print_word_bigrams(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const struct_word_bigram_listing * restrict word_bigrams);
 
 #endif // INCLUDE_HEADER
@@ -1,28 +1,790 @@
+#define _POSIX_C_SOURCE 200112L // mmap(), posix_madvise(), fstat(), glob(), opendir()
 #include <zlib.h>		// Strongly recommended to use zlib-1.2.5 or newer
 #include <stdio.h>
+#include <fcntl.h>		// open()
+#include <unistd.h>		// close(), dup()
+#include <sys/mman.h>	// mmap()
+#include <sys/stat.h>	// fstat()
+#include <limits.h>		// INT_MAX
+#include <glob.h>		// glob()
+#include <dirent.h>		// opendir()
+#ifdef HAVE_ZSTD
+#include <zstd.h>		// Build with:  make CFLAGS=-DHAVE_ZSTD LDLIBS='-lm -lz -lzstd'
+#endif
 #include "clustercat.h"
 #include "clustercat-data.h"
 #include "clustercat-array.h"
 #include "clustercat-io.h"
 
-long fill_sent_buffer(FILE *file, char * restrict sent_buffer[], const long max_sents_in_buffer) {
-	char line_in[STDIN_SENT_MAX_CHARS];
-	long sent_buffer_num = 0;
-	unsigned int strlen_line_in = 0;
+#define CORPUS_READ_CHUNK   (1 << 22) // Bytes read at a time when the corpus can't be mapped
+#define CORPUS_LINES_INITIAL (1 << 16)
+#define CORPUS_STREAM_BLOCK (1 << 25) // Bytes per block with --stream
+#define CORPUS_INFLATE_CHUNK (1 << 20) // Initial output buffer for each compressed member/frame.  It doubles as needed
+#define CORPUS_SOURCE_CHUNK  (1 << 20) // Compressed bytes read at a time with --stream
+#define CORPUS_LIST_LINE     4096      // Longest path in an @file list
+#define CORPUS_SAMPLE_SEED   0x5EED5A3F1E5ULL // So that --tune-sample takes the same lines every run
 
-	while (sent_buffer_num < max_sents_in_buffer) {
-		if (! fgets(line_in, STDIN_SENT_MAX_CHARS, file))
+enum { CORPUS_PLAIN, CORPUS_GZIP, CORPUS_ZSTD };
+
+typedef struct { // One decompressed gzip member or zstd frame
+	char * text;
+	size_t length;
+	size_t consumed;   // Compressed bytes
+} struct_corpus_piece;
+
+static int corpus_compression(const unsigned char * restrict data, const size_t length) { // By magic number
+	if (length >= 2  &&  data[0] == 0x1f  &&  data[1] == 0x8b)
+		return CORPUS_GZIP;
+	if (length >= 4  &&  data[0] == 0x28  &&  data[1] == 0xb5  &&  data[2] == 0x2f  &&  data[3] == 0xfd)
+		return CORPUS_ZSTD;
+	return CORPUS_PLAIN;
+}
+
+static bool grow_piece(struct_corpus_piece * restrict piece, size_t * restrict capacity) {
+	*capacity *= 2;
+	char * text = realloc(piece->text, *capacity);
+	if (text == NULL)
+		return false;
+	piece->text = text;
+	return true;
+}
+
+static bool inflate_gzip_member(const unsigned char * restrict raw, const size_t raw_length, struct_corpus_piece * restrict piece) { // Decompresses just the member at the start of raw.  Returns false if it isn't a valid member
+	z_stream strm = {0};
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) // 16: gzip header and trailer
+		return false;
+	size_t capacity = CORPUS_INFLATE_CHUNK;
+	size_t fed = 0;
+	piece->text   = malloc(capacity);
+	piece->length = 0;
+	int ret = Z_OK;
+	while (piece->text) {
+		if (strm.avail_in == 0  &&  fed < raw_length) { // avail_in & avail_out are only 32 bits wide
+			strm.next_in  = (unsigned char *)raw + fed;
+			strm.avail_in = raw_length - fed < (1u << 30) ? raw_length - fed : (1u << 30);
+			fed += strm.avail_in;
+		}
+		if (piece->length == capacity  &&  !grow_piece(piece, &capacity))
+			break;
+		strm.next_out  = (unsigned char *)piece->text + piece->length;
+		strm.avail_out = capacity - piece->length < (1u << 30) ? capacity - piece->length : (1u << 30);
+		const uInt avail_out = strm.avail_out;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		piece->length += avail_out - strm.avail_out;
+		if (ret == Z_STREAM_END  ||  (ret != Z_OK  &&  ret != Z_BUF_ERROR)  ||  (ret == Z_BUF_ERROR  &&  fed == raw_length  &&  strm.avail_in == 0))
+			break;
+	}
+	piece->consumed = fed - strm.avail_in;
+	inflateEnd(&strm);
+	if (ret != Z_STREAM_END) {
+		free(piece->text);
+		piece->text = NULL;
+		return false;
+	}
+	return true;
+}
+
+static struct_corpus_piece * decompress_gzip(const unsigned char * restrict raw, const size_t raw_length, const unsigned int num_threads, size_t * restrict num_pieces) {
+	// Member boundaries aren't known until a member is decompressed.  So every place that looks like a gzip header gets decompressed at once, in parallel.
+	// Then we follow the chain of real members from the start of the file, which is the same text that gzip -d would give us.
+	// The rest are false starts inside compressed data, and those almost always fail within a few bytes
+	size_t num_starts = 0, starts_capacity = 64;
+	size_t * restrict starts = malloc(sizeof(size_t) * starts_capacity);
+	for (const unsigned char * magic = raw; (magic = memchr(magic, 0x1f, raw + raw_length - magic)); magic++) {
+		const size_t pos = magic - raw;
+		if (raw_length - pos < 20  ||  magic[1] != 0x8b  ||  magic[2] != 8  ||  (magic[3] & 0xe0)) // Deflate, and no reserved flags.  The smallest member is 20 bytes
+			continue;
+		if (num_starts == starts_capacity) {
+			starts_capacity *= 2;
+			starts = realloc(starts, sizeof(size_t) * starts_capacity);
+		}
+		starts[num_starts++] = pos;
+	}
+
+	struct_corpus_piece * restrict attempts = calloc(num_starts ? num_starts : 1, sizeof(struct_corpus_piece));
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+	for (size_t i = 0; i < num_starts; i++)
+		inflate_gzip_member(raw + starts[i], raw_length - starts[i], &attempts[i]);
+
+	struct_corpus_piece * restrict pieces = malloc(sizeof(struct_corpus_piece) * (num_starts ? num_starts : 1));
+	*num_pieces = 0;
+	size_t pos = 0, i = 0;
+	bool corrupt = false;
+	while (pos < raw_length) {
+		while (i < num_starts  &&  starts[i] < pos)
+			i++;
+		const bool at_header = i < num_starts  &&  starts[i] == pos;
+		if (at_header  &&  attempts[i].text) {
+			pieces[(*num_pieces)++] = attempts[i];
+			attempts[i].text = NULL;
+			pos += attempts[i].consumed;
+			continue;
+		}
+		if (at_header  ||  *num_pieces == 0) { // A member that doesn't decompress
+			corrupt = true;
+		} else { // Like gzip -d
+			fprintf(stderr, "%s: Notice: Ignoring %zu bytes of trailing garbage after the last gzip member\n", argv_0_basename, raw_length - pos); fflush(stderr);
+		}
+		break;
+	}
+
+	for (size_t j = 0; j < num_starts; j++)
+		free(attempts[j].text);
+	free(attempts);
+	free(starts);
+	if (corrupt) {
+		fprintf(stderr,  "%s: Error: Corrupt or truncated gzip input, at compressed byte %zu\n", argv_0_basename, pos); fflush(stderr);
+		exit(15);
+	}
+	return pieces;
+}
+
+#ifdef HAVE_ZSTD
+static struct_corpus_piece * decompress_zstd(const unsigned char * restrict raw, const size_t raw_length, const unsigned int num_threads, size_t * restrict num_pieces) {
+	// Unlike gzip, a frame's compressed size can be found from its block headers, without decompressing it.  So we split first, then decompress the frames in parallel
+	size_t capacity = 64;
+	size_t * restrict starts = malloc(sizeof(size_t) * capacity);
+	*num_pieces = 0;
+	for (size_t pos = 0; pos < raw_length; ) {
+		const size_t frame_length = ZSTD_findFrameCompressedSize(raw + pos, raw_length - pos);
+		if (ZSTD_isError(frame_length)) {
+			fprintf(stderr,  "%s: Error: Corrupt or truncated zstd input, at compressed byte %zu: %s\n", argv_0_basename, pos, ZSTD_getErrorName(frame_length)); fflush(stderr);
+			exit(15);
+		}
+		if (*num_pieces + 1 >= capacity) {
+			capacity *= 2;
+			starts = realloc(starts, sizeof(size_t) * capacity);
+		}
+		starts[(*num_pieces)++] = pos;
+		pos += frame_length;
+		starts[*num_pieces] = pos;
+	}
+
+	struct_corpus_piece * restrict pieces = calloc(*num_pieces ? *num_pieces : 1, sizeof(struct_corpus_piece));
+	bool failed = false;
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+	for (size_t i = 0; i < *num_pieces; i++) {
+		struct_corpus_piece * restrict piece = &pieces[i];
+		const unsigned long long content_size = ZSTD_getFrameContentSize(raw + starts[i], starts[i+1] - starts[i]);
+		size_t text_capacity = content_size < ZSTD_CONTENTSIZE_ERROR  &&  content_size > 0 ? content_size : CORPUS_INFLATE_CHUNK; // Skippable frames have no content
+		ZSTD_DCtx * dctx = ZSTD_createDCtx();
+		ZSTD_inBuffer in = { raw + starts[i], starts[i+1] - starts[i], 0 };
+		piece->text = malloc(text_capacity);
+		size_t ret = 1;
+		while (piece->text  &&  dctx) {
+			if (piece->length == text_capacity  &&  !grow_piece(piece, &text_capacity))
+				break;
+			ZSTD_outBuffer out = { piece->text, text_capacity, piece->length };
+			ret = ZSTD_decompressStream(dctx, &out, &in);
+			piece->length = out.pos;
+			if (ZSTD_isError(ret)  ||  ret == 0  ||  (in.pos == in.size  &&  out.pos < out.size)) // ret == 0: end of frame
+				break;
+		}
+		ZSTD_freeDCtx(dctx);
+		if (ret != 0) {
+			#pragma omp atomic write
+			failed = true;
+		}
+	}
+	free(starts);
+	if (failed) {
+		fprintf(stderr,  "%s: Error: Unable to decompress zstd input.  It's corrupt or truncated, or we're out of memory\n", argv_0_basename); fflush(stderr);
+		exit(15);
+	}
+	return pieces;
+}
+#endif
+
+static void decompress_corpus(struct_corpus * restrict corpus, const unsigned int num_threads) { // Replaces compressed text with its decompressed text
+	const int compression = corpus_compression((const unsigned char *)corpus->text, corpus->length);
+	if (compression == CORPUS_PLAIN)
+		return;
+
+	size_t num_pieces = 0;
+	struct_corpus_piece * restrict pieces = NULL;
+	if (compression == CORPUS_GZIP) {
+		pieces = decompress_gzip((const unsigned char *)corpus->text, corpus->length, num_threads, &num_pieces);
+	} else {
+#ifdef HAVE_ZSTD
+		pieces = decompress_zstd((const unsigned char *)corpus->text, corpus->length, num_threads, &num_pieces);
+#else
+		fprintf(stderr,  "%s: Error: This build can't read zstd input.  Rebuild with  make CFLAGS=-DHAVE_ZSTD LDLIBS='-lm -lz -lzstd' , or pipe the input through zstdcat\n", argv_0_basename); fflush(stderr);
+		exit(15);
+#endif
+	}
+
+	// Join the pieces, each thread copying its own
+	size_t * restrict offsets = malloc(sizeof(size_t) * (num_pieces + 1));
+	offsets[0] = 0;
+	for (size_t i = 0; i < num_pieces; i++)
+		offsets[i+1] = offsets[i] + pieces[i].length;
+	char * restrict text = malloc(offsets[num_pieces] ? offsets[num_pieces] : 1);
+	if (text == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the decompressed corpus (%zu bytes)\n", argv_0_basename, offsets[num_pieces]); fflush(stderr);
+		exit(7);
+	}
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+	for (size_t i = 0; i < num_pieces; i++) {
+		memcpy(text + offsets[i], pieces[i].text, pieces[i].length);
+		free(pieces[i].text);
+	}
+
+	if (corpus->mapped)
+		munmap((void *)corpus->text, corpus->length);
+	else
+		free((void *)corpus->text);
+	corpus->text   = text;
+	corpus->length = offsets[num_pieces];
+	corpus->mapped = false;
+	free(offsets);
+	free(pieces);
+}
+
+static void index_corpus_lines(struct_corpus * restrict corpus, const unsigned long max_lines) {
+	size_t capacity = CORPUS_LINES_INITIAL;
+	size_t * restrict line_starts = malloc(sizeof(size_t) * capacity);
+	unsigned long num_lines = 0;
+	size_t pos = 0;
+
+	while (pos < corpus->length  &&  num_lines < max_lines) {
+		if (num_lines + 1 >= capacity) { // Keep room for the end offset
+			capacity *= 2;
+			line_starts = realloc(line_starts, sizeof(size_t) * capacity);
+			if (line_starts == NULL) {
+				fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the line index, at line %lu\n", argv_0_basename, num_lines); fflush(stderr);
+				exit(7);
+			}
+		}
+		line_starts[num_lines++] = pos;
+		const char * restrict newline = memchr(corpus->text + pos, '\n', corpus->length - pos);
+		pos = newline ? (size_t)(newline - corpus->text) + 1 : corpus->length;
+	}
+	line_starts[num_lines] = pos;
+
+	corpus->line_starts = line_starts;
+	corpus->num_lines   = num_lines;
+}
+
+static void append_corpus_file(struct_corpus_files * restrict files, const char * restrict name) {
+	files->names = realloc(files->names, sizeof(char *) * (files->num_files + 1));
+	files->names[files->num_files] = malloc(strlen(name) + 1);
+	strcpy(files->names[files->num_files], name);
+	files->num_files++;
+}
+
+static int compare_file_names(const void * a, const void * b) { // Byte order rather than the locale's, so the files' order is the same everywhere
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void add_corpus_path(struct_corpus_files * restrict files, const char * restrict path) { // A directory adds its files, but not its subdirectories or hidden files
+	struct stat path_stat;
+	if (stat(path, &path_stat)  ||  !S_ISDIR(path_stat.st_mode)) { // A missing file is reported when it's opened
+		append_corpus_file(files, path);
+		return;
+	}
+
+	DIR * restrict dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to open input directory \"%s\"\n", argv_0_basename, path); fflush(stderr);
+		exit(15);
+	}
+	char * * restrict names = NULL;
+	size_t num_names = 0;
+	for (struct dirent * entry; (entry = readdir(dir)); ) {
+		if (entry->d_name[0] == '.')
+			continue;
+		char * restrict name = malloc(strlen(path) + strlen(entry->d_name) + 2);
+		sprintf(name, "%s/%s", path, entry->d_name);
+		struct stat entry_stat;
+		if (stat(name, &entry_stat)  ||  !S_ISREG(entry_stat.st_mode)) {
+			free(name);
+			continue;
+		}
+		names = realloc(names, sizeof(char *) * (num_names + 1));
+		names[num_names++] = name;
+	}
+	closedir(dir);
+	if (num_names == 0) {
+		fprintf(stderr,  "%s: Error: Input directory \"%s\" has no files\n", argv_0_basename, path); fflush(stderr);
+		exit(15);
+	}
+	qsort(names, num_names, sizeof(char *), compare_file_names);
+	for (size_t i = 0; i < num_names; i++) {
+		append_corpus_file(files, names[i]);
+		free(names[i]);
+	}
+	free(names);
+}
+
+void add_corpus_files(struct_corpus_files * restrict files, const char * restrict path) { // A file, a directory, a glob pattern, or @ and a file listing any of these, one per line
+	if (path[0] == '@') {
+		FILE * restrict list = fopen(path + 1, "r");
+		if (list == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to open input file list \"%s\"\n", argv_0_basename, path + 1); fflush(stderr);
+			exit(15);
+		}
+		char line[CORPUS_LIST_LINE];
+		while (fgets(line, CORPUS_LIST_LINE, list)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0])
+				add_corpus_files(files, line);
+		}
+		fclose(list);
+	} else if (strpbrk(path, "*?[")) {
+		glob_t matches;
+		if (glob(path, GLOB_NOSORT, NULL, &matches)) {
+			fprintf(stderr,  "%s: Error: No input files match \"%s\"\n", argv_0_basename, path); fflush(stderr);
+			exit(15);
+		}
+		qsort(matches.gl_pathv, matches.gl_pathc, sizeof(char *), compare_file_names);
+		for (size_t i = 0; i < matches.gl_pathc; i++)
+			add_corpus_path(files, matches.gl_pathv[i]);
+		globfree(&matches);
+	} else {
+		add_corpus_path(files, path);
+	}
+}
+
+void free_corpus_files(struct_corpus_files * restrict files) {
+	for (size_t i = 0; i < files->num_files; i++)
+		free(files->names[i]);
+	free(files->names);
+	*files = (struct_corpus_files){0};
+}
+
+static void read_corpus_stream(FILE *file, const unsigned long max_lines, struct_corpus * restrict corpus) { // For stdin, pipes, and the like.  Stops reading once it has max_lines lines
+	size_t capacity = CORPUS_READ_CHUNK;
+	size_t length = 0;
+	unsigned long num_newlines = 0;
+	bool compressed = false; // Then newlines don't mean anything yet, so read it all
+	char * restrict text = malloc(capacity);
+
+	while (compressed  ||  num_newlines < max_lines) {
+		if (capacity - length < CORPUS_READ_CHUNK) {
+			capacity *= 2;
+			text = realloc(text, capacity);
+		}
+		if (text == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the corpus, after %'lu lines.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, num_newlines, max_lines); fflush(stderr);
+			exit(7);
+		}
+		const size_t bytes_read = fread(text + length, 1, CORPUS_READ_CHUNK, file);
+		if (!bytes_read)
+			break;
+		if (length == 0)
+			compressed = corpus_compression((const unsigned char *)text, bytes_read) != CORPUS_PLAIN;
+		for (const char * restrict newline = text + length; (newline = memchr(newline, '\n', text + length + bytes_read - newline)); newline++)
+			num_newlines++;
+		length += bytes_read;
+	}
+
+	corpus->text   = text;
+	corpus->length = length;
+	corpus->mapped = false;
+}
+
+static void read_corpus_file(const char * restrict file_name, const unsigned long max_lines, const unsigned int num_threads, struct_corpus * restrict corpus) { // Reads plain, gzip'd, or zstd-compressed text
+	*corpus = (struct_corpus){0};
+
+	if (file_name == NULL) {
+		read_corpus_stream(stdin, max_lines, corpus);
+	} else {
+		const int fd = open(file_name, O_RDONLY);
+		struct stat file_stat;
+		if (fd < 0  ||  fstat(fd, &file_stat)) {
+			fprintf(stderr,  "%s: Error: Unable to open input file \"%s\"\n", argv_0_basename, file_name); fflush(stderr);
+			exit(15);
+		}
+
+		if (S_ISREG(file_stat.st_mode)  &&  file_stat.st_size > 0) { // Tokenize directly from the page cache
+			void * mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				posix_madvise(mapping, file_stat.st_size, POSIX_MADV_SEQUENTIAL);
+				corpus->text   = mapping;
+				corpus->length = file_stat.st_size;
+				corpus->mapped = true;
+			}
+		}
+
+		if (!corpus->mapped) { // Empty files, named pipes, and filesystems that don't support mmap
+			FILE *file = fdopen(fd, "r");
+			read_corpus_stream(file, max_lines, corpus);
+			fclose(file);
+		} else {
+			close(fd);
+		}
+	}
+
+	decompress_corpus(corpus, num_threads ? num_threads : 1);
+	index_corpus_lines(corpus, max_lines);
+}
+
+void read_corpus(const struct_corpus_files * restrict files, const unsigned long max_lines, const unsigned int num_threads, struct_corpus * restrict corpus) {
+	// Several files are read a wave of num_threads at a time, each by its own thread, until there are max_lines lines.  Their lines are then indexed in the
+	// order the files were given, so the sentence store's order doesn't depend on which file was read first
+	if (files->num_files <= 1) {
+		read_corpus_file(files->num_files ? files->names[0] : NULL, max_lines, num_threads, corpus);
+		return;
+	}
+
+	const unsigned int wave_size = num_threads ? num_threads : 1;
+	struct_corpus * restrict file_corpora = calloc(files->num_files, sizeof(struct_corpus));
+	size_t num_read = 0;
+	unsigned long num_lines = 0;
+	while (num_read < files->num_files  &&  num_lines < max_lines) {
+		const size_t wave = files->num_files - num_read < wave_size ? files->num_files - num_read : wave_size;
+		const unsigned long lines_wanted = max_lines - num_lines;
+		#pragma omp parallel for num_threads(wave) schedule(dynamic, 1)
+		for (size_t file_i = num_read; file_i < num_read + wave; file_i++)
+			read_corpus_file(files->names[file_i], lines_wanted, wave_size / wave, &file_corpora[file_i]);
+		for (size_t file_i = num_read; file_i < num_read + wave; file_i++)
+			num_lines += file_corpora[file_i].num_lines;
+		num_read += wave;
+	}
+
+	*corpus = (struct_corpus){0};
+	corpus->parts = malloc(sizeof(struct_corpus_part) * num_read);
+	corpus->line_starts = malloc(sizeof(size_t) * ((num_lines < max_lines ? num_lines : max_lines) + 1));
+	if (corpus->line_starts == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the line index, with %lu lines\n", argv_0_basename, num_lines); fflush(stderr);
+		exit(7);
+	}
+	size_t offset = 0;
+	for (size_t file_i = 0; file_i < num_read; file_i++) {
+		struct_corpus * restrict file_corpus = &file_corpora[file_i];
+		const unsigned long lines_kept = file_corpus->num_lines < max_lines - corpus->num_lines ? file_corpus->num_lines : max_lines - corpus->num_lines;
+		if (lines_kept == 0) { // Empty, or past max_lines
+			free_corpus(file_corpus);
+			continue;
+		}
+		corpus->parts[corpus->num_parts++] = (struct_corpus_part){ .text = file_corpus->text, .start = offset, .length = file_corpus->length, .mapped = file_corpus->mapped };
+		for (unsigned long line = 0; line < lines_kept; line++)
+			corpus->line_starts[corpus->num_lines + line] = offset + file_corpus->line_starts[line];
+		offset += file_corpus->line_starts[lines_kept];
+		corpus->num_lines += lines_kept;
+		free(file_corpus->line_starts);
+	}
+	corpus->line_starts[corpus->num_lines] = offset;
+	corpus->length = offset;
+	free(file_corpora);
+}
+
+size_t corpus_memusage(const struct_corpus * restrict corpus) { // Mapped text is in the page cache, so we don't count it
+	size_t text_bytes = corpus->mapped ? 0 : corpus->length;
+	if (corpus->parts) {
+		text_bytes = 0;
+		for (size_t part = 0; part < corpus->num_parts; part++)
+			text_bytes += corpus->parts[part].mapped ? 0 : corpus->parts[part].length;
+	}
+	return sizeof(size_t) * (corpus->num_lines + 1) + text_bytes;
+}
+
+void free_corpus(struct_corpus * restrict corpus) {
+	if (corpus->parts) {
+		for (size_t part = 0; part < corpus->num_parts; part++) {
+			if (corpus->parts[part].mapped)
+				munmap((void *)corpus->parts[part].text, corpus->parts[part].length);
+			else
+				free((void *)corpus->parts[part].text);
+		}
+		free(corpus->parts);
+	} else if (corpus->mapped) {
+		munmap((void *)corpus->text, corpus->length);
+	} else {
+		free((void *)corpus->text);
+	}
+	free(corpus->line_starts);
+	*corpus = (struct_corpus){0};
+}
+
+static void open_corpus_source(struct_corpus_stream * restrict stream) { // zlib reads plain text and gzip'd text alike.  We look for zstd's magic number ourselves
+	const char * restrict file_name = stream->files->num_files ? stream->files->names[stream->file_i] : NULL;
+	gzFile gz = file_name ? gzopen(file_name, "rb") : gzdopen(dup(fileno(stdin)), "rb");
+	if (gz == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to open input file \"%s\"\n", argv_0_basename, file_name ? file_name : "stdin"); fflush(stderr);
+		exit(15);
+	}
+	stream->file_bytes = 0;
+	gzbuffer(gz, CORPUS_SOURCE_CHUNK);
+	stream->gz = gz;
+	if (stream->source_buffer == NULL)
+		stream->source_buffer = malloc(CORPUS_SOURCE_CHUNK);
+	const int bytes_read = gzread(gz, stream->source_buffer, CORPUS_SOURCE_CHUNK);
+	stream->source_pos    = 0;
+	stream->source_length = bytes_read > 0 ? bytes_read : 0;
+
+	if (corpus_compression(stream->source_buffer, stream->source_length) == CORPUS_ZSTD) {
+#ifdef HAVE_ZSTD
+		stream->zstd = ZSTD_createDStream();
+		ZSTD_initDStream(stream->zstd);
+#else
+		fprintf(stderr,  "%s: Error: This build can't read zstd input.  Rebuild with  make CFLAGS=-DHAVE_ZSTD LDLIBS='-lm -lz -lzstd' , or pipe the input through zstdcat\n", argv_0_basename); fflush(stderr);
+		exit(15);
+#endif
+	}
+}
+
+static void close_corpus_source(struct_corpus_stream * restrict stream) {
+	if (stream->gz)
+		gzclose(stream->gz);
+#ifdef HAVE_ZSTD
+	ZSTD_freeDStream(stream->zstd);
+#endif
+	stream->gz   = NULL;
+	stream->zstd = NULL;
+	stream->zstd_mid_frame = false;
+}
+
+static size_t read_corpus_source(struct_corpus_stream * restrict stream, char * restrict buffer, const size_t bytes_wanted) { // Like fread(), but decompresses
+	if (stream->gz == NULL)
+		return fread(buffer, 1, bytes_wanted, stream->file);
+
+	size_t length = 0;
+	while (length < bytes_wanted) {
+		if (stream->source_pos == stream->source_length) {
+			const int bytes_read = gzread(stream->gz, stream->source_buffer, CORPUS_SOURCE_CHUNK);
+			int errnum = Z_OK;
+			const char * error = gzerror(stream->gz, &errnum);
+			if (bytes_read < 0  ||  errnum != Z_OK) { // Z_BUF_ERROR is a truncated gzip member
+				fprintf(stderr,  "%s: Error: Unable to read input: %s\n", argv_0_basename, error); fflush(stderr);
+				exit(15);
+			}
+			stream->source_pos    = 0;
+			stream->source_length = bytes_read;
+			if (bytes_read == 0) {
+				if (stream->zstd_mid_frame) {
+					fprintf(stderr,  "%s: Error: Truncated zstd input\n", argv_0_basename); fflush(stderr);
+					exit(15);
+				}
+				if (stream->file_i + 1 >= stream->files->num_files)
+					break;
+				if (stream->file_bytes  &&  stream->last_char != '\n') // The file's last line ends with the file
+					buffer[length++] = stream->last_char = '\n';
+				close_corpus_source(stream);
+				stream->file_i++;
+				open_corpus_source(stream);
+				continue;
+			}
+		}
+#ifdef HAVE_ZSTD
+		if (stream->zstd) {
+			ZSTD_inBuffer in   = { stream->source_buffer, stream->source_length, stream->source_pos };
+			ZSTD_outBuffer out = { buffer, bytes_wanted, length };
+			const size_t ret = ZSTD_decompressStream(stream->zstd, &out, &in);
+			if (ZSTD_isError(ret)) {
+				fprintf(stderr,  "%s: Error: Corrupt zstd input: %s\n", argv_0_basename, ZSTD_getErrorName(ret)); fflush(stderr);
+				exit(15);
+			}
+			stream->source_pos = in.pos;
+			stream->zstd_mid_frame = ret != 0;
+			if (out.pos > length) {
+				stream->file_bytes += out.pos - length;
+				stream->last_char = buffer[out.pos - 1];
+			}
+			length = out.pos;
+			continue;
+		}
+#endif
+		const size_t bytes_copied = stream->source_length - stream->source_pos < bytes_wanted - length ? stream->source_length - stream->source_pos : bytes_wanted - length;
+		memcpy(buffer + length, stream->source_buffer + stream->source_pos, bytes_copied);
+		stream->source_pos += bytes_copied;
+		length += bytes_copied;
+		stream->file_bytes += bytes_copied;
+		if (bytes_copied)
+			stream->last_char = buffer[length - 1];
+	}
+	return length;
+}
+
+void open_corpus_stream(const struct_corpus_files * restrict files, const unsigned long max_lines, const bool rereadable, struct_corpus_stream * restrict stream) { // Reads plain, gzip'd, or zstd-compressed text
+	*stream = (struct_corpus_stream){0};
+	stream->max_lines = max_lines;
+	stream->files = files;
+	if (files->num_files == 0  &&  rereadable) {
+		stream->spool = tmpfile();
+		if (stream->spool == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to create a temporary file for reading stdin more than once.  Use --in instead\n", argv_0_basename); fflush(stderr);
+			exit(15);
+		}
+	}
+	open_corpus_source(stream);
+	stream->capacity = CORPUS_STREAM_BLOCK;
+	stream->buffer   = malloc(stream->capacity);
+}
+
+bool read_corpus_block(struct_corpus_stream * restrict stream) { // Reads the next block of whole lines into stream->block.  Returns false once there are no more
+	free(stream->block.line_starts);
+	stream->block.line_starts = NULL;
+	if (stream->lines_read >= stream->max_lines)
+		return false;
+
+	// Move the partial line left over from the last block to the front, then fill up the rest of the buffer.  The buffer gets bigger if a single line doesn't fit
+	memmove(stream->buffer, stream->buffer + stream->length - stream->carry, stream->carry);
+	stream->length = stream->carry;
+	size_t block_length = 0;
+	while (true) {
+		bool at_end = false;
+		while (!at_end  &&  stream->length < stream->capacity) {
+			const size_t bytes_wanted = stream->capacity - stream->length;
+			const size_t bytes_read = read_corpus_source(stream, stream->buffer + stream->length, bytes_wanted);
+			if (stream->spool  &&  bytes_read)
+				fwrite(stream->buffer + stream->length, 1, bytes_read, stream->spool);
+			stream->length += bytes_read;
+			at_end = bytes_read < bytes_wanted;
+		}
+		if (at_end) {
+			block_length = stream->length;
 			break;
-		else {
-			strlen_line_in = strlen(line_in); // We'll need this a couple times;  strnlen isn't in C standard :-(
-			if (strlen_line_in == STDIN_SENT_MAX_CHARS-1)
-				fprintf(stderr, "\n%s: Notice: Input line too long, at buffer line %li. The full line was:\n%s\n", argv_0_basename, sent_buffer_num+1, line_in);
-			sent_buffer[sent_buffer_num] = (char *)malloc(1+ strlen_line_in * sizeof(char *));
-			strncpy(sent_buffer[sent_buffer_num], line_in, 1+strlen_line_in);
-			//printf("fill_sent_buffer 7: sent_buffer_num=%li, line_in=<<%s>>, strlen_line_in=%u, sent_in=<<%s>>\n", sent_buffer_num, line_in, strlen_line_in, sent_buffer[sent_buffer_num]); fflush(stdout);
-			sent_buffer_num++;
-		}
-	}
-	//printf("fill_sent_buffer 99: sent_buffer_num=%li\n", sent_buffer_num);
-	return sent_buffer_num;
+		}
+
+		size_t pos = stream->length;
+		while (pos > 0  &&  stream->buffer[pos-1] != '\n') // Usually just a short way back
+			pos--;
+		if (pos > 0) {
+			block_length = pos;
+			break;
+		}
+
+		stream->capacity *= 2;
+		stream->buffer = realloc(stream->buffer, stream->capacity);
+		if (stream->buffer == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for input line %lu\n", argv_0_basename, stream->lines_read + 1); fflush(stderr);
+			exit(7);
+		}
+	}
+
+	stream->carry = stream->length - block_length;
+	if (block_length == 0)
+		return false;
+
+	stream->block = (struct_corpus){ .text = stream->buffer, .length = block_length, .first_line = stream->lines_read };
+	index_corpus_lines(&stream->block, stream->max_lines - stream->lines_read);
+	stream->lines_read += stream->block.num_lines;
+	return true;
+}
+
+void rewind_corpus_stream(struct_corpus_stream * restrict stream) { // For another pass over the same lines
+	close_corpus_source(stream);
+	if (stream->spool) { // Read stdin's decompressed copy from now on
+		fflush(stream->spool);
+		stream->file  = stream->spool;
+		stream->spool = NULL;
+	}
+	stream->file_i = 0;
+	stream->last_char = '\0';
+	if (stream->file)
+		rewind(stream->file);
+	else
+		open_corpus_source(stream);
+	stream->length     = 0;
+	stream->carry      = 0;
+	stream->lines_read = 0;
+}
+
+void close_corpus_stream(struct_corpus_stream * restrict stream) {
+	close_corpus_source(stream);
+	if (stream->file)
+		fclose(stream->file);
+	if (stream->spool)
+		fclose(stream->spool);
+	free(stream->source_buffer);
+	free(stream->block.line_starts);
+	free(stream->buffer);
+	*stream = (struct_corpus_stream){0};
+}
+
+static inline double sample_random(struct_corpus_sample * restrict sample) { // Uniform in (0,1), from splitmix64
+	uint64_t z = (sample->rng += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return ((z >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static void skip_sample_lines(struct_corpus_sample * restrict sample) { // Algorithm L's jump from the line just taken to the next one that goes into a full sample
+	const double skip = floor(log(sample_random(sample)) / log1p(-sample->w));
+	sample->next_line = skip < (double)(ULONG_MAX - sample->next_line - 1) ? sample->next_line + (unsigned long)skip + 1 : ULONG_MAX;
+}
+
+void init_corpus_sample(struct_corpus_sample * restrict sample, const unsigned long size) {
+	*sample = (struct_corpus_sample){ .size = size, .rng = CORPUS_SAMPLE_SEED };
+	sample->w = exp(log(sample_random(sample)) / size);
+	if (size == 0)
+		sample->next_line = ULONG_MAX;
+}
+
+void sample_corpus_block(struct_corpus_sample * restrict sample, const struct_corpus * restrict block) { // Which lines are taken only depends on their line numbers, so it's the same for any block size or --jobs
+	const unsigned long block_end = block->first_line + block->num_lines;
+	while (sample->next_line < block_end) {
+		size_t line_length;
+		const char * restrict line = corpus_line(block, sample->next_line - block->first_line, &line_length);
+		const bool filling = sample->num_lines < sample->size;
+		unsigned long slot;
+		if (filling) {
+			if (sample->num_lines == sample->capacity) {
+				sample->capacity = sample->capacity ? 2 * sample->capacity : CORPUS_LINES_INITIAL;
+				if (sample->capacity > sample->size)
+					sample->capacity = sample->size;
+				sample->lines = realloc(sample->lines, sizeof(struct_sample_line) * sample->capacity);
+				if (sample->lines == NULL) {
+					fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the sample of lines.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, sample->size); fflush(stderr);
+					exit(8);
+				}
+			}
+			slot = sample->num_lines++;
+		} else { // Replaces a random line in the sample
+			slot = (unsigned long)(sample_random(sample) * sample->size);
+			sample->text_bytes -= sample->lines[slot].length;
+			free(sample->lines[slot].text);
+		}
+
+		char * restrict text = malloc(line_length ? line_length : 1);
+		if (text == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the sample of lines.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, sample->size); fflush(stderr);
+			exit(8);
+		}
+		memcpy(text, line, line_length);
+		sample->lines[slot] = (struct_sample_line){ .text = text, .length = line_length, .line = sample->next_line };
+		sample->text_bytes += line_length;
+
+		if (!filling) // Each replacement makes the next one less likely
+			sample->w *= exp(log(sample_random(sample)) / sample->size);
+		if (sample->num_lines < sample->size)
+			sample->next_line++;
+		else
+			skip_sample_lines(sample);
+	}
+}
+
+static int compare_sample_lines(const void * a, const void * b) {
+	const unsigned long line_a = ((const struct_sample_line *)a)->line, line_b = ((const struct_sample_line *)b)->line;
+	return (line_a > line_b) - (line_a < line_b);
+}
+
+void corpus_from_sample(struct_corpus_sample * restrict sample, struct_corpus * restrict corpus) { // The sampled lines, in their order in the corpus.  Frees the sample
+	if (sample->num_lines) // Otherwise lines is still NULL
+		qsort(sample->lines, sample->num_lines, sizeof(struct_sample_line), compare_sample_lines);
+	*corpus = (struct_corpus){0};
+	char * restrict text = malloc(sample->text_bytes + sample->num_lines + 1); // Room for a newline after a last line without one
+	corpus->line_starts = malloc(sizeof(size_t) * (sample->num_lines + 1));
+	if (text == NULL || corpus->line_starts == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for the sample of lines.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, sample->size); fflush(stderr);
+		exit(8);
+	}
+
+	size_t length = 0;
+	for (unsigned long i = 0; i < sample->num_lines; i++) {
+		corpus->line_starts[i] = length;
+		memcpy(text + length, sample->lines[i].text, sample->lines[i].length);
+		length += sample->lines[i].length;
+		if (sample->lines[i].length == 0  ||  text[length-1] != '\n')
+			text[length++] = '\n';
+		free(sample->lines[i].text);
+	}
+	corpus->line_starts[sample->num_lines] = length;
+	corpus->text      = text;
+	corpus->length    = length;
+	corpus->num_lines = sample->num_lines;
+	free(sample->lines);
+	*sample = (struct_corpus_sample){0};
 }
@@ -5,6 +5,35 @@
 #include "clustercat-data.h"
 
 // Import
-long fill_sent_buffer(FILE *file, char * restrict sent_buffer[], const long max_sents_in_buffer);
+void add_corpus_files(struct_corpus_files * restrict files, const char * restrict path);
+void free_corpus_files(struct_corpus_files * restrict files);
+void read_corpus(const struct_corpus_files * restrict files, const unsigned long max_lines, const unsigned int num_threads, struct_corpus * restrict corpus);
+size_t corpus_memusage(const struct_corpus * restrict corpus);
+void free_corpus(struct_corpus * restrict corpus);
+void open_corpus_stream(const struct_corpus_files * restrict files, const unsigned long max_lines, const bool rereadable, struct_corpus_stream * restrict stream);
+bool read_corpus_block(struct_corpus_stream * restrict stream);
+void rewind_corpus_stream(struct_corpus_stream * restrict stream);
+void close_corpus_stream(struct_corpus_stream * restrict stream);
+void init_corpus_sample(struct_corpus_sample * restrict sample, const unsigned long size);
+void sample_corpus_block(struct_corpus_sample * restrict sample, const struct_corpus * restrict block);
+void corpus_from_sample(struct_corpus_sample * restrict sample, struct_corpus * restrict corpus);
+
+// Lines aren't null-terminated, and include their trailing newline, if any
+static inline const char * corpus_line(const struct_corpus * restrict corpus, const unsigned long line, size_t * restrict line_length) {
+	const size_t start = corpus->line_starts[line];
+	*line_length = corpus->line_starts[line+1] - start;
+	if (corpus->parts == NULL)
+		return corpus->text + start;
+
+	size_t low = 0, high = corpus->num_parts; // The last part that starts at or before the line.  Parts aren't empty, so it's the one the line is in
+	while (high - low > 1) {
+		const size_t mid = (low + high) / 2;
+		if (corpus->parts[mid].start <= start)
+			low = mid;
+		else
+			high = mid;
+	}
+	return corpus->parts[low].text + (start - corpus->parts[low].start);
+}
 
 #endif // INCLUDE_HEADER
@@ -1,92 +1,176 @@
 #include "clustercat-map.h"
 
-inline void map_increment_bigram(struct_map_bigram **map, const struct_word_bigram * bigram) {
-	struct_map_bigram *local_s;
-	HASH_FIND(hh, *map, bigram, sizeof(struct_word_bigram), local_s); // id already in the hash?
-	if (local_s == NULL) {
-		local_s = (struct_map_bigram *)malloc(sizeof(struct_map_bigram));
-		//memcpy(local_s->key, bigram, sizeof(struct_word_bigram));
-		local_s->key = *bigram;
-		local_s->count = 1;
-		HASH_ADD(hh, *map, key, sizeof(struct_word_bigram), local_s);
-	} else {
-		(local_s->count)++;
+static size_t malloc_chunk_bytes(const size_t bytes) { // glibc's usual malloc() overhead:  an 8-byte header, and 16-byte granularity, with 32 bytes at least
+	const size_t chunk = (bytes + 8 + 15) & ~(size_t)15;
+	return chunk < 32 ? 32 : chunk;
+}
+
+void * map_pool_alloc(struct_map_pool * restrict pool, const size_t bytes, const size_t align) {
+	struct_map_pool_block * restrict block = pool->blocks;
+	size_t offset = block ? (block->used + align - 1) & ~(align - 1) : 0;
+	if (block == NULL  ||  offset + bytes > block->size) {
+		const size_t size = bytes + align > MAP_POOL_BLOCK ? bytes + align : MAP_POOL_BLOCK;
+		block = malloc(sizeof(struct_map_pool_block) + size);
+		if (block == NULL) {
+			fprintf(stderr, "Error: Unable to allocate enough memory for the vocabulary\n"); fflush(stderr);
+			exit(7);
+		}
+		block->next = pool->blocks;
+		block->size = size;
+		block->used = 0;
+		pool->blocks = block;
+		pool->reserved += sizeof(struct_map_pool_block) + size;
+		offset = (((uintptr_t)(block + 1) + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)(block + 1);
 	}
+	block->used = offset + bytes;
+	pool->malloc_bytes += malloc_chunk_bytes(bytes);
+	return (char *)(block + 1) + offset;
 }
 
-inline void map_add_entry(struct_map_word **map, char * restrict entry_key, const word_count_t count) { // Based on uthash's docs
-	struct_map_word *local_s;
+char * map_pool_strndup(struct_map_pool * restrict pool, const char * restrict string, const size_t length) {
+	char * restrict copy = map_pool_alloc(pool, length + 1, 1);
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	return copy;
+}
 
-	//HASH_FIND_STR(*map, entry_key, local_s); // id already in the hash?
-	//if (local_s == NULL) {
-		local_s = (struct_map_word *)malloc(sizeof(struct_map_word));
-		unsigned short strlen_entry_key = strlen(entry_key);
-		local_s->key = malloc(strlen_entry_key + 1);
-		strcpy(local_s->key, entry_key);
-		HASH_ADD_KEYPTR(hh, *map, local_s->key, strlen_entry_key, local_s);
-	//}
-	local_s->count = count;
+void map_pool_release(struct_map_pool * restrict pool) {
+	for (struct_map_pool_block * block = pool->blocks, * next; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	*pool = (struct_map_pool){0};
 }
 
-inline void map_add_class(struct_map_word_class **map, const char * restrict entry_key, const unsigned long word_count, const wclass_t entry_class) {
-	struct_map_word_class *local_s;
+static void * map_table_alloc(void * restrict old, const size_t bytes) {
+	void * restrict table = realloc(old, bytes ? bytes : 1);
+	if (table == NULL) {
+		fprintf(stderr, "Error: Unable to allocate enough memory for the vocabulary\n"); fflush(stderr);
+		exit(7);
+	}
+	return table;
+}
+
+static void map_relink_keys(struct_map_word_table * restrict map) { // After the entries have moved
+	for (word_id_t i = 0; i < map->num_entries; i++)
+		if (map->entries[i].key_len < MAP_WORD_INLINE)
+			map->entries[i].key = map->entries[i].short_key;
+}
 
-	//HASH_FIND_STR(*map, entry_key, local_s); // id already in the hash?
-	//if (local_s == NULL) {
-		local_s = (struct_map_word_class *)malloc(sizeof(struct_map_word_class));
-		strncpy(local_s->key, entry_key, KEYLEN-1);
-		HASH_ADD_STR(*map, key, local_s);
-	//}
+static size_t map_free_slot(const struct_map_word_table * restrict map, const uint64_t hash) { // First empty or deleted slot in hash's probe sequence
+	const size_t group_mask = map->num_slots / MAP_GROUP - 1;
+	size_t group = hash & group_mask;
+	for (size_t step = 1; ; step++) {
+		const unsigned int free_slots = map_group_free(map->tags + group * MAP_GROUP);
+		if (free_slots)
+			return group * MAP_GROUP + __builtin_ctz(free_slots);
+		group = (group + step) & group_mask;
+	}
+}
+
+static void map_rebuild_slots(struct_map_word_table * restrict map, const size_t num_slots) { // Rehashing just uses the stored hashes
+	free(map->slots);
+	free(map->tags);
+	map->num_slots = num_slots;
+	map->slots = map_table_alloc(NULL, sizeof(word_id_t) * num_slots);
+	map->tags  = map_table_alloc(NULL, num_slots);
+	memset(map->tags, MAP_TAG_EMPTY, num_slots);
+	for (word_id_t i = 0; i < map->num_entries; i++) {
+		if (map->entries[i].deleted)
+			continue;
+		const size_t slot = map_free_slot(map, map->entries[i].hash);
+		map->tags[slot]  = map_tag(map->entries[i].hash);
+		map->slots[slot] = i;
+	}
+	map->num_used_slots = map->num_live;
+}
+
+struct_map_word * map_insert(struct_map_word_table * restrict map, const char * restrict key, const size_t key_len, const uint64_t hash, const word_count_t count) {
+	if ((map->num_used_slots + 1) * 8 > map->num_slots * 7) { // Keep the load at 7/8 or less.  If it's mostly deleted slots, this just clears them out
+		size_t num_slots = MAP_GROUP;
+		while ((size_t)(map->num_live + 1) * 16 > num_slots * 7)
+			num_slots *= 2;
+		map_rebuild_slots(map, num_slots);
+	}
+	if (map->num_entries == map->entries_size) {
+		map->entries_size = map->entries_size ? 2 * map->entries_size : 64;
+		map->entries = map_table_alloc(map->entries, sizeof(struct_map_word) * map->entries_size);
+		map_relink_keys(map);
+	}
+
+	struct_map_word * restrict entry = &map->entries[map->num_entries];
+	if (key_len < MAP_WORD_INLINE) {
+		memcpy(entry->short_key, key, key_len);
+		entry->short_key[key_len] = '\0';
+		entry->key = entry->short_key;
+	} else {
+		entry->key = map_pool_strndup(&map->pool, key, key_len);
+	}
+	map->pool.malloc_bytes += malloc_chunk_bytes(sizeof(struct_map_word)) + (key_len < MAP_WORD_INLINE ? malloc_chunk_bytes(key_len + 1) : 0); // What a malloc() per entry and key would take, for reporting
+	entry->hash    = hash;
+	entry->count   = count;
+	entry->word_id = 0;
+	entry->key_len = key_len;
+	entry->deleted = false;
+
+	const size_t slot = map_free_slot(map, hash);
+	if (map->tags[slot] == MAP_TAG_EMPTY)
+		map->num_used_slots++;
+	map->tags[slot]  = map_tag(hash);
+	map->slots[slot] = map->num_entries++;
+	map->num_live++;
+	return entry;
+}
+
+size_t map_memusage(const struct_map_word_table * restrict map) {
+	return sizeof(struct_map_word) * map->entries_size + (sizeof(word_id_t) + 1) * map->num_slots + map->pool.reserved;
+}
+
+void map_add_entry(struct_map_word_table * restrict map, const char * restrict entry_key, const word_count_t count) { // Doesn't check whether entry_key is already there
+	const size_t strlen_entry_key = strlen(entry_key);
+	map_insert(map, entry_key, strlen_entry_key, map_hash(entry_key, strlen_entry_key), count);
+}
+
+void map_add_class(struct_map_word_class **map, struct_map_pool * restrict pool, const char * restrict entry_key, const unsigned long word_count, const wclass_t entry_class) {
+	struct_map_word_class *local_s = map_pool_alloc(pool, sizeof(struct_map_word_class), sizeof(void *));
+	local_s->key = entry_key;
+	HASH_ADD_KEYPTR(hh, *map, local_s->key, strlen(local_s->key), local_s);
 	local_s->word_count = word_count;
 	local_s->class = entry_class;
 }
 
-inline void map_update_class(struct_map_word_class **map, const char * restrict entry_key, const unsigned short entry_class) {
+void map_update_class(struct_map_word_class **map, struct_map_pool * restrict pool, const char * restrict entry_key, const unsigned short entry_class) {
 	struct_map_word_class *local_s;
 
 	HASH_FIND_STR(*map, entry_key, local_s); // id already in the hash?
 	if (local_s == NULL) {
-		local_s = (struct_map_word_class *)malloc(sizeof(struct_map_word_class));
-		strncpy(local_s->key, entry_key, KEYLEN-1);
-		HASH_ADD_STR(*map, key, local_s);
+		local_s = map_pool_alloc(pool, sizeof(struct_map_word_class), sizeof(void *));
+		local_s->key = map_pool_strndup(pool, entry_key, strlen(entry_key));
+		local_s->word_count = 0;
+		HASH_ADD_KEYPTR(hh, *map, local_s->key, strlen(local_s->key), local_s);
 	}
 	local_s->class = entry_class;
 }
 
-inline void map_set_word_id(struct_map_word **map, const char * restrict entry_key, const word_id_t word_id) {
-	struct_map_word *local_s; // local_s->word_id uninitialized here; assign value after filtering
-
-	#pragma omp critical
-	{
-		HASH_FIND_STR(*map, entry_key, local_s); // id already in the hash?
-	}
+inline void map_set_word_id(struct_map_word_table * restrict map, const char * restrict entry_key, const word_id_t word_id) {
+	const size_t strlen_entry_key = strlen(entry_key);
+	struct_map_word *local_s = map_lookup(map, entry_key, strlen_entry_key, map_hash(entry_key, strlen_entry_key));
 	if (local_s == NULL) {
 		printf("Error: word '%s' should already be in word_map\n", entry_key); // Shouldn't happen
 		exit(5);
 	}
-	#pragma omp atomic write
 	local_s->word_id = word_id;
 }
 
-inline word_count_t map_increment_count(struct_map_word **map, const char * restrict entry_key) { // Based on uthash's docs
-	struct_map_word *local_s; // local_s->word_id uninitialized here; assign value after filtering
-
-	#pragma omp critical
-	{
-		HASH_FIND_STR(*map, entry_key, local_s); // id already in the hash?
-		if (local_s == NULL) {
-			local_s = (struct_map_word *)malloc(sizeof(struct_map_word));
-			local_s->count = 0;
-			unsigned short strlen_entry_key = strlen(entry_key);
-			local_s->key = malloc(strlen_entry_key + 1);
-			strcpy(local_s->key, entry_key);
-			HASH_ADD_KEYPTR(hh, *map, local_s->key, strlen_entry_key, local_s);
-		}
+inline struct_map_word * map_intern_len(struct_map_word_table * restrict map, const char * restrict entry_key, const unsigned short entry_key_len, word_id_t * restrict num_entries) { // Increments the count of entry_key, which needn't be null-terminated.  New entries get the next word_id.  Not threadsafe
+	const uint64_t hash = map_hash(entry_key, entry_key_len);
+	struct_map_word *local_s = map_lookup(map, entry_key, entry_key_len, hash);
+	if (local_s == NULL) {
+		local_s = map_insert(map, entry_key, entry_key_len, hash, 0);
+		local_s->word_id = (*num_entries)++;
 	}
-	#pragma omp atomic
-	++local_s->count;
-	//printf("map: count of %s is now %u\n", entry_key, local_s->count);
-	return local_s->count;
+	local_s->count++;
+	return local_s;
 }
 
 inline wclass_count_t map_increment_count_fixed_width(struct_map_class **map, const wclass_t entry_key[const]) { // Based on uthash's docs
@@ -125,53 +209,48 @@ inline wclass_count_t map_find_count_fixed_width(struct_map_class *map[const], c
 	return local_count;
 }
 
-inline word_count_t map_update_count(struct_map_word **map, const char * restrict entry_key, const word_count_t count) { // Based on uthash's docs
-	struct_map_word *local_s;
-
-	#pragma omp critical
-	{
-		HASH_FIND_STR(*map, entry_key, local_s); // id already in the hash?
-		if (local_s == NULL) {
-			local_s = (struct_map_word *)malloc(sizeof(struct_map_word));
-			local_s->count = count;
-			unsigned short strlen_entry_key = strlen(entry_key);
-			local_s->key = malloc(strlen_entry_key + 1);
-			strcpy(local_s->key, entry_key);
-			HASH_ADD_KEYPTR(hh, *map, local_s->key, strlen_entry_key, local_s);
-		} else {
-			local_s->count += count;
-		}
+inline word_count_t map_update_count(struct_map_word_table * restrict map, const char * restrict entry_key, const word_count_t count) {
+	const size_t strlen_entry_key = strlen(entry_key);
+	const uint64_t hash = map_hash(entry_key, strlen_entry_key);
+	struct_map_word *local_s = map_lookup(map, entry_key, strlen_entry_key, hash);
+	if (local_s == NULL) {
+		local_s = map_insert(map, entry_key, strlen_entry_key, hash, count);
+	} else {
+		local_s->count += count;
 	}
 	return local_s->count;
 }
 
-inline word_count_t map_find_count(struct_map_word *map[const], const char * restrict entry_key) { // Based on uthash's docs
-	struct_map_word *local_s;
+inline word_count_t map_find_count(const struct_map_word_table * restrict map, const char * restrict entry_key) {
+	const size_t strlen_entry_key = strlen(entry_key);
+	const struct_map_word *local_s = map_lookup(map, entry_key, strlen_entry_key, map_hash(entry_key, strlen_entry_key));
 	word_count_t local_count = 0;
 
-	HASH_FIND_STR(*map, entry_key, local_s);	// local_s: output pointer
 	if (local_s != NULL) { // Deal with OOV
 		local_count = local_s->count;
 	}
 	return local_count;
 }
 
-inline word_id_t map_find_int(struct_map_word *map[const], const char * restrict entry_key) { // Based on uthash's docs
-	struct_map_word *local_s;
+inline word_id_t map_find_int(const struct_map_word_table * restrict map, const char * restrict entry_key) {
+	const size_t strlen_entry_key = strlen(entry_key);
+	const struct_map_word *local_s = map_lookup(map, entry_key, strlen_entry_key, map_hash(entry_key, strlen_entry_key));
 	word_id_t local_id = 0;
 
-	HASH_FIND_STR(*map, entry_key, local_s);
 	if (local_s != NULL) { // Deal with OOV
 		local_id = local_s->word_id;
 	}
 	return local_id;
 }
 
-struct_map_word map_find_entry(struct_map_word *map[const], const char * restrict entry_key) { // Based on uthash's docs
-	struct_map_word *local_s;
+inline word_id_t map_find_int_len(const struct_map_word_table * restrict map, const char * restrict entry_key, const unsigned short entry_key_len) { // Like map_find_int(), but entry_key needn't be null-terminated
+	const struct_map_word *local_s = map_lookup(map, entry_key, entry_key_len, map_hash(entry_key, entry_key_len));
+	return local_s != NULL ? local_s->word_id : 0; // 0 for OOV
+}
 
-	HASH_FIND_STR(*map, entry_key, local_s);
-	return *local_s;
+struct_map_word map_find_entry(const struct_map_word_table * restrict map, const char * restrict entry_key) {
+	const size_t strlen_entry_key = strlen(entry_key);
+	return *map_lookup(map, entry_key, strlen_entry_key, map_hash(entry_key, strlen_entry_key));
 }
 
 inline wclass_t get_class(struct_map_word_class *map[const], const char * restrict entry_key, const wclass_t unk) {
@@ -185,33 +264,42 @@ inline wclass_t get_class(struct_map_word_class *map[const], const char * restri
 	}
 }
 
-word_id_t get_keys(struct_map_word *map[const], char *keys[]) {
-	struct_map_word *entry, *tmp;
+word_id_t get_keys(const struct_map_word_table * restrict map, char *keys[], struct_map_pool * restrict pool) { // Copies the keys into pool, which can outlive the map
 	word_id_t number_of_keys = 0;
 
-	HASH_ITER(hh, *map, entry, tmp) {
-		// Build-up array of keys
-		unsigned short wlen = strlen(entry->key);
-		keys[number_of_keys] = (char *) malloc(wlen + 1);
-		strcpy(keys[number_of_keys], entry->key);
+	for (word_id_t i = 0; i < map->num_entries; i++) {
+		if (map->entries[i].deleted)
+			continue;
+		keys[number_of_keys] = map_pool_strndup(pool, map->entries[i].key, map->entries[i].key_len);
 		number_of_keys++;
 	}
 	return number_of_keys;
 }
 
-void delete_entry(struct_map_word **map, struct_map_word *entry) { // Based on uthash's docs
-	HASH_DEL(*map, entry);	// entry: pointer to deletee
-	free(entry->key); // key is a malloc'd string
-	free(entry);
+void delete_entry(struct_map_word_table * restrict map, struct_map_word * restrict entry) { // Leaves a tombstone in its slot, and keeps its place in the entries
+	const word_id_t index = entry - map->entries;
+	const size_t group_mask = map->num_slots / MAP_GROUP - 1;
+	size_t group = entry->hash & group_mask;
+	for (size_t step = 1; ; step++) {
+		for (unsigned int matches = map_group_match(map->tags + group * MAP_GROUP, map_tag(entry->hash)); matches; matches &= matches - 1) {
+			const size_t slot = group * MAP_GROUP + __builtin_ctz(matches);
+			if (map->slots[slot] == index) {
+				map->tags[slot] = MAP_TAG_DELETED;
+				entry->deleted = true;
+				map->num_live--;
+				return;
+			}
+		}
+		group = (group + step) & group_mask;
+	}
 }
 
-void delete_all(struct_map_word **map) {
-	struct_map_word *current_entry, *tmp;
-
-	HASH_ITER(hh, *map, current_entry, tmp) { // Based on uthash's docs
-		HASH_DEL(*map, current_entry);	// delete it (map advances to next)
-		free(current_entry);	// free it
-	}
+void delete_all(struct_map_word_table * restrict map) {
+	free(map->entries);
+	free(map->slots);
+	free(map->tags);
+	map_pool_release(&map->pool);
+	*map = (struct_map_word_table){0};
 }
 
 void delete_all_class(struct_map_class **map) {
@@ -223,21 +311,13 @@ void delete_all_class(struct_map_class **map) {
 	}
 }
 
-void delete_all_bigram(struct_map_bigram **map) {
-	struct_map_bigram *current_entry, *tmp;
-
-	HASH_ITER(hh, *map, current_entry, tmp) { // Based on uthash's docs
-		HASH_DEL(*map, current_entry);	// delete it (map advances to next)
-		free(current_entry);	// free it
-	}
-}
-
 void print_words_and_classes(FILE * out_file, word_id_t type_count, char **word_list, const word_count_t word_counts[const], const wclass_t word2class[const], const int class_offset, const bool print_freqs) {
 	struct_map_word_class *map = NULL;
+	struct_map_pool pool = {0};
 
 	for (word_id_t word_id = 0; word_id < type_count; word_id++) { // Populate new word2class_map, so we can do fun stuff like primary- and secondary-sort easily
 		//printf("adding %s=%hu to temp word2class_map\n", word_list[word_id], word2class[word_id]); fflush(stdout);
-		map_add_class(&map, word_list[word_id], (unsigned long)word_counts[word_id], word2class[word_id]);
+		map_add_class(&map, &pool, word_list[word_id], (unsigned long)word_counts[word_id], word2class[word_id]);
 	}
 
 	sort_by_key(&map); // Tertiary sort, alphabetically by key
@@ -250,18 +330,40 @@ void print_words_and_classes(FILE * out_file, word_id_t type_count, char **word_
 		if (print_freqs)
 			fprintf(out_file, "\t%lu", (long unsigned)(s->word_count));
 		fprintf(out_file, "\n");
-		HASH_DEL(map, s);	// delete it (map advances to next)
-		free(s->key);	// free it
-		//fprintf(stderr, "49.11: next=%zu\n", (struct_map_word_class *)(s->hh.next)); fflush(stderr);
 	}
+	HASH_CLEAR(hh, map);
+	map_pool_release(&pool);
 }
 
-int count_sort(struct_map_word *a, struct_map_word *b) { // Based on uthash's docs
-	return (b->count - a->count); // sort descending: most frequent to least frequent
+typedef struct {
+	word_count_t count;
+	word_id_t index;
+} struct_count_index;
+
+static int count_sort(const void * a, const void * b) { // Sort descending: most frequent to least frequent.  Ties stay in insertion order
+	const struct_count_index * const x = a, * const y = b;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->index < y->index ? -1 : x->index > y->index;
 }
 
-void sort_by_count(struct_map_word **map) { // Based on uthash's docs
-	HASH_SORT(*map, count_sort);
+void sort_by_count(struct_map_word_table * restrict map) { // Reorders the entries themselves, dropping deleted ones, so iteration then goes by count
+	struct_count_index * restrict order = malloc(sizeof(struct_count_index) * (map->num_live ? map->num_live : 1));
+	word_id_t num_live = 0;
+	for (word_id_t i = 0; i < map->num_entries; i++)
+		if (!map->entries[i].deleted)
+			order[num_live++] = (struct_count_index){ .count = map->entries[i].count, .index = i };
+	qsort(order, num_live, sizeof(struct_count_index), count_sort);
+
+	struct_map_word * restrict sorted = map_table_alloc(NULL, sizeof(struct_map_word) * (num_live ? num_live : 1));
+	for (word_id_t i = 0; i < num_live; i++)
+		sorted[i] = map->entries[order[i].index];
+	free(order);
+	free(map->entries);
+	map->entries = sorted;
+	map->num_entries = map->entries_size = num_live;
+	map_relink_keys(map);
+	map_rebuild_slots(map, map->num_slots);
 }
 
 int word_class_count_sort(struct_map_word_class *a, struct_map_word_class *b) {
@@ -288,29 +390,16 @@ void sort_by_class(struct_map_word_class **map) {
 	HASH_SORT(*map, class_sort);
 }
 
-inline int bigram_sort_word_1(struct_map_bigram *a, struct_map_bigram *b) { // Based on uthash's docs
-	return ((a->key).word_1 - (b->key).word_1);
-}
-
-inline int bigram_sort_word_2(struct_map_bigram *a, struct_map_bigram *b) { // Based on uthash's docs
-	return ((a->key).word_2 - (b->key).word_2);
-}
-
-void sort_bigrams(struct_map_bigram **map) {
-	HASH_SORT(*map, bigram_sort_word_2);
-	//HASH_SORT(*map, bigram_sort_word_1);
-}
-
-unsigned long map_count(struct_map_word *map[const]) {
-	return HASH_COUNT(*map);
+unsigned long map_count(const struct_map_word_table * restrict map) {
+	return map->num_live;
 }
 
-unsigned long map_print_entries(struct_map_word **map, const char * restrict prefix, const char sep_char, const word_count_t min_count) {
-	struct_map_word *entry, *tmp;
+unsigned long map_print_entries(const struct_map_word_table * restrict map, const char * restrict prefix, const char sep_char, const word_count_t min_count) {
 	unsigned long number_of_entries = 0;
 
-	HASH_ITER(hh, *map, entry, tmp) {
-		if (entry->count >= min_count) {
+	for (word_id_t i = 0; i < map->num_entries; i++) {
+		const struct_map_word * restrict entry = &map->entries[i];
+		if (!entry->deleted  &&  entry->count >= min_count) {
 			printf("%s%s%c%i\n", prefix, entry->key, sep_char, entry->count);
 			number_of_entries++;
 		}
@@ -3,7 +3,12 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include "uthash.h"
+#ifdef __SSE2__
+ #include <emmintrin.h>
+#endif
 
 #ifdef ATA_STORE_KHASH
  #include "khash.h"
@@ -20,25 +25,6 @@ typedef unsigned int   word_count_t;        // Max count of a given word class
 typedef unsigned int   word_bigram_count_t; // Max count of a given bigram
 typedef unsigned int   word_class_count_t;  // Max count of a given <word, class> tuple
 
-typedef struct {
-	word_id_t word_1;
-	word_id_t word_2;
-} struct_word_bigram;
-
-
-typedef struct { // We need an O(1) map that we can iterate over later
-	struct_word_bigram key;
-	word_bigram_count_t count;
-	UT_hash_handle hh;	// makes this structure hashable
-} struct_map_bigram;
-
-typedef struct {
-	char * restrict key;
-	word_count_t count;
-	word_id_t word_id;
-	UT_hash_handle hh;	// makes this structure hashable
-} struct_map_word;
-
 typedef struct { // Maps a class to its count
 	wclass_t key[CLASSLEN];
 	wclass_count_t count;
@@ -46,52 +32,165 @@ typedef struct { // Maps a class to its count
 } struct_map_class;
 
 typedef struct { // Maps a word to its class
-	char key[KEYLEN];
+	const char * restrict key;  // Not copied.  It has to outlive the map
 	unsigned long word_count;
 	wclass_t class;
 	UT_hash_handle hh;	// makes this structure hashable
 } struct_map_word_class;
 
-void map_add_entry(struct_map_word **map, char * restrict entry_key, const word_count_t count);
+// Strings are bump-allocated from a pool, instead of a malloc() each.  The pool is released all at once, by map_pool_release().  A pool mustn't be used by two threads at once
+typedef struct struct_map_pool_block {
+	struct struct_map_pool_block * next;
+	size_t size;        // Bytes of data, which follows this header
+	size_t used;
+} struct_map_pool_block;
 
-void map_add_class(struct_map_word_class **map, const char * restrict entry_key, const unsigned long word_count, const wclass_t entry_class);
+typedef struct {
+	struct_map_pool_block * blocks; // Newest first
+	size_t reserved;                // Bytes in blocks, headers included
+	size_t malloc_bytes;            // About what the same allocations would take with a malloc() each, for reporting the savings
+} struct_map_pool;
+
+#define MAP_POOL_BLOCK (1 << 20) // Bytes per block, unless an allocation needs more
+
+void * map_pool_alloc(struct_map_pool * restrict pool, const size_t bytes, const size_t align);
+char * map_pool_strndup(struct_map_pool * restrict pool, const char * restrict string, const size_t length);
+void map_pool_release(struct_map_pool * restrict pool);
+
+// Words are kept in an open-addressing table, keyed on a 64-bit hash that's computed once per key and stored with its entry.  Slots come in groups of
+// MAP_GROUP, each with a tag byte holding 7 bits of its entry's hash, so one SSE2 compare finds the candidates in a whole group.  The slots just hold entry
+// indices.  The entries themselves are in an array, in insertion order (until sort_by_count()), with short keys stored inline and the rest in the table's pool.
+// Lookups don't modify the table, so any number of threads can do them at once, as long as nothing is being added.  Adding can move the entries, though.
+#define MAP_GROUP        16  // Slots per probe group
+#define MAP_WORD_INLINE  24  // Keys shorter than this are stored in their entry
+#define MAP_TAG_EMPTY    0x00
+#define MAP_TAG_DELETED  0x01 // Anything without the high bit is free
 
-void map_update_class(struct_map_word_class **map, const char * restrict entry_key, const wclass_t entry_class);
+typedef struct {
+	char * key;                 // Null-terminated.  Points at short_key for short keys
+	uint64_t hash;
+	word_count_t count;
+	word_id_t word_id;
+	unsigned short key_len;
+	bool deleted;               // Deleted entries stay in the array, but are skipped
+	char short_key[MAP_WORD_INLINE];
+} struct_map_word;
 
-void map_set_word_id(struct_map_word **map, const char * restrict entry_key, const word_id_t word_id);
+typedef struct {
+	struct_map_word * entries;
+	word_id_t * slots;          // Index into entries, for each slot that's in use
+	uint8_t * tags;             // For each slot: MAP_TAG_EMPTY, MAP_TAG_DELETED, or 0x80 | the top 7 bits of the entry's hash
+	word_id_t num_entries;      // Deleted ones included
+	word_id_t num_live;
+	word_id_t entries_size;
+	size_t num_slots;           // A power of 2, and at least MAP_GROUP.  0 until the first entry is added
+	size_t num_used_slots;      // Including deleted ones, which still lengthen probes until the table's rebuilt
+	struct_map_pool pool;       // For the longer keys
+} struct_map_word_table;
+
+static inline uint64_t map_hash(const char * restrict key, size_t len) { // Eight bytes at a time, with a 64-bit multiply-xorshift mix
+	uint64_t hash = 0x9E3779B97F4A7C15ULL ^ len;
+	for (; len >= 8; key += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, key, 8);
+		hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+		hash ^= hash >> 31;
+	}
+	uint64_t tail = 0;
+	for (size_t i = 0; i < len; i++) // Not a memcpy() of a variable length, which would be a library call
+		tail |= (uint64_t)(unsigned char)key[i] << (8 * i);
+	hash = (hash ^ tail) * 0x94D049BB133111EBULL;
+	hash ^= hash >> 29;
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	return hash ^ (hash >> 32);
+}
+
+static inline uint8_t map_tag(const uint64_t hash) {
+	return 0x80 | (uint8_t)(hash >> 57);
+}
+
+static inline unsigned int map_group_match(const uint8_t tags[const], const uint8_t tag) { // Bit i is set if tags[i] == tag
+#ifdef __SSE2__
+	const __m128i group = _mm_loadu_si128((const __m128i *)tags);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+	unsigned int bits = 0;
+	for (unsigned int i = 0; i < MAP_GROUP; i++)
+		bits |= (unsigned int)(tags[i] == tag) << i;
+	return bits;
+#endif
+}
+
+static inline unsigned int map_group_free(const uint8_t tags[const]) { // Bit i is set if slot i is empty or deleted
+#ifdef __SSE2__
+	return ~(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)tags)) & 0xFFFF;
+#else
+	unsigned int bits = 0;
+	for (unsigned int i = 0; i < MAP_GROUP; i++)
+		bits |= (unsigned int)!(tags[i] & 0x80) << i;
+	return bits;
+#endif
+}
 
-word_count_t map_increment_count(struct_map_word **map, const char * restrict entry_key);
+static inline struct_map_word * map_lookup(const struct_map_word_table * restrict map, const char * restrict key, const size_t key_len, const uint64_t hash) { // NULL if it's not there
+	if (map->num_slots == 0)
+		return NULL;
+	const uint8_t tag = map_tag(hash);
+	const size_t group_mask = map->num_slots / MAP_GROUP - 1;
+	size_t group = hash & group_mask;
+	for (size_t step = 1; ; step++) { // Triangular probing, which visits every group
+		const uint8_t * restrict tags = map->tags + group * MAP_GROUP;
+		for (unsigned int matches = map_group_match(tags, tag); matches; matches &= matches - 1) {
+			struct_map_word * restrict entry = &map->entries[map->slots[group * MAP_GROUP + __builtin_ctz(matches)]];
+			if (entry->hash == hash  &&  entry->key_len == key_len  &&  !memcmp(entry->key, key, key_len))
+				return entry;
+		}
+		if (map_group_match(tags, MAP_TAG_EMPTY)) // The key would have gone here
+			return NULL;
+		group = (group + step) & group_mask;
+	}
+}
 
-wclass_count_t map_increment_count_fixed_width(struct_map_class **map, const wclass_t entry_key[const]);
+struct_map_word * map_insert(struct_map_word_table * restrict map, const char * restrict key, const size_t key_len, const uint64_t hash, const word_count_t count); // Doesn't check whether key is already there
+size_t map_memusage(const struct_map_word_table * restrict map);
 
-void map_increment_bigram(struct_map_bigram **map, const struct_word_bigram * bigram);
+void map_add_entry(struct_map_word_table * restrict map, const char * restrict entry_key, const word_count_t count);
+
+void map_add_class(struct_map_word_class **map, struct_map_pool * restrict pool, const char * restrict entry_key, const unsigned long word_count, const wclass_t entry_class);
+
+void map_update_class(struct_map_word_class **map, struct_map_pool * restrict pool, const char * restrict entry_key, const wclass_t entry_class);
+
+void map_set_word_id(struct_map_word_table * restrict map, const char * restrict entry_key, const word_id_t word_id);
+
+struct_map_word * map_intern_len(struct_map_word_table * restrict map, const char * restrict entry_key, const unsigned short entry_key_len, word_id_t * restrict num_entries);
+
+wclass_count_t map_increment_count_fixed_width(struct_map_class **map, const wclass_t entry_key[const]);
 
-word_count_t map_update_count(struct_map_word **map, const char * restrict entry_key, const word_count_t count);
+word_count_t map_update_count(struct_map_word_table * restrict map, const char * restrict entry_key, const word_count_t count);
 
-struct_map_word map_find_entry(struct_map_word *map[const], const char * restrict entry_key);
-word_count_t map_find_count(struct_map_word *map[const], const char * restrict entry_key);
+struct_map_word map_find_entry(const struct_map_word_table * restrict map, const char * restrict entry_key);
+word_count_t map_find_count(const struct_map_word_table * restrict map, const char * restrict entry_key);
 wclass_count_t map_find_count_fixed_width(struct_map_class *map[const], const wclass_t entry_key[const]);
 
-word_id_t map_find_int(struct_map_word *map[const], const char * restrict entry_key);
+word_id_t map_find_int(const struct_map_word_table * restrict map, const char * restrict entry_key);
+word_id_t map_find_int_len(const struct_map_word_table * restrict map, const char * restrict entry_key, const unsigned short entry_key_len);
 
 wclass_t get_class(struct_map_word_class *map[const], const char * restrict entry_key, const wclass_t unk);
 
-word_id_t get_keys(struct_map_word *map[const], char *keys[]);
+word_id_t get_keys(const struct_map_word_table * restrict map, char *keys[], struct_map_pool * restrict pool);
 
 void sort_by_class(struct_map_word_class **map);
 void sort_by_key(struct_map_word_class **map);
-void sort_by_count(struct_map_word **map);
+void sort_by_count(struct_map_word_table * restrict map);
 void word_class_sort_by_count(struct_map_word_class **map);
-void sort_bigrams(struct_map_bigram **map);
 
-unsigned long map_count(struct_map_word *map[const]);
+unsigned long map_count(const struct_map_word_table * restrict map);
 
-unsigned long map_print_entries(struct_map_word **map, const char * restrict prefix, const char sep_char, const word_count_t min_count);
+unsigned long map_print_entries(const struct_map_word_table * restrict map, const char * restrict prefix, const char sep_char, const word_count_t min_count);
 void print_words_and_classes(FILE * out_file, word_id_t type_count, char **word_list, const word_count_t word_counts[const], const wclass_t word2class[const], const int class_offset, const bool print_freqs);
 
-void delete_all(struct_map_word **map);
+void delete_all(struct_map_word_table * restrict map);
 void delete_all_class(struct_map_class **map);
-void delete_all_bigram(struct_map_bigram **map);
-void delete_entry(struct_map_word **map, struct_map_word *entry);
+void delete_entry(struct_map_word_table * restrict map, struct_map_word * restrict entry);
 
 #endif // INCLUDE_HEADER
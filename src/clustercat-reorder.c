@@ -0,0 +1,88 @@
+#include "clustercat-reorder.h"
+
+// Word ids come from sorting by frequency, so a rare word's neighbors, and the <v,c> rows the exchange algorithm reads for them, are spread all over memory.
+// Here the rare words get new ids so that words with the same dominant neighbor are next to each other.  The exchange then visits such words one after another,
+// and their neighbors' <v,c> rows are likely still in cache.  The first num_classes words keep their ids, since those are frequent and treated specially in the first cycles.
+
+static word_id_t dominant_neighbor(const struct_word_bigram_listing * restrict listing, const word_id_t word, word_id_t best, word_bigram_count_t * restrict best_count) {
+	const struct_word_bigram_cell * restrict cells = word_bigram_cells(listing, word);
+	const size_t length = word_bigram_length(listing, word);
+	for (size_t i = 0; i < length; i++) {
+		if (cells[i].count > *best_count  ||  (cells[i].count == *best_count  &&  cells[i].word < best)) {
+			best        = cells[i].word;
+			*best_count = cells[i].count;
+		}
+	}
+	return best;
+}
+
+word_id_t * order_words_by_neighbor(const struct cmd_args cmd_args, const word_id_t type_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev) {
+	// Returns new2old, where new2old[new_id] is the word's current id.  The rare words are ordered by their most frequent neighbor (predecessor or successor), then by their current id
+	const word_id_t head = cmd_args.num_classes < type_count ? cmd_args.num_classes : type_count;
+	word_id_t * restrict new2old  = malloc(sizeof(word_id_t) * type_count);
+	word_id_t * restrict neighbor = malloc(sizeof(word_id_t) * type_count);
+	word_id_t * restrict offsets  = calloc((size_t)type_count + 1, sizeof(word_id_t));
+	if (new2old == NULL || neighbor == NULL || offsets == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for renumbering words\n", argv_0_basename); fflush(stderr);
+		exit(13);
+	}
+
+	#pragma omp parallel for num_threads(cmd_args.num_threads) schedule(dynamic, 4096)
+	for (word_id_t word = head; word < type_count; word++) {
+		word_bigram_count_t best_count = 0;
+		word_id_t best = dominant_neighbor(word_bigrams, word, type_count, &best_count);
+		if (word_bigrams_rev)
+			best = dominant_neighbor(word_bigrams_rev, word, best, &best_count);
+		neighbor[word] = best < type_count ? best : word; // A word with no neighbors stays by itself
+	}
+
+	// Counting sort of the rare words by neighbor, which keeps them in order of current id within each neighbor
+	for (word_id_t word = head; word < type_count; word++)
+		offsets[neighbor[word] + 1]++;
+	for (word_id_t word = 0; word < type_count; word++)
+		offsets[word + 1] += offsets[word];
+	for (word_id_t word = 0; word < head; word++)
+		new2old[word] = word;
+	for (word_id_t word = head; word < type_count; word++)
+		new2old[head + offsets[neighbor[word]]++] = word;
+
+	free(neighbor);
+	free(offsets);
+	return new2old;
+}
+
+word_id_t * renumber_words(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t new2old[const], struct_sent_int_info sent_store_int[restrict], word_count_t word_counts[restrict], char * word_list[restrict], wclass_t word2class[restrict]) {
+	// Gives every word its new id in the sentence store (if there is one) and in the per-word arrays.  The bigram listings and <v,c> counts have to be built afterwards.
+	// Returns old2new, where old2new[old_id] is the word's new id
+	const word_id_t type_count = model_metadata.type_count;
+	word_id_t * restrict old2new = malloc(sizeof(word_id_t) * type_count);
+	for (word_id_t new_id = 0; new_id < type_count; new_id++)
+		old2new[new2old[new_id]] = new_id;
+
+	const unsigned long num_sents = sent_store_int ? model_metadata.line_count : 0; // No sentence store with --stream
+	#pragma omp parallel for num_threads(cmd_args.num_threads) schedule(dynamic, TASK_SENTS)
+	for (unsigned long current_sent_num = 0; current_sent_num < num_sents; current_sent_num++) {
+		word_id_t * restrict sent = sent_store_int[current_sent_num].sent;
+		for (sentlen_t i = 0; i < sent_store_int[current_sent_num].length; i++)
+			sent[i] = old2new[sent[i]];
+	}
+
+	// Permute the per-word arrays, one at a time through a scratch array
+	void * restrict scratch = malloc(sizeof(char *) * type_count);
+	word_count_t * restrict counts = scratch;
+	for (word_id_t new_id = 0; new_id < type_count; new_id++)
+		counts[new_id] = word_counts[new2old[new_id]];
+	memcpy(word_counts, counts, sizeof(word_count_t) * type_count);
+
+	wclass_t * restrict classes = scratch;
+	for (word_id_t new_id = 0; new_id < type_count; new_id++)
+		classes[new_id] = word2class[new2old[new_id]];
+	memcpy(word2class, classes, sizeof(wclass_t) * type_count);
+
+	char ** restrict words = scratch;
+	for (word_id_t new_id = 0; new_id < type_count; new_id++)
+		words[new_id] = word_list[new2old[new_id]];
+	memcpy(word_list, words, sizeof(char *) * type_count);
+	free(scratch);
+	return old2new;
+}
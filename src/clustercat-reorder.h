@@ -0,0 +1,9 @@
+#ifndef INCLUDE_CLUSTERCAT_REORDER_HEADER
+#define INCLUDE_CLUSTERCAT_REORDER_HEADER
+
+#include "clustercat.h"
+
+word_id_t * order_words_by_neighbor(const struct cmd_args cmd_args, const word_id_t type_count, const struct_word_bigram_listing * restrict word_bigrams, const struct_word_bigram_listing * restrict word_bigrams_rev);
+word_id_t * renumber_words(const struct cmd_args cmd_args, const struct_model_metadata model_metadata, const word_id_t new2old[const], struct_sent_int_info sent_store_int[restrict], word_count_t word_counts[restrict], char * word_list[restrict], wclass_t word2class[restrict]);
+
+#endif // INCLUDE_HEADER
@@ -34,3 +34,27 @@ void tokenize_simple_free(char ** restrict sent_words, sentlen_t length) {
 	}
 	free(sent_words);
 }
+
+// Non-destructive tokenization of line[0,line_length), which needn't be null-terminated.  Words are pointers into the line, plus their lengths.
+// Stops after max_words words, so a return value of max_words means there might be more
+sentlen_t tokenize_span(const char * restrict line, const size_t line_length, const char * restrict words[restrict], size_t word_lengths[restrict], const sentlen_t max_words) {
+	const char * restrict pch = line;
+	const char * const line_end = line + line_length;
+	sentlen_t num_words = 0;
+
+	while (num_words < max_words) {
+		while (pch < line_end  &&  (*pch == ' '  ||  *pch == '\t'  ||  *pch == '\n')) // Same as TOK_CHARS
+			pch++;
+		if (pch == line_end)
+			break;
+
+		const char * restrict word_start = pch;
+		while (pch < line_end  &&  *pch != ' '  &&  *pch != '\t'  &&  *pch != '\n')
+			pch++;
+		words[num_words]        = word_start;
+		word_lengths[num_words] = pch - word_start;
+		num_words++;
+	}
+
+	return num_words;
+}
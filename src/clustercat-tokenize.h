@@ -5,5 +5,6 @@
 
 sentlen_t tokenize_simple(char * restrict sent_string, char * restrict * restrict sent_words);
 void tokenize_simple_free(char ** restrict sent_words, sentlen_t length);
+sentlen_t tokenize_span(const char * restrict line, const size_t line_length, const char * restrict words[restrict], size_t word_lengths[restrict], const sentlen_t max_words);
 
 #endif // INCLUDE_HEADER
@@ -0,0 +1,337 @@
+#include "clustercat.h"				// argv_0_basename
+#include "clustercat-word-class-counts.h"
+
+#define WORD_CLASS_ROW_MIN_CAPACITY 2
+
+static void * alloc_or_die(void * ptr, const size_t size, const char * const what) {
+	void * new_ptr = realloc(ptr, size ? size : 1);
+	if (new_ptr == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for %s.  %'.1f MB needed.  Maybe increase --min-count\n", argv_0_basename, what, size / (double)1048576); fflush(stderr);
+		exit(13);
+	}
+	return new_ptr;
+}
+
+void init_word_class_counts(struct_word_class_counts * restrict wcc, const word_id_t num_rows, const wclass_t num_classes) {
+	memset(wcc, 0, sizeof(struct_word_class_counts));
+	wcc->num_rows    = num_rows;
+	wcc->num_classes = num_classes;
+	// A sparse cell takes a class and a 16-bit count, while a dense cell is usually 8 bits
+	wcc->max_sparse_length = (num_classes * sizeof(uint8_t)) / (sizeof(wclass_t) + sizeof(uint16_t));
+	wcc->rows = alloc_or_die(NULL, num_rows * sizeof(struct_word_class_row), "<v,c> rows");
+	memset(wcc->rows, 0, num_rows * sizeof(struct_word_class_row));
+}
+
+void free_word_class_counts(struct_word_class_counts * restrict wcc) {
+	free(wcc->rows);
+	free(wcc->dense_cells);
+	free(wcc->sparse_classes);
+	free(wcc->sparse_counts);
+	free(wcc->overflow.keys);
+	free(wcc->overflow.counts);
+	memset(wcc, 0, sizeof(struct_word_class_counts));
+}
+
+size_t word_class_counts_memusage(const struct_word_class_counts * restrict wcc) {
+	return wcc->num_rows * sizeof(struct_word_class_row) + wcc->dense_size + wcc->sparse_size * (sizeof(wclass_t) + sizeof(uint16_t)) + wcc->overflow.size * (sizeof(uint64_t) + sizeof(word_class_count_t));
+}
+
+
+// Overflow table, for counts too big for their cells
+
+static void overflow_resize(struct_word_class_overflow * restrict overflow, const size_t new_size) {
+	uint64_t * restrict old_keys = overflow->keys;
+	word_class_count_t * restrict old_counts = overflow->counts;
+	const size_t old_size = overflow->size;
+
+	overflow->keys   = alloc_or_die(NULL, new_size * sizeof(uint64_t), "<v,c> overflow table");
+	overflow->counts = alloc_or_die(NULL, new_size * sizeof(word_class_count_t), "<v,c> overflow table");
+	overflow->size   = new_size;
+	for (size_t slot = 0; slot < new_size; slot++)
+		overflow->keys[slot] = WORD_CLASS_OVERFLOW_EMPTY;
+
+	for (size_t old_slot = 0; old_slot < old_size; old_slot++) {
+		if (old_keys[old_slot] == WORD_CLASS_OVERFLOW_EMPTY)
+			continue;
+		size_t slot = word_class_overflow_slot(overflow, old_keys[old_slot]);
+		while (overflow->keys[slot] != WORD_CLASS_OVERFLOW_EMPTY)
+			slot = (slot + 1) & (new_size - 1);
+		overflow->keys[slot]   = old_keys[old_slot];
+		overflow->counts[slot] = old_counts[old_slot];
+	}
+	free(old_keys);
+	free(old_counts);
+}
+
+static void overflow_set(struct_word_class_overflow * restrict overflow, const word_id_t word, const wclass_t class, const word_class_count_t count) {
+	if (2 * (overflow->used + 1) > overflow->size) // Keep the load factor at most 1/2
+		overflow_resize(overflow, overflow->size ? 2 * overflow->size : 1024);
+
+	const uint64_t key = word_class_overflow_key(word, class);
+	size_t slot = word_class_overflow_slot(overflow, key);
+	while (overflow->keys[slot] != WORD_CLASS_OVERFLOW_EMPTY  &&  overflow->keys[slot] != key)
+		slot = (slot + 1) & (overflow->size - 1);
+	if (overflow->keys[slot] == WORD_CLASS_OVERFLOW_EMPTY) {
+		overflow->keys[slot] = key;
+		overflow->used++;
+	}
+	overflow->counts[slot] = count;
+}
+
+static void overflow_remove(struct_word_class_overflow * restrict overflow, const word_id_t word, const wclass_t class) {
+	if (!overflow->size)
+		return;
+	const size_t mask = overflow->size - 1;
+	const uint64_t key = word_class_overflow_key(word, class);
+	size_t slot = word_class_overflow_slot(overflow, key);
+	while (overflow->keys[slot] != key) {
+		if (overflow->keys[slot] == WORD_CLASS_OVERFLOW_EMPTY)
+			return;
+		slot = (slot + 1) & mask;
+	}
+
+	// Shift later entries of the probe run back, so that lookups never need tombstones
+	for (size_t next = (slot + 1) & mask; overflow->keys[next] != WORD_CLASS_OVERFLOW_EMPTY; next = (next + 1) & mask) {
+		const size_t home = word_class_overflow_slot(overflow, overflow->keys[next]);
+		const bool movable = (slot <= next) ? (home <= slot || home > next) : (home <= slot && home > next);
+		if (movable) {
+			overflow->keys[slot]   = overflow->keys[next];
+			overflow->counts[slot] = overflow->counts[next];
+			slot = next;
+		}
+	}
+	overflow->keys[slot] = WORD_CLASS_OVERFLOW_EMPTY;
+	overflow->used--;
+}
+
+
+// Cell updates.  These keep the overflow table and each row's number of escapes in sync
+
+static void set_cell8(struct_word_class_counts * restrict wcc, struct_word_class_row * restrict row, uint8_t * restrict cell, const word_id_t word, const wclass_t class, const word_class_count_t count) {
+	const bool was_escaped = (*cell == WORD_CLASS_CELL8_ESCAPE);
+	if (count < WORD_CLASS_CELL8_ESCAPE) {
+		if (was_escaped) {
+			overflow_remove(&wcc->overflow, word, class);
+			row->escapes--;
+		}
+		*cell = (uint8_t)count;
+	} else {
+		if (!was_escaped)
+			row->escapes++;
+		*cell = WORD_CLASS_CELL8_ESCAPE;
+		overflow_set(&wcc->overflow, word, class, count);
+	}
+}
+
+static void set_cell16(struct_word_class_counts * restrict wcc, struct_word_class_row * restrict row, uint16_t * restrict cell, const word_id_t word, const wclass_t class, const word_class_count_t count) {
+	const bool was_escaped = (*cell == WORD_CLASS_CELL16_ESCAPE);
+	if (count < WORD_CLASS_CELL16_ESCAPE) {
+		if (was_escaped) {
+			overflow_remove(&wcc->overflow, word, class);
+			row->escapes--;
+		}
+		*cell = (uint16_t)count;
+	} else {
+		if (!was_escaped)
+			row->escapes++;
+		*cell = WORD_CLASS_CELL16_ESCAPE;
+		overflow_set(&wcc->overflow, word, class, count);
+	}
+}
+
+
+// Pools
+
+static size_t dense_row_bytes(const struct_word_class_counts * restrict wcc, const unsigned char width) {
+	return ((size_t)width * wcc->num_classes + 7) & ~(size_t)7; // Keeps all rows aligned
+}
+
+static size_t reserve_dense_cells(struct_word_class_counts * restrict wcc, const unsigned char width) { // Returns byte offset of a new zeroed dense row
+	const size_t bytes = dense_row_bytes(wcc, width);
+	if (wcc->dense_used + bytes > wcc->dense_size) {
+		size_t new_size = wcc->dense_size ? wcc->dense_size + wcc->dense_size / 4 + bytes : 64 * bytes;
+		wcc->dense_cells = alloc_or_die(wcc->dense_cells, new_size, "dense <v,c> rows");
+		wcc->dense_size  = new_size;
+	}
+	const size_t offset = wcc->dense_used;
+	memset(wcc->dense_cells + offset, 0, bytes);
+	wcc->dense_used += bytes;
+	return offset;
+}
+
+static size_t reserve_sparse_cells(struct_word_class_counts * restrict wcc, const unsigned int capacity) { // Returns offset of room for a sparse row
+	if (wcc->sparse_used + capacity > wcc->sparse_size) {
+		size_t new_size = wcc->sparse_size ? wcc->sparse_size + wcc->sparse_size / 4 : 4 * (size_t)wcc->num_rows;
+		if (new_size < wcc->sparse_used + capacity)
+			new_size = wcc->sparse_used + capacity;
+		wcc->sparse_classes = alloc_or_die(wcc->sparse_classes, new_size * sizeof(wclass_t), "sparse <v,c> rows");
+		wcc->sparse_counts  = alloc_or_die(wcc->sparse_counts, new_size * sizeof(uint16_t), "sparse <v,c> rows");
+		wcc->sparse_size    = new_size;
+	}
+	const size_t offset = wcc->sparse_used;
+	wcc->sparse_used += capacity;
+	return offset;
+}
+
+static void make_dense_row(struct_word_class_counts * restrict wcc, struct_word_class_row * restrict row, const word_id_t word, unsigned char width) {
+	// Lays out a sparse row, or an 8-bit dense row, as a new dense row.  The old spot in the pool is just left behind
+	word_class_count_t * restrict counts = alloc_or_die(NULL, sizeof(word_class_count_t) * wcc->num_classes, "<v,c> row");
+	word_class_row_expand(wcc, word, 0, wcc->num_classes, counts);
+
+	if (width == 1) { // Go right to 16 bits if the new row would already have too many escapes
+		wclass_t escapes = 0;
+		for (wclass_t class = 0; class < wcc->num_classes; class++)
+			escapes += (counts[class] >= WORD_CLASS_CELL8_ESCAPE);
+		if (escapes > WORD_CLASS_ROW_MAX_ESCAPES)
+			width = 2;
+	}
+
+	// Drop the old escapes;  set_cell*() below adds back the ones still needed
+	const word_class_count_t old_escape = (row->dense && row->width == 1) ? WORD_CLASS_CELL8_ESCAPE : WORD_CLASS_CELL16_ESCAPE;
+	if (row->escapes)
+		for (wclass_t class = 0; class < wcc->num_classes; class++)
+			if (counts[class] >= old_escape)
+				overflow_remove(&wcc->overflow, word, class);
+
+	if (!row->dense)
+		wcc->num_dense_rows++;
+	if (width == 2)
+		wcc->num_wide_rows++;
+
+	row->offset   = reserve_dense_cells(wcc, width);
+	row->width    = width;
+	row->dense    = true;
+	row->length   = 0;
+	row->capacity = 0;
+	row->escapes  = 0;
+
+	for (wclass_t class = 0; class < wcc->num_classes; class++) {
+		if (!counts[class])
+			continue;
+		if (width == 1)
+			set_cell8(wcc, row, wcc->dense_cells + row->offset + class, word, class, counts[class]);
+		else
+			set_cell16(wcc, row, (uint16_t *)(wcc->dense_cells + row->offset) + class, word, class, counts[class]);
+	}
+	free(counts);
+}
+
+static void grow_word_class_row(struct_word_class_counts * restrict wcc, struct_word_class_row * restrict row, const word_id_t word) {
+	// The old spot in the pool is just left behind.  Rows only grow when a word gets a neighbor in a new class, so this levels off after the first cycles
+	const unsigned int new_capacity = row->capacity ? 2 * (unsigned int)row->capacity : WORD_CLASS_ROW_MIN_CAPACITY;
+
+	if (new_capacity > wcc->max_sparse_length) { // Becomes dense
+		make_dense_row(wcc, row, word, 1);
+		return;
+	}
+
+	const size_t offset = reserve_sparse_cells(wcc, new_capacity);
+	memcpy(wcc->sparse_classes + offset, wcc->sparse_classes + row->offset, row->length * sizeof(wclass_t));
+	memcpy(wcc->sparse_counts + offset, wcc->sparse_counts + row->offset, row->length * sizeof(uint16_t));
+	row->offset   = offset;
+	row->capacity = new_capacity;
+}
+
+void word_class_count_set(struct_word_class_counts * restrict wcc, const word_id_t word, const wclass_t class, const word_class_count_t count) {
+	struct_word_class_row * restrict row = &wcc->rows[word];
+	if (row->dense) {
+		if (row->width == 1) {
+			uint8_t * restrict cell = wcc->dense_cells + row->offset + class;
+			if (! (count >= WORD_CLASS_CELL8_ESCAPE  &&  *cell != WORD_CLASS_CELL8_ESCAPE  &&  row->escapes >= WORD_CLASS_ROW_MAX_ESCAPES)) {
+				set_cell8(wcc, row, cell, word, class, count);
+				return;
+			}
+			make_dense_row(wcc, row, word, 2); // Too many escapes, so widen to 16 bits
+		}
+		set_cell16(wcc, row, (uint16_t *)(wcc->dense_cells + row->offset) + class, word, class, count);
+		return;
+	}
+
+	wclass_t pos = word_class_row_search(wcc->sparse_classes + row->offset, row->length, class);
+	if (pos < row->length  &&  wcc->sparse_classes[row->offset + pos] == class) { // Already there
+		set_cell16(wcc, row, wcc->sparse_counts + row->offset + pos, word, class, count);
+		if (!count) { // Drop zeros, to keep sparse rows short
+			memmove(wcc->sparse_classes + row->offset + pos, wcc->sparse_classes + row->offset + pos + 1, (row->length - pos - 1) * sizeof(wclass_t));
+			memmove(wcc->sparse_counts + row->offset + pos, wcc->sparse_counts + row->offset + pos + 1, (row->length - pos - 1) * sizeof(uint16_t));
+			row->length--;
+		}
+		return;
+	}
+
+	if (!count)
+		return;
+
+	if (row->length == row->capacity) {
+		grow_word_class_row(wcc, row, word);
+		if (row->dense) {
+			word_class_count_set(wcc, word, class, count);
+			return;
+		}
+	}
+
+	memmove(wcc->sparse_classes + row->offset + pos + 1, wcc->sparse_classes + row->offset + pos, (row->length - pos) * sizeof(wclass_t));
+	memmove(wcc->sparse_counts + row->offset + pos + 1, wcc->sparse_counts + row->offset + pos, (row->length - pos) * sizeof(uint16_t));
+	wcc->sparse_classes[row->offset + pos] = class;
+	wcc->sparse_counts[row->offset + pos]  = 0;
+	row->length++;
+	set_cell16(wcc, row, wcc->sparse_counts + row->offset + pos, word, class, count);
+}
+
+void pack_word_class_counts(struct_word_class_counts * restrict wcc) {
+	// Moves rows next to each other, dropping the spots left behind by grown rows, and trims the pools.  Each sparse row keeps a little room to grow
+	size_t new_sparse_size = 0, new_dense_size = 0;
+	for (word_id_t word = 0; word < wcc->num_rows; word++) {
+		const struct_word_class_row row = wcc->rows[word];
+		if (row.dense) {
+			new_dense_size += dense_row_bytes(wcc, row.width);
+		} else if (row.length) {
+			unsigned int capacity = row.length + 1 + row.length / 4;
+			if (capacity > wcc->max_sparse_length)
+				capacity = row.length;
+			new_sparse_size += capacity;
+		}
+	}
+
+	wclass_t * restrict new_classes    = malloc((new_sparse_size ? new_sparse_size : 1) * sizeof(wclass_t));
+	uint16_t * restrict new_counts     = malloc((new_sparse_size ? new_sparse_size : 1) * sizeof(uint16_t));
+	unsigned char * restrict new_cells = malloc(new_dense_size ? new_dense_size : 1);
+	if (new_classes == NULL || new_counts == NULL || new_cells == NULL) { // Not fatal;  just keep the unpacked pools
+		free(new_classes);
+		free(new_counts);
+		free(new_cells);
+		return;
+	}
+
+	size_t sparse_offset = 0, dense_offset = 0;
+	for (word_id_t word = 0; word < wcc->num_rows; word++) {
+		struct_word_class_row * restrict row = &wcc->rows[word];
+		if (row->dense) {
+			const size_t bytes = dense_row_bytes(wcc, row->width);
+			memcpy(new_cells + dense_offset, wcc->dense_cells + row->offset, bytes);
+			row->offset = dense_offset;
+			dense_offset += bytes;
+			continue;
+		}
+		unsigned int capacity = row->length ? row->length + 1 + row->length / 4 : 0;
+		if (capacity > wcc->max_sparse_length)
+			capacity = row->length;
+		if (row->length) {
+			memcpy(new_classes + sparse_offset, wcc->sparse_classes + row->offset, row->length * sizeof(wclass_t));
+			memcpy(new_counts + sparse_offset, wcc->sparse_counts + row->offset, row->length * sizeof(uint16_t));
+		}
+		row->offset   = sparse_offset;
+		row->capacity = capacity;
+		sparse_offset += capacity;
+	}
+
+	free(wcc->sparse_classes);
+	free(wcc->sparse_counts);
+	free(wcc->dense_cells);
+	wcc->sparse_classes = new_classes;
+	wcc->sparse_counts  = new_counts;
+	wcc->dense_cells    = new_cells;
+	wcc->sparse_used    = sparse_offset;
+	wcc->sparse_size    = new_sparse_size;
+	wcc->dense_used     = dense_offset;
+	wcc->dense_size     = new_dense_size;
+}
@@ -0,0 +1,202 @@
+#ifndef INCLUDE_CC_WORD_CLASS_COUNTS_HEADER
+#define INCLUDE_CC_WORD_CLASS_COUNTS_HEADER
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "clustercat-map.h"	// wclass_t, word_id_t, word_class_count_t
+
+// <v,c> counts:  how often word v is followed by a word in class c (or preceded, for the reversed counts).
+// A full num_classes * type_count array is mostly zeros for large vocabularies, since a rare word only neighbors a few classes.
+// So each word gets its own row:  a sparse row holds just the nonzero classes (sorted) and their counts, and a dense row holds all num_classes counts.
+// Rows start out sparse.  When a sparse row fills up it's moved to a bigger spot in the pool, or it becomes dense once that would take about as much memory.
+//
+// Almost all counts are small, so cells are narrow:  16 bits in sparse rows, and 8 or 16 bits in dense rows.  A count that doesn't fit is stored in the
+// overflow table instead, and its cell holds the escape value.  A dense 8-bit row that gets too many of these is widened to 16 bits.
+
+#define WORD_CLASS_CELL8_ESCAPE    UINT8_MAX
+#define WORD_CLASS_CELL16_ESCAPE   UINT16_MAX
+#define WORD_CLASS_ROW_MAX_ESCAPES 8           // Widen a dense 8-bit row once more than this many of its counts overflow
+#define WORD_CLASS_OVERFLOW_EMPTY  UINT64_MAX
+
+typedef struct {
+	size_t offset;         // Byte offset into dense_cells for a dense row, otherwise cell offset into sparse_classes & sparse_counts
+	wclass_t length;       // Number of nonzero classes in a sparse row
+	wclass_t capacity;     // Room for this many classes in a sparse row
+	wclass_t escapes;      // Number of counts in this row that are in the overflow table
+	unsigned char width;   // Bytes per dense cell: 1 or 2
+	bool dense;
+} struct_word_class_row;
+
+typedef struct { // Open addressing, with linear probing.  Keys are (word << 16) | class
+	uint64_t * restrict keys;
+	word_class_count_t * restrict counts;
+	size_t size;
+	size_t used;
+} struct_word_class_overflow;
+
+typedef struct {
+	struct_word_class_row * restrict rows;
+	unsigned char * restrict dense_cells;
+	wclass_t * restrict sparse_classes;
+	uint16_t * restrict sparse_counts;
+	struct_word_class_overflow overflow;
+	size_t dense_used;      // Bytes
+	size_t dense_size;      // Bytes
+	size_t sparse_used;
+	size_t sparse_size;
+	word_id_t num_rows;
+	word_id_t num_dense_rows;
+	word_id_t num_wide_rows; // Dense rows with 16-bit cells
+	wclass_t num_classes;
+	wclass_t max_sparse_length; // Rows with more nonzero classes than this are dense
+} struct_word_class_counts;
+
+void init_word_class_counts(struct_word_class_counts * restrict wcc, const word_id_t num_rows, const wclass_t num_classes);
+void free_word_class_counts(struct_word_class_counts * restrict wcc);
+void word_class_count_set(struct_word_class_counts * restrict wcc, const word_id_t word, const wclass_t class, const word_class_count_t count);
+void pack_word_class_counts(struct_word_class_counts * restrict wcc);
+size_t word_class_counts_memusage(const struct_word_class_counts * restrict wcc);
+
+static inline uint64_t word_class_overflow_key(const word_id_t word, const wclass_t class) {
+	return ((uint64_t)word << 16) | class;
+}
+
+static inline size_t word_class_overflow_slot(const struct_word_class_overflow * restrict overflow, const uint64_t key) {
+	return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (overflow->size - 1);
+}
+
+static inline word_class_count_t word_class_overflow_find(const struct_word_class_overflow * restrict overflow, const word_id_t word, const wclass_t class) {
+	const uint64_t key = word_class_overflow_key(word, class);
+	for (size_t slot = word_class_overflow_slot(overflow, key); overflow->keys[slot] != WORD_CLASS_OVERFLOW_EMPTY; slot = (slot + 1) & (overflow->size - 1)) {
+		if (overflow->keys[slot] == key)
+			return overflow->counts[slot];
+	}
+	return 0; // Can't happen for an escaped cell
+}
+
+static inline wclass_t word_class_row_search(const wclass_t classes[const], const wclass_t length, const wclass_t class) { // Position of class in a sorted sparse row, or where it would go
+	wclass_t low = 0, high = length;
+	while (low < high) {
+		const wclass_t mid = (low + high) / 2;
+		if (classes[mid] < class)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static inline word_class_count_t word_class_count_find(const struct_word_class_counts * restrict wcc, const word_id_t word, const wclass_t class) {
+	const struct_word_class_row row = wcc->rows[word];
+	if (row.dense) {
+		if (row.width == 1) {
+			const uint8_t cell = wcc->dense_cells[row.offset + class];
+			return cell == WORD_CLASS_CELL8_ESCAPE ? word_class_overflow_find(&wcc->overflow, word, class) : cell;
+		} else {
+			const uint16_t cell = ((const uint16_t *)(wcc->dense_cells + row.offset))[class];
+			return cell == WORD_CLASS_CELL16_ESCAPE ? word_class_overflow_find(&wcc->overflow, word, class) : cell;
+		}
+	}
+
+	const wclass_t pos = word_class_row_search(wcc->sparse_classes + row.offset, row.length, class);
+	if (pos < row.length  &&  wcc->sparse_classes[row.offset + pos] == class) {
+		const uint16_t cell = wcc->sparse_counts[row.offset + pos];
+		return cell == WORD_CLASS_CELL16_ESCAPE ? word_class_overflow_find(&wcc->overflow, word, class) : cell;
+	}
+	return 0;
+}
+
+// Widens a word's counts for classes [class_start,class_end) into row_buffer, and returns row_buffer
+static inline const word_class_count_t * word_class_row_expand(const struct_word_class_counts * restrict wcc, const word_id_t word, const wclass_t class_start, const wclass_t class_end, word_class_count_t row_buffer[restrict]) {
+	const struct_word_class_row row = wcc->rows[word];
+	if (row.dense  &&  row.width == 1) {
+		const uint8_t * restrict cells = wcc->dense_cells + row.offset;
+		#pragma omp simd
+		for (wclass_t class = class_start; class < class_end; class++)
+			row_buffer[class] = cells[class];
+		if (row.escapes) {
+			for (wclass_t class = class_start; class < class_end; class++)
+				if (cells[class] == WORD_CLASS_CELL8_ESCAPE)
+					row_buffer[class] = word_class_overflow_find(&wcc->overflow, word, class);
+		}
+	} else if (row.dense) {
+		const uint16_t * restrict cells = (const uint16_t *)(wcc->dense_cells + row.offset);
+		#pragma omp simd
+		for (wclass_t class = class_start; class < class_end; class++)
+			row_buffer[class] = cells[class];
+		if (row.escapes) {
+			for (wclass_t class = class_start; class < class_end; class++)
+				if (cells[class] == WORD_CLASS_CELL16_ESCAPE)
+					row_buffer[class] = word_class_overflow_find(&wcc->overflow, word, class);
+		}
+	} else {
+		memset(row_buffer + class_start, 0, sizeof(word_class_count_t) * (class_end - class_start));
+		const wclass_t * restrict classes = wcc->sparse_classes + row.offset;
+		const uint16_t * restrict counts  = wcc->sparse_counts + row.offset;
+		for (wclass_t i = 0; i < row.length; i++) {
+			const wclass_t class = classes[i];
+			if (class < class_start  ||  class >= class_end)
+				continue;
+			row_buffer[class] = counts[i] == WORD_CLASS_CELL16_ESCAPE ? word_class_overflow_find(&wcc->overflow, word, class) : counts[i];
+		}
+	}
+	return row_buffer;
+}
+
+// Copies a word's counts into row_buffer, and returns how many there are.  A sparse row gives just its nonzero counts, and a dense row gives all num_classes of them
+static inline wclass_t word_class_row_values(const struct_word_class_counts * restrict wcc, const word_id_t word, word_class_count_t row_buffer[restrict]) {
+	const struct_word_class_row row = wcc->rows[word];
+	if (row.dense) {
+		word_class_row_expand(wcc, word, 0, wcc->num_classes, row_buffer);
+		return wcc->num_classes;
+	}
+	for (wclass_t i = 0; i < row.length; i++) {
+		const uint16_t cell = wcc->sparse_counts[row.offset + i];
+		row_buffer[i] = cell == WORD_CLASS_CELL16_ESCAPE ? word_class_overflow_find(&wcc->overflow, word, wcc->sparse_classes[row.offset + i]) : cell;
+	}
+	return row.length;
+}
+
+// The biggest of a word's counts
+static inline word_class_count_t word_class_row_max(const struct_word_class_counts * restrict wcc, const word_id_t word) {
+	const struct_word_class_row row = wcc->rows[word];
+	word_class_count_t row_max = 0;
+	if (row.dense  &&  row.width == 1) {
+		const uint8_t * restrict cells = wcc->dense_cells + row.offset;
+		uint8_t cell_max = 0;
+		#pragma omp simd reduction(max:cell_max)
+		for (wclass_t class = 0; class < wcc->num_classes; class++)
+			cell_max = cells[class] > cell_max ? cells[class] : cell_max;
+		row_max = cell_max;
+		if (row.escapes) // Any escaped count is bigger than every cell, so just look at those
+			for (wclass_t class = 0; class < wcc->num_classes; class++)
+				if (cells[class] == WORD_CLASS_CELL8_ESCAPE) {
+					const word_class_count_t count = word_class_overflow_find(&wcc->overflow, word, class);
+					row_max = count > row_max ? count : row_max;
+				}
+	} else if (row.dense) {
+		const uint16_t * restrict cells = (const uint16_t *)(wcc->dense_cells + row.offset);
+		uint16_t cell_max = 0;
+		#pragma omp simd reduction(max:cell_max)
+		for (wclass_t class = 0; class < wcc->num_classes; class++)
+			cell_max = cells[class] > cell_max ? cells[class] : cell_max;
+		row_max = cell_max;
+		if (row.escapes)
+			for (wclass_t class = 0; class < wcc->num_classes; class++)
+				if (cells[class] == WORD_CLASS_CELL16_ESCAPE) {
+					const word_class_count_t count = word_class_overflow_find(&wcc->overflow, word, class);
+					row_max = count > row_max ? count : row_max;
+				}
+	} else {
+		for (wclass_t i = 0; i < row.length; i++) {
+			const uint16_t cell = wcc->sparse_counts[row.offset + i];
+			const word_class_count_t count = cell == WORD_CLASS_CELL16_ESCAPE ? word_class_overflow_find(&wcc->overflow, word, wcc->sparse_classes[row.offset + i]) : cell;
+			row_max = count > row_max ? count : row_max;
+		}
+	}
+	return row_max;
+}
+
+#endif // INCLUDE_HEADER
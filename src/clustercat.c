@@ -12,13 +12,17 @@
 
 #include "clustercat.h"						// Model importing/exporting functions
 #include "clustercat-array.h"				// which_maxf()
+#include "clustercat-brown.h"				// print_words_and_bitstrings()
+#include "clustercat-cache.h"				// load_corpus_cache(), save_cache_corpus()
 #include "clustercat-data.h"
 #include "clustercat-cluster.h"				// cluster()
 #include "clustercat-dbg.h"					// for printing out various complex data structures
 #include "clustercat-import-class-file.h"	// import_class_file()
-#include "clustercat-io.h"					// fill_sent_buffer()
+#include "clustercat-io.h"					// read_corpus()
 #include "clustercat-math.h"				// perplexity(), powi()
 #include "clustercat-ngram-prob.h"			// class_ngram_prob()
+#include "clustercat-reorder.h"			// order_words_by_neighbor(), renumber_words()
+#include "clustercat-tokenize.h"			// tokenize_span()
 
 #define USAGE_LEN 10000
 
@@ -27,12 +31,14 @@ void get_usage_string(char * restrict usage_string, int usage_len);
 void parse_cmd_args(const int argc, char **argv, char * restrict usage, struct cmd_args *cmd_args);
 void free_sent_info(struct_sent_info sent_info);
 char * restrict class_algo           = NULL;
-char * restrict in_train_file_string = NULL;
+struct_corpus_files in_train_files  = {0}; // From --in.  None means stdin
 char * restrict out_file_string      = NULL;
 char * restrict initial_class_file   = NULL;
+char * restrict load_cache_file      = NULL;
+char * restrict save_cache_file      = NULL;
 char * restrict weights_string       = NULL;
 
-struct_map_word *ngram_map = NULL; // Must initialize to NULL
+struct_map_word_table ngram_map = {0};
 char usage[USAGE_LEN];
 size_t memusage = 0;
 
@@ -41,6 +47,7 @@ size_t memusage = 0;
 struct cmd_args cmd_args = {
 	.class_algo         = EXCHANGE,
 	.class_offset       = 0,
+	.entropy_table      = false,
 	.max_tune_sents     = 10000000,
 	.min_count          = 3,
 	.max_array          = 3,
@@ -48,10 +55,15 @@ struct cmd_args cmd_args = {
 	.num_classes        = 0,
 	.print_freqs        = false,
 	.print_word_vectors = NO_VEC,
+	.reorder_words      = false,
+	.stream             = false,
+	.tune_sample        = false,
 	.rev_alternate      = 3,
 	.tune_cycles        = 15,
 	.unidirectional     = false,
 	.verbose            = 0,
+	.verify_every       = 0,
+	.word_block         = 0,
 };
 
 
@@ -69,39 +81,103 @@ int main(int argc, char **argv) {
 	parse_cmd_args(argc, argv, usage, &cmd_args);
 
 	if (cmd_args.class_algo == EXCHANGE || cmd_args.class_algo == EXCHANGE_BROWN)
-		memusage += sizeof(float) * ENTROPY_TERMS_MAX; // We'll build the precomputed entropy terms after reporting memusage
+		memusage += sizeof(float) * (cmd_args.entropy_table ? ENTROPY_TERMS_MAX : ENTROPY_TERMS_SMALL); // We'll build the precomputed entropy terms after reporting memusage
 
 	struct_model_metadata global_metadata;
 	global_metadata.token_count = 0;
 	global_metadata.line_count  = 0;
 
 
-	// The list of unique words should always include <s>, unknown word, and </s>
-	map_update_count(&ngram_map, UNKNOWN_WORD, 0); // Should always be first
-	map_update_count(&ngram_map, "<s>", 0);
-	map_update_count(&ngram_map, "</s>", 0);
+	const unsigned int num_shards = cmd_args.num_threads ? cmd_args.num_threads : 1;
+	struct_corpus_shard * restrict shards = malloc(sizeof(struct_corpus_shard) * num_shards);
+	struct_sent_int_info * restrict sent_store_int = NULL;
+	struct_corpus_stream corpus_stream;
+	bool stream_open = false;
+	struct_corpus sample_corpus = {0};
+	unsigned long corpus_line_count = 0, corpus_token_count = 0; // All of it, with --tune-sample
+	struct_corpus_cache corpus_cache;
+	struct_corpus_cache_writer cache_writer;
+	const bool cache_loaded = load_cache_file  &&  load_corpus_cache(load_cache_file, &in_train_files, cmd_args, &corpus_cache);
+	const bool saving_cache = save_cache_file  &&  !cache_loaded;
+
+	if (cache_loaded) { // The vocabulary and sentences come from the cache, instead of from reading the corpus
+		cache_vocab_to_map(&corpus_cache, &ngram_map);
+		global_metadata.line_count  = corpus_cache.header->line_count;
+		global_metadata.token_count = corpus_cache.header->token_count;
+		global_metadata.type_count  = map_count(&ngram_map);
+		free(shards);
+		shards = NULL;
+		if (cmd_args.verbose >= -1) {
+			fprintf(stderr, "%s: Loaded the preprocessed corpus from \"%s\"\n", argv_0_basename, load_cache_file); fflush(stderr);
+		}
+	} else if (cmd_args.stream) { // Count words a block at a time, without keeping the sentences.  The bigrams come from a second pass over the corpus
+		open_corpus_stream(&in_train_files, cmd_args.max_tune_sents, true, &corpus_stream);
+		stream_open = true;
+		add_special_words();
+		while (read_corpus_block(&corpus_stream)) {
+			global_metadata.line_count  += corpus_stream.block.num_lines;
+			global_metadata.token_count += parse_corpus(&corpus_stream.block, NULL, shards, num_shards);
+			free_shard_vocabs(shards, num_shards);
+		}
+		global_metadata.type_count = map_count(&ngram_map);
+		free(shards);
+		shards = NULL;
+	} else if (cmd_args.tune_sample) { // Count words over the whole corpus a block at a time, like --stream, while keeping a uniform sample of its lines for the sentence store
+		struct_corpus_sample corpus_sample;
+		open_corpus_stream(&in_train_files, ULONG_MAX, false, &corpus_stream);
+		init_corpus_sample(&corpus_sample, cmd_args.max_tune_sents);
+		add_special_words();
+		while (read_corpus_block(&corpus_stream)) {
+			corpus_line_count  += corpus_stream.block.num_lines;
+			corpus_token_count += parse_corpus(&corpus_stream.block, NULL, shards, num_shards);
+			free_shard_vocabs(shards, num_shards);
+			sample_corpus_block(&corpus_sample, &corpus_stream.block);
+		}
+		close_corpus_stream(&corpus_stream);
+		global_metadata.token_count = corpus_token_count;
+		global_metadata.type_count  = map_count(&ngram_map);
+		free(shards);
+		shards = NULL;
+
+		corpus_from_sample(&corpus_sample, &sample_corpus); // Tokenized once the word ids are known
+		memusage += corpus_memusage(&sample_corpus);
+		global_metadata.line_count = sample_corpus.num_lines;
+		sent_store_int = malloc(sizeof(struct_sent_int_info) * (global_metadata.line_count ? global_metadata.line_count : 1));
+		if (sent_store_int == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for sent_store_int.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, cmd_args.max_tune_sents); fflush(stderr);
+			exit(8);
+		}
+		memusage += sizeof(struct_sent_int_info) * global_metadata.line_count;
+		if (cmd_args.verbose >= -1) {
+			fprintf(stderr, "%s: Sampled %'lu of %'lu lines for tuning.  Word counts are from all of them\n", argv_0_basename, global_metadata.line_count, corpus_line_count); fflush(stderr);
+		}
+	} else {
+		// Read in the corpus.  Lines are tokenized straight from it, without copying them
+		struct_corpus corpus;
+		read_corpus(&in_train_files, cmd_args.max_tune_sents, cmd_args.num_threads, &corpus);
+		memusage += corpus_memusage(&corpus);
+		global_metadata.line_count  += corpus.num_lines;
+
+		sent_store_int = malloc(sizeof(struct_sent_int_info) * global_metadata.line_count);
+		if (sent_store_int == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for sent_store_int.  Reduce --tune-sents (current value: %lu), or use --stream\n", argv_0_basename, cmd_args.max_tune_sents); fflush(stderr);
+			exit(8);
+		}
+		memusage += sizeof(struct_sent_int_info) * global_metadata.line_count;
 
-	char * * restrict sent_buffer = calloc(sizeof(char **), cmd_args.max_tune_sents);
-	if (sent_buffer == NULL) {
-		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for initial sentence buffer.  %'lu MB needed.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, ((sizeof(void *) * cmd_args.max_tune_sents) / 1048576 ), cmd_args.max_tune_sents); fflush(stderr);
-		exit(7);
+		// Each thread parses its own part of the corpus once, into the sentence store and its own word counts.  Those are then merged into ngram_map
+		global_metadata.token_count += parse_corpus(&corpus, sent_store_int, shards, num_shards);
+		global_metadata.type_count   = map_count(&ngram_map);
+		memusage -= corpus_memusage(&corpus);
+		free_corpus(&corpus);
 	}
-	memusage += sizeof(void *) * cmd_args.max_tune_sents;
-
-	// Fill sentence buffer
-	FILE *in_train_file = stdin;
-	if (in_train_file_string)
-		in_train_file = fopen(in_train_file_string, "r");
-	const unsigned long num_sents_in_buffer = fill_sent_buffer(in_train_file, sent_buffer, cmd_args.max_tune_sents);
-	fclose(in_train_file);
-	//printf("cmd_args.max_tune_sents=%lu; global_metadata.line_count=%lu; num_sents_in_buffer=%lu\n", cmd_args.max_tune_sents, global_metadata.line_count, num_sents_in_buffer);
-	global_metadata.line_count  += num_sents_in_buffer;
-	if (cmd_args.max_tune_sents <= global_metadata.line_count) { // There are more sentences in stdin than were processed
-		fprintf(stderr, "%s: Warning: Sentence buffer is full.  You probably should increase it using --tune-sents .  Current value: %lu\n", argv_0_basename, cmd_args.max_tune_sents); fflush(stderr);
+	if (saving_cache) { // The vocabulary and sentences are saved before filtering, so that the cache works for any --min-count
+		begin_corpus_cache(&cache_writer, save_cache_file, &in_train_files, cmd_args);
+		save_cache_corpus(&cache_writer, &ngram_map, sent_store_int, shards, num_shards, global_metadata);
+	}
+	if (cmd_args.max_tune_sents <= global_metadata.line_count  &&  !cmd_args.tune_sample) { // There are more sentences in the input than were processed
+		fprintf(stderr, "%s: Warning: Sentence buffer is full.  You probably should increase it using --tune-sents , or use --tune-sample .  Current value: %lu\n", argv_0_basename, cmd_args.max_tune_sents); fflush(stderr);
 	}
-
-	global_metadata.token_count += process_str_sents_in_buffer(sent_buffer, num_sents_in_buffer);
-	global_metadata.type_count   = map_count(&ngram_map);
 
 	// Filter out infrequent words
 	word_id_t number_of_deleted_words = filter_infrequent_words(cmd_args, &global_metadata, &ngram_map);
@@ -118,7 +194,9 @@ int main(int argc, char **argv) {
 	char * * restrict word_list = (char **)malloc(sizeof(char*) * global_metadata.type_count);
 	memusage += sizeof(char*) * global_metadata.type_count;
 	sort_by_count(&ngram_map); // Speeds up lots of stuff later
-	get_keys(&ngram_map, word_list);
+	struct_map_pool word_list_pool = {0}; // The words themselves, which outlive ngram_map
+	get_keys(&ngram_map, word_list, &word_list_pool);
+	memusage += word_list_pool.reserved;
 
 	// Build array of word_counts
 	word_count_t * restrict word_counts = malloc(sizeof(word_count_t) * global_metadata.type_count);
@@ -128,16 +206,22 @@ int main(int argc, char **argv) {
 	// Now that we have filtered-out infrequent words, we can populate values of struct_map_word->word_id values.  We could have merged this step with get_keys(), but for code clarity, we separate it out.  It's a one-time, quick operation.
 	populate_word_ids(&ngram_map, word_list, global_metadata.type_count);
 
-	struct_sent_int_info * restrict sent_store_int = malloc(sizeof(struct_sent_int_info) * global_metadata.line_count);
-	if (sent_store_int == NULL) {
-		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for sent_store_int.  Reduce --tune-sents (current value: %lu)\n", argv_0_basename, cmd_args.max_tune_sents); fflush(stderr);
-		exit(8);
+	global_metadata.start_sent_id = map_find_int(&ngram_map, "<s>");
+
+	// Now the sentence store's thread-local word ids can become real ones
+	const bool cached_bigrams = cache_loaded  &&  corpus_cache.header->min_count == cmd_args.min_count; // Otherwise they're rebuilt from the cache's sentences
+	size_t cache_store_memusage = 0;
+	if (cache_loaded  &&  corpus_cache.has_sents  &&  (!cmd_args.stream  ||  !cached_bigrams)) {
+		cache_store_memusage = cache_sent_store(&corpus_cache, &ngram_map, num_shards, &sent_store_int);
+		memusage += cache_store_memusage;
+	} else if (cmd_args.tune_sample) {
+		memusage += integerize_corpus(&ngram_map, &sample_corpus, cmd_args.num_threads, sent_store_int);
+		memusage -= corpus_memusage(&sample_corpus);
+		free_corpus(&sample_corpus);
+	} else if (sent_store_int) {
+		memusage += integerize_sent_store(&ngram_map, shards, num_shards, sent_store_int);
+		free(shards);
 	}
-	memusage += sizeof(struct_sent_int_info) * global_metadata.line_count;
-	memusage += sent_buffer2sent_store_int(&ngram_map, sent_buffer, sent_store_int, global_metadata.line_count);
-	// Each sentence in sent_buffer was freed within sent_buffer2sent_store_int().  Now we can free the entire array
-	free(sent_buffer);
-	memusage -= sizeof(void *) * cmd_args.max_tune_sents;
 
 
 	// Initialize clusters, and possibly read-in external class file
@@ -146,66 +230,118 @@ int main(int argc, char **argv) {
 	init_clusters(cmd_args, global_metadata.type_count, word2class, word_counts, word_list);
 	if (initial_class_file != NULL)
 		import_class_file(&ngram_map, global_metadata.type_count, word2class, initial_class_file, cmd_args.num_classes); // Overwrite subset of word mappings, from user-provided initial_class_file
-	delete_all(&ngram_map);
 
 
 	// Initialize and set word bigram listing
 	clock_t time_bigram_start = clock();
-	size_t bigram_memusage = 0; size_t bigram_rev_memusage = 0;
-	struct_word_bigram_entry * restrict word_bigrams = NULL;
-	struct_word_bigram_entry * restrict word_bigrams_rev = NULL;
-	if (cmd_args.verbose >= -1)
+	struct_word_bigram_listing word_bigrams_store, word_bigrams_rev_store;
+	struct_word_bigram_listing * restrict word_bigrams = &word_bigrams_store;
+	struct_word_bigram_listing * restrict word_bigrams_rev = cmd_args.rev_alternate || saving_cache || cmd_args.class_algo == BROWN ? &word_bigrams_rev_store : NULL; // Don't bother building the reverse listing if it won't be used
+	if (cmd_args.verbose >= -1) {
 		fprintf(stderr, "%s: Word bigram listing ... ", argv_0_basename); fflush(stderr);
+	}
 
-	#pragma omp parallel sections // Both bigram listing and reverse bigram listing can be done in parallel
-	{
-		#pragma omp section
-		{
-			word_bigrams = calloc(global_metadata.type_count, sizeof(struct_word_bigram_entry));
-			memusage += sizeof(struct_word_bigram_entry) * global_metadata.type_count;
-			bigram_memusage = set_bigram_counts(cmd_args, word_bigrams, sent_store_int, global_metadata.line_count, false);
-		}
-
-		// Initialize and set *reverse* word bigram listing
-		#pragma omp section
-		{
-			if (cmd_args.rev_alternate) { // Don't bother building this if it won't be used
-				word_bigrams_rev = calloc(global_metadata.type_count, sizeof(struct_word_bigram_entry));
-				memusage += sizeof(struct_word_bigram_entry) * global_metadata.type_count;
-				bigram_rev_memusage = set_bigram_counts(cmd_args, word_bigrams_rev, sent_store_int, global_metadata.line_count, true);
-			}
+	size_t bigram_memusage;
+	if (cached_bigrams) { // Straight from the page cache
+		word_bigrams_store = corpus_cache.word_bigrams;
+		if (word_bigrams_rev)
+			word_bigrams_rev_store = corpus_cache.word_bigrams_rev;
+		bigram_memusage = 0;
+	} else if (stream_open) {
+		bigram_memusage = stream_bigram_counts(cmd_args, &corpus_stream, word_bigrams, word_bigrams_rev, global_metadata.type_count, NULL);
+	} else {
+		bigram_memusage = set_bigram_counts(cmd_args, word_bigrams, word_bigrams_rev, sent_store_int, global_metadata.line_count, global_metadata.type_count);
+	}
+
+	if (saving_cache) {
+		save_cache_bigrams(&cache_writer, word_bigrams, word_bigrams_rev, cmd_args.min_count);
+		if (cmd_args.verbose >= -1) {
+			fprintf(stderr, "saved the preprocessed corpus to \"%s\" ... ", save_cache_file); fflush(stderr);
+		}
+		if (!cmd_args.rev_alternate  &&  cmd_args.class_algo != BROWN) { // It was only needed for the cache
+			bigram_memusage -= sizeof(size_t) * ((size_t)word_bigrams_rev->num_words + 1) + sizeof(struct_word_bigram_cell) * word_bigrams_rev->num_cells;
+			free_bigram_counts(word_bigrams_rev);
+			word_bigrams_rev = NULL;
 		}
 	}
 
-	memusage += bigram_memusage + bigram_rev_memusage;
+	word_id_t * restrict old2new = NULL; // New id of each word, so that word vectors can be printed in the original order
+	if (cmd_args.reorder_words) { // The new ids come from the bigram listings, which then get rebuilt with the new ids
+		word_id_t * restrict new2old = order_words_by_neighbor(cmd_args, global_metadata.type_count, word_bigrams, word_bigrams_rev);
+		old2new = renumber_words(cmd_args, global_metadata, new2old, sent_store_int, word_counts, word_list, word2class);
+		global_metadata.start_sent_id = old2new[global_metadata.start_sent_id];
+		if (sent_store_int  ||  stream_open) {
+			free_bigram_counts(word_bigrams);
+			if (word_bigrams_rev)
+				free_bigram_counts(word_bigrams_rev);
+		}
+		if (sent_store_int)
+			bigram_memusage = set_bigram_counts(cmd_args, word_bigrams, word_bigrams_rev, sent_store_int, global_metadata.line_count, global_metadata.type_count);
+		else if (stream_open) // ngram_map still has the old ids
+			bigram_memusage = stream_bigram_counts(cmd_args, &corpus_stream, word_bigrams, word_bigrams_rev, global_metadata.type_count, old2new);
+		else // Loaded from the cache with --stream, so there's nothing to count the bigrams from again
+			bigram_memusage = renumber_bigram_counts(cmd_args, word_bigrams, word_bigrams_rev, new2old, old2new);
+		free(new2old);
+		memusage += sizeof(word_id_t) * global_metadata.type_count;
+	}
+
+	if (cmd_args.stream  &&  cache_store_memusage) { // The cache's sentences were just for rebuilding the bigram listings.  They're all in one block
+		free(sent_store_int[0].sent);
+		free(sent_store_int);
+		sent_store_int = NULL;
+		memusage -= cache_store_memusage;
+	}
+	// The clustering's word counts have to agree with its bigrams, so with --tune-sample they come from the sample.  The printed ones are from the whole corpus
+	word_count_t * restrict tune_counts = word_counts;
+	if (cmd_args.tune_sample  &&  global_metadata.line_count < corpus_line_count) { // Otherwise the sample is the whole corpus
+		tune_counts = calloc(global_metadata.type_count, sizeof(word_count_t));
+		memusage += sizeof(word_count_t) * global_metadata.type_count;
+		global_metadata.token_count = 0;
+		for (unsigned long current_sent_num = 0; current_sent_num < global_metadata.line_count; current_sent_num++) {
+			for (sentlen_t i = 0; i < sent_store_int[current_sent_num].length; i++)
+				tune_counts[sent_store_int[current_sent_num].sent[i]]++;
+			global_metadata.token_count += sent_store_int[current_sent_num].length;
+		}
+	}
+
+	memusage += bigram_memusage;
+	const size_t vocab_pool_bytes = map_memusage(&ngram_map), vocab_malloc_bytes = ngram_map.pool.malloc_bytes; // For reporting what the table saved
+	delete_all(&ngram_map);
+	if (stream_open)
+		close_corpus_stream(&corpus_stream);
 	clock_t time_bigram_end = clock();
-	if (cmd_args.verbose >= -1)
-		fprintf(stderr, "in %'.2f CPU secs.  Bigram memusage: %'.1f MB\n", (double)(time_bigram_end - time_bigram_start)/CLOCKS_PER_SEC, (bigram_memusage + bigram_rev_memusage)/(double)1048576); fflush(stderr);
+	if (cmd_args.verbose >= -1) {
+		fprintf(stderr, "in %'.2f CPU secs.  Bigram memusage: %'.1f MB\n", (double)(time_bigram_end - time_bigram_start)/CLOCKS_PER_SEC, bigram_memusage/(double)1048576); fflush(stderr);
+	}
 
 
-	// Build <v,c> counts, which consists of a word followed by a given class
-	word_class_count_t * restrict word_class_counts = calloc(1 + cmd_args.num_classes * global_metadata.type_count , sizeof(word_class_count_t));
-	if (word_class_counts == NULL) {
-		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for <v,c>.  %'.1f MB needed.  Maybe increase --min-count\n", argv_0_basename, ((cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t)) / (double)1048576 )); fflush(stderr);
-		exit(13);
+	// Build <v,c> counts, which consists of a word followed by a given class.  Rows are sparse for most words, so this takes much less than num_classes * type_count cells.
+	// Brown clustering doesn't use these, since it works with the bigram listings and its own cluster counts
+	struct_word_class_counts word_class_counts_store;
+	struct_word_class_counts * restrict word_class_counts = NULL;
+	if (cmd_args.class_algo != BROWN) {
+		word_class_counts = &word_class_counts_store;
+		init_word_class_counts(word_class_counts, global_metadata.type_count, cmd_args.num_classes);
+		build_word_class_counts(cmd_args, word_class_counts, word2class, word_bigrams, false);
+		pack_word_class_counts(word_class_counts);
+		memusage += word_class_counts_memusage(word_class_counts);
+	}
+	if (cmd_args.verbose >= -1  &&  word_class_counts) {
+		fprintf(stderr, "%s: Allocated %'.1f MB for word_class_counts: %'u dense rows (%'u of them 16-bit), %'u sparse rows, %'zu overflowing counts (a full array would be %'.1f MB)\n", argv_0_basename, word_class_counts_memusage(word_class_counts) / (double)1048576, word_class_counts->num_dense_rows, word_class_counts->num_wide_rows, global_metadata.type_count - word_class_counts->num_dense_rows, word_class_counts->overflow.used, ((double)cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t)) / 1048576); fflush(stderr);
 	}
-	memusage += cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t);
-	fprintf(stderr, "%s: Allocating %'.1f MB for word_class_counts: num_classes=%u x type_count=%u x sizeof(w-cl-count_t)=%zu\n", argv_0_basename, (double)(cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t)) / 1048576 , cmd_args.num_classes, global_metadata.type_count, sizeof(word_class_count_t)); fflush(stderr);
-	build_word_class_counts(cmd_args, word_class_counts, word2class, sent_store_int, global_metadata.line_count, false);
-
-	// Build reverse: <c,v> counts: class followed by word.  This and the normal one are both pretty fast, so no need to parallelize this
-	word_class_count_t * restrict word_class_rev_counts = NULL;
-	if (cmd_args.rev_alternate) { // Don't bother building this if it won't be used
-		word_class_rev_counts = calloc(1 + cmd_args.num_classes * global_metadata.type_count , sizeof(word_class_count_t));
-		if (word_class_rev_counts == NULL) {
-			fprintf(stderr,  "%s: Warning: Unable to allocate enough memory for <v,c>.  %'.1f MB needed.  Falling back to --rev-alternate 0\n", argv_0_basename, ((cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t)) / (double)1048576 )); fflush(stderr);
-			cmd_args.rev_alternate = 0;
-		} else {
-			memusage += cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t);
-			fprintf(stderr, "%s: Allocating %'.1f MB for word_class_rev_counts: num_classes=%u x type_count=%u x sizeof(w-cl-count_t)=%zu\n", argv_0_basename, (double)(cmd_args.num_classes * global_metadata.type_count * sizeof(word_class_count_t)) / 1048576 , cmd_args.num_classes, global_metadata.type_count, sizeof(word_class_count_t)); fflush(stderr);
-			build_word_class_counts(cmd_args, word_class_rev_counts, word2class, sent_store_int, global_metadata.line_count, true);
-		}
 
+	// Build reverse: <c,v> counts: class followed by word.  This and the normal one both come from the bigram listing, so they're pretty fast
+	struct_word_class_counts word_class_rev_counts_store;
+	struct_word_class_counts * restrict word_class_rev_counts = NULL;
+	if (cmd_args.rev_alternate  &&  cmd_args.class_algo != BROWN) { // Don't bother building this if it won't be used
+		word_class_rev_counts = &word_class_rev_counts_store;
+		init_word_class_counts(word_class_rev_counts, global_metadata.type_count, cmd_args.num_classes);
+		build_word_class_counts(cmd_args, word_class_rev_counts, word2class, word_bigrams, true);
+		pack_word_class_counts(word_class_rev_counts);
+		memusage += word_class_counts_memusage(word_class_rev_counts);
+		if (cmd_args.verbose >= -1) {
+			fprintf(stderr, "%s: Allocated %'.1f MB for word_class_rev_counts: %'u dense rows (%'u of them 16-bit), %'u sparse rows, %'zu overflowing counts\n", argv_0_basename, word_class_counts_memusage(word_class_rev_counts) / (double)1048576, word_class_rev_counts->num_dense_rows, word_class_rev_counts->num_wide_rows, global_metadata.type_count - word_class_rev_counts->num_dense_rows, word_class_rev_counts->overflow.used); fflush(stderr);
+		}
 	}
 
 	// Calculate memusage for count_arrays
@@ -215,22 +351,38 @@ int main(int argc, char **argv) {
 	}
 
 	clock_t time_model_built = clock();
-	if (cmd_args.verbose >= -1)
-		fprintf(stderr, "%s: Finished loading %'lu tokens and %'u types (%'u filtered) from %'lu lines in %'.2f CPU secs\n", argv_0_basename, global_metadata.token_count, global_metadata.type_count, number_of_deleted_words, global_metadata.line_count, (double)(time_model_built - time_start)/CLOCKS_PER_SEC); fflush(stderr);
-	if (cmd_args.verbose >= -1)
-		fprintf(stderr, "%s: Approximate mem usage: %'.1fMB\n", argv_0_basename, (double)memusage / 1048576); fflush(stderr);
+	if (cmd_args.verbose >= -1) {
+		fprintf(stderr, "%s: Finished loading %'lu tokens and %'u types (%'u filtered) from %'lu lines in %'.2f CPU secs\n", argv_0_basename, cmd_args.tune_sample ? corpus_token_count : global_metadata.token_count, global_metadata.type_count, number_of_deleted_words, cmd_args.tune_sample ? corpus_line_count : global_metadata.line_count, (double)(time_model_built - time_start)/CLOCKS_PER_SEC); fflush(stderr);
+	}
+	if (cmd_args.verbose >= -1) {
+		const double pool_savings = ((double)vocab_malloc_bytes + word_list_pool.malloc_bytes - vocab_pool_bytes - word_list_pool.reserved) / 1048576; // Versus a malloc() per entry and key
+		if (pool_savings > 0.05)
+			fprintf(stderr, "%s: Approximate mem usage: %'.1fMB  (%'.1fMB less for the vocabulary, from keeping its strings and entries in flat tables)\n", argv_0_basename, (double)memusage / 1048576, pool_savings);
+		else
+			fprintf(stderr, "%s: Approximate mem usage: %'.1fMB\n", argv_0_basename, (double)memusage / 1048576);
+		fflush(stderr);
+	}
+
+	float * restrict entropy_terms = NULL;
+	if (cmd_args.class_algo == EXCHANGE || cmd_args.class_algo == EXCHANGE_BROWN)
+		entropy_terms = build_entropy_terms(cmd_args);
 
-	cluster(cmd_args, global_metadata, sent_store_int, word_counts, word_list, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts);
+	char * * class_bitstrings = NULL; // Each class' path in the tree of merges, for Brown clustering
+	if (cmd_args.class_algo == BROWN  ||  cmd_args.class_algo == EXCHANGE_BROWN)
+		class_bitstrings = calloc(cmd_args.num_classes, sizeof(char *));
+	cluster(cmd_args, global_metadata, sent_store_int, tune_counts, word_list, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, entropy_terms, class_bitstrings);
 
 	// Now print the final word2class mapping
 	if (cmd_args.verbose >= 0) {
 		FILE *out_file = stdout;
 		if (out_file_string)
 			out_file = fopen(out_file_string, "w");
-		if (cmd_args.class_algo == EXCHANGE && (!cmd_args.print_word_vectors)) {
+		if (class_bitstrings) {
+			print_words_and_bitstrings(out_file, global_metadata.type_count, word_list, word_counts, word2class, class_bitstrings);
+		} else if (cmd_args.class_algo == EXCHANGE && (!cmd_args.print_word_vectors)) {
 			print_words_and_classes(out_file, global_metadata.type_count, word_list, word_counts, word2class, (int)cmd_args.class_offset, cmd_args.print_freqs);
 		} else if (cmd_args.class_algo == EXCHANGE && cmd_args.print_word_vectors) {
-			print_words_and_vectors(out_file, cmd_args, global_metadata, sent_store_int, word_counts, word_list, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts);
+			print_words_and_vectors(out_file, cmd_args, global_metadata, sent_store_int, tune_counts, word_list, word2class, word_bigrams, word_bigrams_rev, word_class_counts, word_class_rev_counts, entropy_terms, old2new);
 		}
 		fclose(out_file);
 	}
@@ -242,11 +394,30 @@ int main(int argc, char **argv) {
 	if (cmd_args.verbose >= -1)
 		fprintf(stderr, "%s: Finished clustering in %'.2f CPU seconds.  Total wall clock time was about %lim %lis\n", argv_0_basename, (double)(time_clustered - time_model_built)/CLOCKS_PER_SEC, (long)time_secs_total/60, ((long)time_secs_total % 60)  );
 
+	if (class_bitstrings) {
+		for (wclass_t class = 0; class < cmd_args.num_classes; class++)
+			free(class_bitstrings[class]);
+		free(class_bitstrings);
+	}
+	free(entropy_terms);
+	if (word_class_counts)
+		free_word_class_counts(word_class_counts);
+	if (word_class_rev_counts)
+		free_word_class_counts(word_class_rev_counts);
 	free(word2class);
-	free(word_bigrams);
+	free(old2new);
+	free_bigram_counts(word_bigrams);
+	if (word_bigrams_rev)
+		free_bigram_counts(word_bigrams_rev);
 	free(word_list);
+	map_pool_release(&word_list_pool);
+	if (tune_counts != word_counts)
+		free(tune_counts);
 	free(word_counts);
 	free(sent_store_int);
+	if (cache_loaded)
+		close_corpus_cache(&corpus_cache);
+	free_corpus_files(&in_train_files);
 	exit(0);
 }
 
@@ -260,34 +431,53 @@ Usage:    clustercat [options] < corpus.tok.txt > classes.tsv \n\
 Function: Induces word categories from plaintext\n\
 \n\
 Options:\n\
+     --class-algo <s>     Set class-induction algorithm {brown,exchange,exchange-then-brown} (default: exchange).  The Brown ones print each\n\
+                          word's bitstring, the word, and its count.  brown keeps --num-classes + 1 clusters, and takes about V * num_classes^2\n\
+                          steps.  exchange-then-brown builds the tree of Brown merges over the exchange algorithm's classes\n\
      --class-file <file>  Initialize exchange word classes from an existing clustering tsv file (default: pseudo-random initialization\n\
                           for exchange). If you use this option, you probably can set --tune-cycles to 3 or so\n\
      --class-offset <c>   Print final word classes starting at a given number (default: %d)\n\
+     --entropy-table      Look up n*log2(n) terms in a 40 MB table, rather than computing the bigger ones.  Mostly for benchmarking\n\
  -h, --help               Print this usage\n\
-     --in <file>          Specify input training file (default: stdin)\n\
+     --in <file ...>      Specify input training files, plain or compressed with gzip or zstd (default: stdin).  Directories give their files, and\n\
+                          globs and @<list file> are expanded, in byte order of the names.  The files are read in parallel, and their lines kept in that order\n\
  -j, --jobs <hu>          Set number of threads to run simultaneously (default: %d threads)\n\
+     --load-cache <file>  Load the preprocessed corpus from a file saved with --save-cache, instead of reading --in .  The cache is checked against\n\
+                          the --in files' size, modification time and contents, and --tune-sents.  If it doesn't match, the corpus is read as usual\n\
      --min-count <hu>     Minimum count of entries in training set to consider (default: %d occurrences)\n\
      --max-array <c>      Set maximum order of n-grams for which to use an array instead of a sparse hash map (default: %d-grams)\n\
  -n, --num-classes <hu>   Set number of word classes (default: 1.2 * square root of vocabulary size)\n\
      --out <file>         Specify output file (default: stdout)\n\
      --print-freqs        Print word frequencies after words and classes in final clustering output (useful for visualization)\n\
  -q, --quiet              Print less output.  Use additional -q for even less output\n\
+     --reorder-words      Renumber rare words so that ones sharing their most frequent neighbor are next to each other, meant for better cache use\n\
+                          during exchange.  Experimental:  no speedup has been shown yet.  Words are then visited in a different order, so the\n\
+                          clustering differs a little\n\
      --rev-alternate <u>  How often to alternate using reverse predictive exchange. 0==never, 1==after every normal cycle (default: %u)\n\
+     --save-cache <file>  Save the preprocessed corpus (vocabulary, sentences, and bigram listings) to a file, for --load-cache in later runs with\n\
+                          any --num-classes, --min-count, --rev-alternate, etc.  Needs --in .  Skipped if --load-cache succeeds\n\
+     --stream             Don't keep the corpus in memory.  Read it once to count words and again to count bigrams, and report the exchange objective\n\
+                          instead of the corpus log-likelihood.  Stdin is copied to a temporary file.  Reads the whole corpus unless --tune-sents is given\n\
+     --tune-sample        Count words over the whole corpus, and tune on a uniform random sample of --tune-sents of its lines instead of the\n\
+                          first ones.  The corpus is read once, a block at a time.  The sample is the same every run\n\
      --tune-sents <lu>    Set size of sentence store to tune on (default: first %'lu lines)\n\
      --tune-cycles <hu>   Set max number of cycles to tune on (default: %d cycles)\n\
      --unidirectional     Disable simultaneous bidirectional predictive exchange. Results in faster cycles, but slower & worse convergence\n\
                           If you want to do basic predictive exchange, use:  --rev-alternate 0 --unidirectional\n\
  -v, --verbose            Print additional info to stderr.  Use additional -v for more verbosity\n\
+     --verify-every <hu>  Recompute the tracked objective and log-likelihood from scratch every <hu> cycles, stopping if they disagree, and print the corpus LL and PP.  Otherwise only the class bigram model's classLL and classPP are printed (default: %u == never)\n\
+     --word-block <u>     Evaluate blocks of <u> words in parallel against a snapshot of the counts, then commit their moves in order.\n\
+                          Output is identical for any --jobs value (default: %u == off)\n\
      --word-vectors <s>   Print word vectors (a.k.a. word embeddings) instead of discrete classes.\n\
                           Specify <s> as either 'text' or 'binary'.  The binary format is compatible with word2vec\n\
 \n\
-", cmd_args.class_offset, cmd_args.num_threads, cmd_args.min_count, cmd_args.max_array, cmd_args.rev_alternate, cmd_args.max_tune_sents, cmd_args.tune_cycles);
+", cmd_args.class_offset, cmd_args.num_threads, cmd_args.min_count, cmd_args.max_array, cmd_args.rev_alternate, cmd_args.max_tune_sents, cmd_args.tune_cycles, cmd_args.verify_every, cmd_args.word_block);
 }
-//     --class-algo <s>     Set class-induction algorithm {brown,exchange,exchange-then-brown} (default: exchange)\n\
 // -o, --order <i>          Maximum n-gram order in training set to consider (default: %d-grams)\n\
 // -w, --weights 'f f ...'  Set class interpolation weights for: 3-gram, 2-gram, 1-gram, rev 2-gram, rev 3-gram. (default: %s)\n\
 
 void parse_cmd_args(int argc, char **argv, char * restrict usage, struct cmd_args *cmd_args) {
+	bool tune_sents_given = false;
 	for (int arg_i = 1; arg_i < argc; arg_i++) {
 		if (!(strcmp(argv[arg_i], "-h") && strcmp(argv[arg_i], "--help"))) {
 			printf("%s", usage);
@@ -308,12 +498,19 @@ void parse_cmd_args(int argc, char **argv, char * restrict usage, struct cmd_arg
 		} else if (!strcmp(argv[arg_i], "--class-offset")) {
 			cmd_args->class_offset = (signed char)atoi(argv[arg_i+1]);
 			arg_i++;
-		} else if (!strcmp(argv[arg_i], "--in")) {
-			in_train_file_string = argv[arg_i+1];
-			arg_i++;
+		} else if (!strcmp(argv[arg_i], "--entropy-table")) {
+			cmd_args->entropy_table = true;
+		} else if (!strcmp(argv[arg_i], "--in")) { // Takes everything up to the next option, so that the shell can expand a glob
+			do {
+				add_corpus_files(&in_train_files, argv[arg_i+1]);
+				arg_i++;
+			} while (arg_i + 1 < argc  &&  argv[arg_i+1][0] != '-');
 		} else if (!(strcmp(argv[arg_i], "-j") && strcmp(argv[arg_i], "--jobs"))) {
 			cmd_args->num_threads = (unsigned int) atol(argv[arg_i+1]);
 			arg_i++;
+		} else if (!strcmp(argv[arg_i], "--load-cache")) {
+			load_cache_file = argv[arg_i+1];
+			arg_i++;
 		} else if (!strcmp(argv[arg_i], "--min-count")) {
 			cmd_args->min_count = (unsigned int) atol(argv[arg_i+1]);
 			arg_i++;
@@ -335,11 +532,21 @@ void parse_cmd_args(int argc, char **argv, char * restrict usage, struct cmd_arg
 			cmd_args->print_freqs = true;
 		} else if (!(strcmp(argv[arg_i], "-q") && strcmp(argv[arg_i], "--quiet"))) {
 			cmd_args->verbose--;
+		} else if (!strcmp(argv[arg_i], "--reorder-words")) {
+			cmd_args->reorder_words = true;
 		} else if (!strcmp(argv[arg_i], "--rev-alternate")) {
 			cmd_args->rev_alternate = (unsigned char) atoi(argv[arg_i+1]);
 			arg_i++;
+		} else if (!strcmp(argv[arg_i], "--save-cache")) {
+			save_cache_file = argv[arg_i+1];
+			arg_i++;
+		} else if (!strcmp(argv[arg_i], "--stream")) {
+			cmd_args->stream = true;
+		} else if (!strcmp(argv[arg_i], "--tune-sample")) {
+			cmd_args->tune_sample = true;
 		} else if (!strcmp(argv[arg_i], "--tune-sents")) {
 			cmd_args->max_tune_sents = atol(argv[arg_i+1]);
+			tune_sents_given = true;
 			arg_i++;
 		} else if (!strcmp(argv[arg_i], "--tune-cycles")) {
 			cmd_args->tune_cycles = (unsigned short) atol(argv[arg_i+1]);
@@ -348,9 +555,15 @@ void parse_cmd_args(int argc, char **argv, char * restrict usage, struct cmd_arg
 			cmd_args->unidirectional = true;
 		} else if (!(strcmp(argv[arg_i], "-v") && strcmp(argv[arg_i], "--verbose"))) {
 			cmd_args->verbose++;
+		} else if (!strcmp(argv[arg_i], "--verify-every")) {
+			cmd_args->verify_every = (unsigned short) atol(argv[arg_i+1]);
+			arg_i++;
 		} else if (!(strcmp(argv[arg_i], "-w") && strcmp(argv[arg_i], "--weights"))) {
 			weights_string = argv[arg_i+1];
 			arg_i++;
+		} else if (!strcmp(argv[arg_i], "--word-block")) {
+			cmd_args->word_block = (word_id_t) atol(argv[arg_i+1]);
+			arg_i++;
 		} else if (!(strcmp(argv[arg_i], "--word-vectors"))) {
 			char * restrict print_word_vectors_string = argv[arg_i+1];
 			arg_i++;
@@ -365,159 +578,295 @@ void parse_cmd_args(int argc, char **argv, char * restrict usage, struct cmd_arg
 			exit(2);
 		}
 	}
+
+	if (cmd_args->stream  &&  cmd_args->verify_every) {
+		printf("%s: --verify-every queries the sentence store, which isn't kept with --stream\n", argv_0_basename);
+		exit(10);
+	}
+	if (cmd_args->tune_sample  &&  (cmd_args->stream || load_cache_file || save_cache_file)) {
+		printf("%s: --tune-sample can't be used with --stream, --load-cache, or --save-cache\n", argv_0_basename);
+		exit(10);
+	}
+	if ((load_cache_file || save_cache_file)  &&  in_train_files.num_files == 0) {
+		printf("%s: --load-cache and --save-cache need --in, to check the cache against the corpus\n", argv_0_basename);
+		exit(10);
+	}
+	if (cmd_args->stream  &&  !tune_sents_given)
+		cmd_args->max_tune_sents = ULONG_MAX;
 }
 
-size_t  sent_buffer2sent_store_int(struct_map_word **ngram_map, char * restrict sent_buffer[restrict], struct_sent_int_info sent_store_int[restrict], const unsigned long num_sents_in_store) {
-	size_t local_memusage = 0;
+static sentlen_t tokenize_corpus_line(const struct_corpus * restrict corpus, const unsigned long line_num, const char * restrict words[restrict], size_t word_lengths[restrict], const bool notify) {
+	size_t line_length;
+	const char * restrict line = corpus_line(corpus, line_num, &line_length);
+	sentlen_t num_words = tokenize_span(line, line_length, words, word_lengths, STDIN_SENT_MAX_WORDS - 1);
+
+	if (num_words == STDIN_SENT_MAX_WORDS - 1) { // Deal with pathologically-long lines.  Leave room for <s> and </s>
+		num_words--;
+		if (notify)
+			fprintf(stderr, "%s: Notice: Truncating pathologically-long line %lu starting with: \"%.*s %.*s %.*s ...\"\n", argv_0_basename, corpus->first_line + line_num + 1, (int)(word_lengths[0] < MAX_WORD_LEN ? word_lengths[0] : MAX_WORD_LEN), words[0], (int)(word_lengths[1] < MAX_WORD_LEN ? word_lengths[1] : MAX_WORD_LEN), words[1], (int)(word_lengths[2] < MAX_WORD_LEN ? word_lengths[2] : MAX_WORD_LEN), words[2]);
+	}
 
-	for (unsigned long i = 0; i < num_sents_in_store; i++) { // Copy string-oriented sent_buffer[] to int-oriented sent_store_int[]
-		if (sent_buffer[i] == NULL) // No more sentences in buffer
-			break;
+	for (sentlen_t w_i = 0; w_i < num_words; w_i++) {
+		if (word_lengths[w_i] > MAX_WORD_LEN) { // Deal with pathologically-long words
+			word_lengths[w_i] = MAX_WORD_LEN;
+			if (notify)
+				fprintf(stderr, "%s: Notice: Truncating pathologically-long word '%.*s'\n", argv_0_basename, MAX_WORD_LEN, words[w_i]);
+		}
+	}
+	return num_words;
+}
 
-		char * restrict sent_i = sent_buffer[i];
-		//printf("sent[%lu]=<<%s>>\n", i, sent_buffer[i]); fflush(stdout);
+static const char * const special_words[] = {UNKNOWN_WORD, "<s>", "</s>"}; // The list of unique words should always start with these, in this order
 
-		word_id_t sent_int_temp[SENT_LEN_MAX];
+void add_special_words(void) { // Puts the special words into an empty ngram_map, so that they're there even if the corpus is empty.  The blocks' counts are added to them later
+	if (ngram_map.num_entries)
+		return;
+	for (unsigned int special_i = 0; special_i < 3; special_i++) {
+		const size_t special_len = strlen(special_words[special_i]);
+		map_insert(&ngram_map, special_words[special_i], special_len, map_hash(special_words[special_i], special_len), 0);
+	}
+}
 
-		// Stupid strtok is destructive
-		char * restrict pch = NULL;
-		pch = strtok(sent_i, TOK_CHARS);
+static void merge_shard_vocabs(struct_corpus_shard shards[const], const unsigned int num_shards) { // Adds the shards' word counts to the global ngram_map
+	// Each thread merges the words in its own hash partition, going through the shards in corpus order.  So there's no locking, and each word's merged entry
+	// comes from its first occurrence in the corpus.  The merged entries are then put into ngram_map in that order, which is what sort_by_count() uses to break ties.
+	// A shard's entries are in local id order, and every table uses the same hash function, so the stored hashes are reused all the way through
+	const unsigned int num_partitions = num_shards;
+	struct_map_word_table * restrict partitions = calloc(num_partitions, sizeof(struct_map_word_table));
+	word_id_t * * restrict first_entries = malloc(sizeof(word_id_t *) * num_shards); // Per shard and local id, 1 + the merged entry's index if this is the word's first occurrence
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++)
+		first_entries[shard_i] = calloc(shards[shard_i].num_types ? shards[shard_i].num_types : 1, sizeof(word_id_t));
+
+	#pragma omp parallel for num_threads(num_partitions)
+	for (unsigned int partition = 0; partition < num_partitions; partition++) {
+		for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+			const struct_map_word_table * restrict vocab = &shards[shard_i].vocab;
+			for (word_id_t local_id = 0; local_id < vocab->num_entries; local_id++) {
+				const struct_map_word * restrict entry = &vocab->entries[local_id];
+				if ((entry->hash >> 32) % num_partitions != partition)
+					continue;
+				struct_map_word * merged = map_lookup(&partitions[partition], entry->key, entry->key_len, entry->hash);
+				if (merged == NULL) {
+					merged = map_insert(&partitions[partition], entry->key, entry->key_len, entry->hash, 0); // Its word_id becomes 1 once it's in ngram_map
+					first_entries[shard_i][local_id] = partitions[partition].num_entries;
+				}
+				merged->count += entry->count;
+			}
+		}
+	}
 
-		// Initialize first element in sentence to <s>
-		sent_int_temp[0] = map_find_int(ngram_map, "<s>");
+	const bool fresh_map = (ngram_map.num_entries == 0); // Otherwise this is a block with --stream or --tune-sample, and some words are already there
+	if (fresh_map) {
+		for (unsigned int special_i = 0; special_i < 3; special_i++) {
+			const size_t special_len = strlen(special_words[special_i]);
+			const uint64_t hash = map_hash(special_words[special_i], special_len);
+			struct_map_word * restrict special = map_lookup(&partitions[(hash >> 32) % num_partitions], special_words[special_i], special_len, hash);
+			map_insert(&ngram_map, special_words[special_i], special_len, hash, special ? special->count : 0); // Otherwise it's not in the corpus itself
+			if (special)
+				special->word_id = 1;
+		}
+	}
 
-		sentlen_t w_i = 1; // Word 0 is <s>; we initialize it here to be able to use it after the loop for </s>
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+		const struct_map_word_table * restrict vocab = &shards[shard_i].vocab;
+		for (word_id_t local_id = 0; local_id < shards[shard_i].num_types; local_id++) {
+			if (first_entries[shard_i][local_id] == 0)
+				continue;
+			struct_map_word * restrict merged = &partitions[(vocab->entries[local_id].hash >> 32) % num_partitions].entries[first_entries[shard_i][local_id] - 1];
+			if (merged->word_id)
+				continue;
+			struct_map_word * existing = NULL;
+			if (!fresh_map)
+				existing = map_lookup(&ngram_map, merged->key, merged->key_len, merged->hash);
+			if (existing)
+				existing->count += merged->count;
+			else
+				map_insert(&ngram_map, merged->key, merged->key_len, merged->hash, merged->count);
+		}
+		free(first_entries[shard_i]);
+	}
+	for (unsigned int partition = 0; partition < num_partitions; partition++)
+		delete_all(&partitions[partition]);
+	free(first_entries);
+	free(partitions);
+}
 
-		for (; pch != NULL  &&  w_i < SENT_LEN_MAX; w_i++) {
-			if (w_i == STDIN_SENT_MAX_WORDS - 1) { // Deal with pathologically-long lines
-				//fprintf(stderr, "%s: Warning: Line %lu length at %u. Truncating pathologically-long line starting with: \"%s ...\"\n", argv_0_basename, i+1, w_i, sent_i);
-				break;
+unsigned long parse_corpus(const struct_corpus * restrict corpus, struct_sent_int_info sent_store_int[restrict], struct_corpus_shard shards[restrict], const unsigned int num_shards) { // Uses global ngram_map
+	// Shards cover about the same number of bytes, rather than of lines
+	const size_t corpus_bytes = corpus->line_starts[corpus->num_lines];
+	unsigned long line_i = 0;
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+		const size_t shard_start_byte = corpus_bytes * shard_i / num_shards;
+		while (line_i < corpus->num_lines  &&  corpus->line_starts[line_i] < shard_start_byte)
+			line_i++;
+		shards[shard_i].line_start = line_i;
+		if (shard_i)
+			shards[shard_i-1].line_end = line_i;
+	}
+	shards[num_shards-1].line_end = corpus->num_lines;
+
+	#pragma omp parallel for num_threads(num_shards)
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+		struct_corpus_shard * restrict shard = &shards[shard_i];
+		const char * words[STDIN_SENT_MAX_WORDS];
+		size_t word_lengths[STDIN_SENT_MAX_WORDS];
+		shard->vocab = (struct_map_word_table){0};
+		shard->num_types = 0;
+		shard->num_sents_counted = 0;
+		shard->token_count = 0;
+
+		for (unsigned long i = shard->line_start; i < shard->line_end; i++) {
+			const sentlen_t num_words = tokenize_corpus_line(corpus, i, words, word_lengths, true);
+			const sentlen_t sent_length = num_words + 2; // Include <s> and </s>, which integerize_sent_store() fills in
+			if (sent_store_int) {
+				word_id_t * restrict sent = malloc(sizeof(word_id_t) * sent_length);
+				for (sentlen_t w_i = 0; w_i < num_words; w_i++)
+					sent[w_i+1] = map_intern_len(&shard->vocab, words[w_i], word_lengths[w_i], &shard->num_types)->word_id;
+				sent_store_int[i].sent   = sent;
+				sent_store_int[i].length = sent_length;
+			} else { // Just counting words, with --stream
+				for (sentlen_t w_i = 0; w_i < num_words; w_i++)
+					map_intern_len(&shard->vocab, words[w_i], word_lengths[w_i], &shard->num_types);
 			}
 
-			sent_int_temp[w_i] = map_find_int(ngram_map, pch);
-			//printf("pch=%s, int=%u, count=%u\n", pch, sent_int_temp[w_i], sent_counts_int_temp[w_i]);
-
-			pch = strtok(NULL, TOK_CHARS);
+			size_t line_length;
+			if (*corpus_line(corpus, i, &line_length) != '\n') { // Empty lines are still in the sentence store, but they aren't counted
+				shard->num_sents_counted++;
+				shard->token_count += sent_length;
+			}
 		}
+	}
 
-		// Initialize first element in sentence to </s>
-		sent_int_temp[w_i] = map_find_int(ngram_map, "</s>");
+	merge_shard_vocabs(shards, num_shards);
 
-		sentlen_t sent_length = w_i + 1; // Include <s>;  we use this local variable for perspicuity later on
-		sent_store_int[i].length = sent_length;
+	unsigned long token_count = 0;
+	unsigned long num_sents_counted = 0;
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+		token_count       += shards[shard_i].token_count;
+		num_sents_counted += shards[shard_i].num_sents_counted;
+	}
+	map_update_count(&ngram_map, "<s>", num_sents_counted);
+	map_update_count(&ngram_map, "</s>", num_sents_counted);
 
-		// Now that we know the actual sentence length, we can allocate the right amount for the sentence
-		sent_store_int[i].sent = malloc(sizeof(word_id_t) * sent_length);
+	return token_count;
+}
+
+void free_shard_vocabs(struct_corpus_shard shards[restrict], const unsigned int num_shards) {
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++)
+		delete_all(&shards[shard_i].vocab);
+}
 
-		local_memusage += sizeof(word_id_t) * sent_length;
+size_t integerize_sent_store(const struct_map_word_table * restrict ngram_map, struct_corpus_shard shards[restrict], const unsigned int num_shards, struct_sent_int_info sent_store_int[restrict]) {
+	size_t local_memusage = 0;
+	const word_id_t start_id = map_find_int(ngram_map, "<s>");
+	const word_id_t end_id   = map_find_int(ngram_map, "</s>");
+	const word_id_t unk_id   = map_find_int(ngram_map, UNKNOWN_WORD);
+
+	#pragma omp parallel for num_threads(num_shards) reduction(+:local_memusage)
+	for (unsigned int shard_i = 0; shard_i < num_shards; shard_i++) {
+		struct_corpus_shard * restrict shard = &shards[shard_i];
+		word_id_t * restrict local2global = malloc(sizeof(word_id_t) * (shard->num_types ? shard->num_types : 1));
+		for (word_id_t local_id = 0; local_id < shard->vocab.num_entries; local_id++) {
+			const struct_map_word * restrict entry = &shard->vocab.entries[local_id];
+			const struct_map_word * restrict global = map_lookup(ngram_map, entry->key, entry->key_len, entry->hash);
+			local2global[local_id] = global ? global->word_id : unk_id; // Filtered words become <unk>
+		}
+		delete_all(&shard->vocab);
+
+		for (unsigned long i = shard->line_start; i < shard->line_end; i++) {
+			word_id_t * restrict sent = sent_store_int[i].sent;
+			const sentlen_t sent_length = sent_store_int[i].length;
+			sent[0] = start_id;
+			for (sentlen_t w_i = 1; w_i < sent_length - 1; w_i++)
+				sent[w_i] = local2global[sent[w_i]];
+			sent[sent_length-1] = end_id;
+			local_memusage += sizeof(word_id_t) * sent_length;
+		}
+		free(local2global);
+	}
 
-		// Copy the temporary fixed-width array on stack to dynamic-width array in heap
-		memcpy(sent_store_int[i].sent, sent_int_temp, sizeof(word_id_t) * sent_length);
+	return local_memusage;
+}
 
-		free(sent_i); // Free-up string-based sentence
+size_t integerize_corpus(const struct_map_word_table * restrict ngram_map, const struct_corpus * restrict corpus, const unsigned int num_threads, struct_sent_int_info sent_store_int[restrict]) { // Fills the sentence store straight from the final word ids, for --tune-sample
+	size_t local_memusage = 0;
+	const unsigned int num_chunks = num_threads ? num_threads : 1;
+	const word_id_t start_id = map_find_int(ngram_map, "<s>");
+	const word_id_t end_id   = map_find_int(ngram_map, "</s>");
+	const word_id_t unk_id   = map_find_int(ngram_map, UNKNOWN_WORD);
+
+	#pragma omp parallel for num_threads(num_chunks) reduction(+:local_memusage)
+	for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+		const char * words[STDIN_SENT_MAX_WORDS];
+		size_t word_lengths[STDIN_SENT_MAX_WORDS];
+		for (unsigned long i = corpus->num_lines * chunk / num_chunks; i < corpus->num_lines * (chunk+1) / num_chunks; i++) {
+			const sentlen_t num_words = tokenize_corpus_line(corpus, i, words, word_lengths, false); // Long lines were already reported while counting words
+			const sentlen_t sent_length = num_words + 2;
+			word_id_t * restrict sent = malloc(sizeof(word_id_t) * sent_length);
+			sent[0] = start_id;
+			for (sentlen_t w_i = 0; w_i < num_words; w_i++) {
+				const struct_map_word * restrict entry = map_lookup(ngram_map, words[w_i], word_lengths[w_i], map_hash(words[w_i], word_lengths[w_i]));
+				sent[w_i+1] = entry ? entry->word_id : unk_id; // Filtered words become <unk>
+			}
+			sent[sent_length-1] = end_id;
+			sent_store_int[i].sent   = sent;
+			sent_store_int[i].length = sent_length;
+			local_memusage += sizeof(word_id_t) * sent_length;
+		}
 	}
+
 	return local_memusage;
 }
 
-void build_word_count_array(struct_map_word **ngram_map, char * restrict word_list[const], word_count_t word_counts[restrict], const word_id_t type_count) {
+void build_word_count_array(const struct_map_word_table * restrict ngram_map, char * restrict word_list[const], word_count_t word_counts[restrict], const word_id_t type_count) {
 	for (word_id_t i = 0; i < type_count; i++) {
 		word_counts[i] = map_find_count(ngram_map, word_list[i]);
 	}
 }
 
-void populate_word_ids(struct_map_word **ngram_map, char * restrict word_list[const], const word_id_t type_count) {
+void populate_word_ids(struct_map_word_table * restrict ngram_map, char * restrict word_list[const], const word_id_t type_count) {
 	for (word_id_t i = 0; i < type_count; i++) {
 		//printf("%s=%u\n", word_list[i], i);
 		map_set_word_id(ngram_map, word_list[i], i);
 	}
 }
 
-word_id_t filter_infrequent_words(const struct cmd_args cmd_args, struct_model_metadata * restrict model_metadata, struct_map_word ** ngram_map) {
+word_id_t filter_infrequent_words(const struct cmd_args cmd_args, struct_model_metadata * restrict model_metadata, struct_map_word_table * restrict ngram_map) {
 
 	unsigned long number_of_deleted_words = 0;
 	unsigned long vocab_size = model_metadata->type_count; // Save this to separate variable since we'll modify model_metadata.type_count later
 
-	// Get keys
-	// Iterate over keys
-	//   If count of key_i < threshold,
-	//     increment count of <unk> by count of key_i,
+	// Iterate over entries
+	//   If count of entry < threshold,
+	//     increment count of <unk> by count of entry,
 	//     decrement model_metadata.type_count by one
-	//     free & delete entry in map,
+	//     delete entry in map.  It stays in the entries until sort_by_count()
 
-	char **local_word_list = (char **)malloc(model_metadata->type_count * sizeof(char*));
-	//char * local_word_list[model_metadata->type_count];
-	if (vocab_size != get_keys(ngram_map, local_word_list)) {
-		printf("Error: model_metadata->type_count != get_keys()\n"); fflush(stderr);
+	if (vocab_size != map_count(ngram_map)) {
+		printf("Error: model_metadata->type_count != map_count()\n"); fflush(stderr);
 		exit(4);
 	}
 
-	for (unsigned long word_i = 0; word_i < vocab_size; word_i++) {
-		unsigned long word_i_count = map_find_count(ngram_map, local_word_list[word_i]);  // We'll use this a couple times
-		if ((word_i_count < cmd_args.min_count) && (strncmp(local_word_list[word_i], UNKNOWN_WORD, MAX_WORD_LEN)) ) { // Don't delete <unk>
+	for (word_id_t word_i = 0; word_i < ngram_map->num_entries; word_i++) {
+		struct_map_word * restrict entry = &ngram_map->entries[word_i];
+		if (entry->deleted)
+			continue;
+		unsigned long word_i_count = entry->count;  // We'll use this a couple times
+		if ((word_i_count < cmd_args.min_count) && (strncmp(entry->key, UNKNOWN_WORD, MAX_WORD_LEN)) ) { // Don't delete <unk>
 			number_of_deleted_words++;
-			map_update_count(ngram_map, UNKNOWN_WORD, word_i_count);
+			map_update_count(ngram_map, UNKNOWN_WORD, word_i_count); // <unk> is always there already, so this doesn't move the entries
 			if (cmd_args.verbose > 3)
-				printf("Filtering-out word: %s (%lu < %hu);\tcount(%s)=%u\n", local_word_list[word_i], word_i_count, cmd_args.min_count, UNKNOWN_WORD, map_find_count(ngram_map, UNKNOWN_WORD));
+				printf("Filtering-out word: %s (%lu < %hu);\tcount(%s)=%u\n", entry->key, word_i_count, cmd_args.min_count, UNKNOWN_WORD, map_find_count(ngram_map, UNKNOWN_WORD));
 			model_metadata->type_count--;
-			struct_map_word *local_s;
-			HASH_FIND_STR(*ngram_map, local_word_list[word_i], local_s);
-			delete_entry(ngram_map, local_s);
+			delete_entry(ngram_map, entry);
 		}
 		//else
-			//printf("Keeping word: %s (%lu < %hu);\tcount(%s)=%u\n", local_word_list[word_i], word_i_count, cmd_args.min_count, UNKNOWN_WORD, map_find_count(ngram_map, UNKNOWN_WORD));
+			//printf("Keeping word: %s (%lu < %hu);\tcount(%s)=%u\n", entry->key, word_i_count, cmd_args.min_count, UNKNOWN_WORD, map_find_count(ngram_map, UNKNOWN_WORD));
 	}
 
-	free(local_word_list);
 	return number_of_deleted_words;
 }
 
-void increment_ngram_variable_width(struct_map_word **ngram_map, char * restrict sent[const], const short * restrict word_lengths, short start_position, const sentlen_t i) {
-	short j;
-	size_t sizeof_char = sizeof(char); // We use this multiple times
-	unsigned char ngram_len = 0; // Terminating char '\0' is same size as joining tab, so we'll just count that later
-
-	// We first build the longest n-gram string, then successively remove the leftmost word
-
-	for (j = i; j >= start_position ; j--) { // Determine length of longest n-gram string, starting with smallest to ensure longest string is less than 255 chars
-		if (ngram_len + sizeof_char + word_lengths[j]  < UCHAR_MAX ) { // Ensure n-gram string is less than 255 chars
-			ngram_len += sizeof_char + word_lengths[j]; // the additional sizeof_char is for either a space for words in the history, or for a \0 for word_i
-		} else { // It's too big; ensmallen n-gram
-			start_position++;
-		}
-
-		//printf("increment_ngram1: start_position=%d, ngram_len=%u, j=%d, len(j)=%u, w_j=%s, i=%i, w_i=%s\n", start_position, ngram_len, j, word_lengths[j], sent[j], i, sent[i]);
-	}
-
-	if (!ngram_len) // We couldn't do anything with this n-gram because it was too long.  Wa, wa, wa
-		return;
-
-	char ngram[ngram_len];
-	strcpy(ngram, sent[start_position]);
-	// For single words, append \0 instead of space
-	if (start_position < i)
-		strcat(ngram, SECONDARY_SEP_STRING);
-	else
-		ngram[ngram_len] = '\0';
-	//printf("increment_ngram1.5: start_position=%d, i=%i, w_i=%s, ngram_len=%d, ngram=<<%s>>\n", start_position, i, sent[i], ngram_len, ngram);
-
-	for (j = start_position+1; j <= i ; ++j) { // Build longest n-gram string.  We do this as a separate loop than before since malloc'ing a bunch of times is probably more expensive than the first cheap loop
-		strcat(ngram, sent[j]);
-		if (j < i) // But wait! There's more!
-			strcat(ngram, SECONDARY_SEP_STRING);
-	}
-	//printf("increment_ngram3: start_position=%d, i=%i, w_i=%s, ngram_len=%d, ngram=<<%s>>\n", start_position, i, sent[i], ngram_len, ngram);
-
-	char * restrict jp = ngram;
-	short diff = i - start_position;
-	for (j = start_position; j <= i; ++j, --diff) { // Traverse longest n-gram string
-		//if (cmd_args.verbose)
-			//printf("increment_ngram4: start_position=%d, i=%i, w_i=%s, ngram_len=%d, ngram=<<%s>>, jp=<<%s>>\n", start_position, i, sent[i], ngram_len, ngram, jp);
-		map_increment_count(ngram_map, jp);
-		//if (diff > 0) // 0 allows for unigrams
-			jp += sizeof_char + word_lengths[j];
-	}
-}
-
 void increment_ngram_fixed_width(const struct cmd_args cmd_args, count_arrays_t count_arrays, wclass_t sent[const], short start_position, const sentlen_t i) {
 
 	// n-grams handled using a dense array for each n-gram order
@@ -552,6 +901,21 @@ void tally_class_counts_in_store(const struct cmd_args cmd_args, const struct_se
 	}
 }
 
+void tally_class_counts_in_listing(const struct cmd_args cmd_args, const struct_word_bigram_listing * restrict word_bigrams, const struct_model_metadata model_metadata, const wclass_t word2class[const], count_arrays_t count_arrays) { // Class unigram and bigram counts, for when there's no sentence store
+	// Every token but the <s> that starts each sentence is the second word of some bigram.  Class trigrams would need the corpus, so those stay empty
+	count_arrays[0][word2class[model_metadata.start_sent_id]] += model_metadata.line_count;
+	for (word_id_t word_2 = 0; word_2 < word_bigrams->num_words; word_2++) {
+		const struct_word_bigram_cell * restrict cells = word_bigram_cells(word_bigrams, word_2);
+		const size_t length = word_bigram_length(word_bigrams, word_2);
+		for (size_t i = 0; i < length; i++) {
+			wclass_t class_bigram[2] = {word2class[cells[i].word], word2class[word_2]};
+			count_arrays[0][class_bigram[1]] += cells[i].count;
+			if (cmd_args.max_array > 1)
+				count_arrays[1][array_offset(class_bigram, 2, cmd_args.num_classes)] += cells[i].count;
+		}
+	}
+}
+
 void tally_int_sents_in_store(const struct cmd_args cmd_args, const struct_sent_int_info * const sent_store_int, const struct_model_metadata model_metadata, const wclass_t word2class[const], count_arrays_t count_arrays, const word_id_t temp_word, const wclass_t temp_class) {
 
 	for (unsigned long current_sent_num = 0; current_sent_num < model_metadata.line_count; current_sent_num++) { // loop over sentences
@@ -573,83 +937,6 @@ void tally_int_sents_in_store(const struct cmd_args cmd_args, const struct_sent_
 	}
 }
 
-unsigned long process_str_sents_in_buffer(char * restrict sent_buffer[], const unsigned long num_sents_in_buffer) {
-	unsigned long token_count = 0;
-	char local_sent_copy[STDIN_SENT_MAX_CHARS];
-	local_sent_copy[STDIN_SENT_MAX_CHARS-1] = '\0'; // Ensure at least last element of array is terminating character
-
-	for (unsigned long current_sent_num = 0; current_sent_num < num_sents_in_buffer; current_sent_num++) {
-		strncpy(local_sent_copy, sent_buffer[current_sent_num], STDIN_SENT_MAX_CHARS-2); // Strtok, which is used later, is destructive
-		token_count += process_str_sent(local_sent_copy);
-	}
-
-	return token_count;
-}
-
-unsigned long process_str_sent(char * restrict sent_str) { // Uses global ngram_map
-	if (!strncmp(sent_str, "\n", 1)) // Ignore empty lines
-		return 0;
-
-	struct_sent_info sent_info = {0};
-	sent_info.sent = malloc(STDIN_SENT_MAX_WORDS * sizeof(char*));
-
-	// We could have built up the word n-gram counts directly from sent_str, but it's
-	// the only one out of the three models we're building that we can do this way, and
-	// it's simpler to have a more uniform way of building these up.
-
-	tokenize_sent(sent_str, &sent_info);
-	unsigned long token_count = sent_info.length;
-	//if (cmd_args.verbose > 2) {
-	//	print_sent_info(&sent_info);
-	//	fflush(stdout);
-	//}
-
-	register sentlen_t i;
-	for (i = 0; i < sent_info.length; i++) {
-		increment_ngram_variable_width(&ngram_map, sent_info.sent, sent_info.word_lengths, i, i); // N-grams starting point is 0, for <s>;  We only need unigrams for visible words
-	}
-
-	free(sent_info.sent);
-	return token_count;
-}
-
-
-void tokenize_sent(char * restrict sent_str, struct_sent_info *sent_info) {
-	// Stupid strtok is destructive
-	char * restrict pch = NULL;
-	pch = strtok(sent_str, TOK_CHARS);
-
-	// Initialize first element in sentence to <s>
-	sent_info->sent[0] = "<s>";
-	sent_info->word_lengths[0]  = strlen("<s>");
-
-	sentlen_t w_i = 1; // Word 0 is <s>
-
-	for (; pch != NULL  &&  w_i < SENT_LEN_MAX; w_i++) {
-		if (w_i == STDIN_SENT_MAX_WORDS - 1) { // Deal with pathologically-long lines
-			fprintf(stderr, "%s: Notice: Truncating pathologically-long line starting with: \"%s %s %s %s %s %s ...\"\n", argv_0_basename, sent_info->sent[1], sent_info->sent[2], sent_info->sent[3], sent_info->sent[4], sent_info->sent[5], sent_info->sent[6]);
-			break;
-		}
-
-		sent_info->sent[w_i] = pch;
-		sent_info->word_lengths[w_i] = strlen(pch);
-		//printf("pch=%s; len=%u\n", pch, sent_info->word_lengths[w_i]);
-
-		if (sent_info->word_lengths[w_i] > MAX_WORD_LEN) { // Deal with pathologically-long words
-			pch[MAX_WORD_LEN] = '\0';
-			sent_info->word_lengths[w_i] = MAX_WORD_LEN;
-			fprintf(stderr, "%s: Notice: Truncating pathologically-long word '%s'\n", argv_0_basename, pch);
-		}
-
-		pch = strtok(NULL, TOK_CHARS);
-	}
-
-	// Initialize last element in sentence to </s>
-	sent_info->sent[w_i] = "</s>";
-	sent_info->word_lengths[w_i]  = strlen("</s>");
-	sent_info->length = w_i + 1; // Include <s>
-}
-
 // Slightly different from free_sent_info() since we don't free the individual words in sent_info.sent here
 void free_sent_info(struct_sent_info sent_info) {
 	for (sentlen_t i = 1; i < sent_info.length-1; ++i) // Assumes word_0 is <s> and word_sentlen is </s>, which weren't malloc'd
@@ -669,218 +956,455 @@ void init_clusters(const struct cmd_args cmd_args, word_id_t vocab_size, wclass_
 			//printf("cls=%-4u w_i=%-8lu #(w)=%-8u str(w)=%-20s vocab_size=%u\n", class, word_i, word_counts[word_i], word_list[word_i], vocab_size);
 			word2class[word_i] = class;
 		}
-
-	} else if (cmd_args.class_algo == BROWN) { // Really simple initialization: one class per word
-		for (unsigned long class = 0; word_i < vocab_size; word_i++, class++)
-			word2class[word_i] = class;
+	} else { // Brown clustering starts with each word in its own cluster, which it keeps track of itself, and sets word2class at the end
+		memset(word2class, 0, sizeof(wclass_t) * vocab_size);
 	}
 }
 
-size_t set_bigram_counts(const struct cmd_args cmd_args, struct_word_bigram_entry * restrict word_bigrams, const struct_sent_int_info * const sent_store_int, const unsigned long line_count, const bool reverse) {
-	// We first build a hash map of bigrams, since we need random access when traversing the corpus.
-	// Then we convert that to an array of linked lists, since we'll need sequential access during the clustering phase of predictive exchange clustering.
-
-	struct_map_bigram *map_bigram = NULL;
-	struct_word_bigram bigram;
+static size_t alloc_bigram_listing(struct_word_bigram_listing * restrict word_bigrams, const word_id_t type_count, const size_t num_cells) { // Offsets and cells go in one block, each starting on a 64-byte boundary
+	const size_t offsets_bytes = ((type_count + 1) * sizeof(size_t) + 63) & ~(size_t)63;
+	const size_t cells_bytes   = num_cells * sizeof(struct_word_bigram_cell);
+	word_bigrams->block = malloc(offsets_bytes + cells_bytes + 64);
+	if (word_bigrams->block == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for bigram listing.  %'.1f MB needed.  Maybe increase --min-count\n", argv_0_basename, (offsets_bytes + cells_bytes + 64) / (double)1048576); fflush(stderr);
+		exit(13);
+	}
+	word_bigrams->offsets   = (size_t *)(((uintptr_t)word_bigrams->block + 63) & ~(uintptr_t)63);
+	word_bigrams->cells     = (struct_word_bigram_cell *)((char *)word_bigrams->offsets + offsets_bytes);
+	word_bigrams->num_cells = num_cells;
+	word_bigrams->num_words = type_count;
+	memset(word_bigrams->offsets, 0, (type_count + 1) * sizeof(size_t));
+	return offsets_bytes + cells_bytes;
+}
 
-	for (unsigned long current_sent_num = 0; current_sent_num < line_count; current_sent_num++) { // loop over sentences
-		register sentlen_t sent_length = sent_store_int[current_sent_num].length;
+static uint64_t * radix_sort_keys(uint64_t * restrict keys, uint64_t * restrict buffer, const size_t num_keys, const unsigned int key_bits, const unsigned int num_chunks) {
+	// Stable LSD radix sort, 8 bits at a time.  Each chunk of keys is histogrammed and scattered by its own thread, and the chunks' buckets are laid out in chunk order.
+	// Returns whichever of keys or buffer ends up holding the sorted keys
+	size_t (* restrict histograms)[256] = malloc(num_chunks * sizeof(*histograms));
+	for (unsigned int shift = 0; shift < key_bits; shift += 8) {
+		#pragma omp parallel for num_threads(num_chunks)
+		for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+			const size_t start = num_keys * chunk / num_chunks, end = num_keys * (chunk+1) / num_chunks;
+			memset(histograms[chunk], 0, sizeof(histograms[chunk]));
+			for (size_t i = start; i < end; i++)
+				histograms[chunk][(keys[i] >> shift) & 0xFF]++;
+		}
 
-		for (sentlen_t i = 1; i < sent_length; i++) { // loop over words in a sentence, starting with the first word after <s>
-			if (reverse) {
-				bigram.word_2 = sent_store_int[current_sent_num].sent[i-1];
-				bigram.word_1 = sent_store_int[current_sent_num].sent[i];
-			} else { // Normal direction
-				bigram.word_1 = sent_store_int[current_sent_num].sent[i-1];
-				bigram.word_2 = sent_store_int[current_sent_num].sent[i];
+		size_t offset = 0;
+		bool all_in_one_bucket = false;
+		for (unsigned int digit = 0; digit < 256; digit++) {
+			size_t bucket_size = 0;
+			for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+				const size_t count = histograms[chunk][digit];
+				histograms[chunk][digit] = offset;
+				offset += count;
+				bucket_size += count;
 			}
-			map_increment_bigram(&map_bigram, &bigram);
-		}
-	}
-
-	sort_bigrams(&map_bigram); // really speeds up the next step
-
-	register size_t memusage = 0;
-	register word_id_t word_2;
-	register word_id_t word_2_last = 0;
-	register unsigned int length = 0;
-	word_id_t * word_buffer     = malloc(sizeof(word_id_t) * MAX_WORD_PREDECESSORS);
-	word_bigram_count_t * count_buffer = malloc(sizeof(word_bigram_count_t) * MAX_WORD_PREDECESSORS);
-
-	// Iterate through bigram map to get counts of word_2's, so we know how much to allocate for each predecessor list
-	struct_map_bigram *entry, *tmp;
-	HASH_ITER(hh, map_bigram, entry, tmp) {
-		word_2 = (entry->key).word_2;
-		//printf("[%u,%u]=%u, w2_last=%u, length=%u\n", (entry->key).word_1, (entry->key).word_2, entry->count, word_2_last, length); fflush(stdout);
-		if (word_2 == word_2_last) { // Within successive entry; ie. 2nd entry or greater
-			word_buffer[length]  = (entry->key).word_1;
-			count_buffer[length] = entry->count;
-			length++;
-		} else { // New entry; process previous entry
-			word_bigrams[word_2_last].length = length;
-			word_bigrams[word_2_last].words  = malloc(length * sizeof(word_id_t));
-			memcpy(word_bigrams[word_2_last].words,  word_buffer, length * sizeof(word_id_t));
-			memusage += length * sizeof(word_id_t);
-			word_bigrams[word_2_last].counts = malloc(length * sizeof(word_bigram_count_t));
-			memcpy(word_bigrams[word_2_last].counts, count_buffer , length * sizeof(word_bigram_count_t));
-			memusage += length * sizeof(word_bigram_count_t);
-			//printf("\nword_2_last=%u, length=%u word_1s: ", word_2_last, length);
-			//for (unsigned int i = 0; i < length; i++) {
-			//	printf("<%u,%u> ", word_bigrams[word_2_last].words[i], word_bigrams[word_2_last].counts[i]);
-			//}
-			//printf("\n");
-
-			word_2_last = word_2;
-			word_buffer[0]  = (entry->key).word_1;
-			count_buffer[0] = entry->count;
-			length = 1;
-		}
-	}
-
-	free(word_buffer);
-	free(count_buffer);
-	delete_all_bigram(&map_bigram);
+			if (bucket_size == num_keys)
+				all_in_one_bucket = true;
+		}
+		if (all_in_one_bucket) // This digit is the same for every key, so this pass wouldn't change anything
+			continue;
+
+		#pragma omp parallel for num_threads(num_chunks)
+		for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+			const size_t start = num_keys * chunk / num_chunks, end = num_keys * (chunk+1) / num_chunks;
+			size_t * restrict bucket_offsets = histograms[chunk];
+			for (size_t i = start; i < end; i++)
+				buffer[bucket_offsets[(keys[i] >> shift) & 0xFF]++] = keys[i];
+		}
+		uint64_t * restrict swap = keys;
+		keys   = buffer;
+		buffer = swap;
+	}
+	free(histograms);
+	return keys;
+}
 
-	return memusage;
+static unsigned int bigram_word_bits(const word_id_t type_count) { // Bits per word id in a bigram key
+	unsigned int word_bits = 1;
+	while (word_bits < 32  &&  ((word_id_t)1 << word_bits) < type_count)
+		word_bits++;
+	return word_bits;
 }
 
-void build_word_class_counts(const struct cmd_args cmd_args, word_class_count_t * restrict word_class_counts, const wclass_t word2class[const], const struct_sent_int_info * const sent_store_int, const unsigned long line_count, const bool reverse) {
+static size_t count_sorted_keys(uint64_t keys[restrict], word_bigram_count_t counts[restrict], const size_t num_keys) { // Run-length counts the sorted keys, compacting them in place.  Returns the number of distinct keys
+	size_t num_bigrams = 0;
+	for (size_t key_i = 0; key_i < num_keys; key_i++) {
+		if (num_bigrams  &&  keys[num_bigrams-1] == keys[key_i]) {
+			counts[num_bigrams-1]++;
+		} else {
+			keys[num_bigrams]   = keys[key_i];
+			counts[num_bigrams] = 1;
+			num_bigrams++;
+		}
+	}
+	return num_bigrams;
+}
 
-	for (unsigned long current_sent_num = 0; current_sent_num < line_count; current_sent_num++) { // loop over sentences
-		register sentlen_t sent_length = sent_store_int[current_sent_num].length;
-		register wclass_t class_i;
-		register word_id_t word_id_i_minus_1;
-
-		for (sentlen_t i = 1; i < sent_length; i++) { // loop over words in a sentence, starting with the first word after <s>
-			if (reverse) { // Reversed: <c,v>
-				class_i           = word2class[sent_store_int[current_sent_num].sent[i-1]];
-				word_id_i_minus_1 = sent_store_int[current_sent_num].sent[i];
-			} else { // Normal <v,c>
-				class_i           = word2class[sent_store_int[current_sent_num].sent[i]];
-				word_id_i_minus_1 = sent_store_int[current_sent_num].sent[i-1];
+static size_t build_bigram_listings(struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const uint64_t keys[const], const word_bigram_count_t counts[const], const size_t num_bigrams, const unsigned int word_bits, const word_id_t type_count) {
+	// The distinct keys, in sorted order, are laid out as the (forward) listing of predecessors
+	const uint64_t word_mask = ((uint64_t)1 << word_bits) - 1;
+	size_t memusage = alloc_bigram_listing(word_bigrams, type_count, num_bigrams);
+	for (size_t bigram_i = 0; bigram_i < num_bigrams; bigram_i++) {
+		word_bigrams->offsets[(keys[bigram_i] >> word_bits) + 1]++;
+		word_bigrams->cells[bigram_i].word  = keys[bigram_i] & word_mask;
+		word_bigrams->cells[bigram_i].count = counts[bigram_i];
+	}
+	for (word_id_t word = 0; word < type_count; word++)
+		word_bigrams->offsets[word + 1] += word_bigrams->offsets[word];
+
+	if (word_bigrams_rev) { // Counting sort of the forward listing by predecessor.  Going through it in order of w_2 keeps each row of successors sorted
+		memusage += alloc_bigram_listing(word_bigrams_rev, type_count, num_bigrams);
+		for (size_t bigram_i = 0; bigram_i < num_bigrams; bigram_i++)
+			word_bigrams_rev->offsets[word_bigrams->cells[bigram_i].word + 1]++;
+		for (word_id_t word = 0; word < type_count; word++)
+			word_bigrams_rev->offsets[word + 1] += word_bigrams_rev->offsets[word];
+
+		size_t * restrict next_cell = malloc(type_count * sizeof(size_t));
+		memcpy(next_cell, word_bigrams_rev->offsets, type_count * sizeof(size_t));
+		for (word_id_t word_2 = 0; word_2 < type_count; word_2++) {
+			for (size_t bigram_i = word_bigrams->offsets[word_2]; bigram_i < word_bigrams->offsets[word_2+1]; bigram_i++) {
+				struct_word_bigram_cell * restrict cell = &word_bigrams_rev->cells[next_cell[word_bigrams->cells[bigram_i].word]++];
+				cell->word  = word_2;
+				cell->count = word_bigrams->cells[bigram_i].count;
 			}
-			//printf("i=%hu, sent_len=%u, sent_num=%lu, line_count=%lu, <v,w>=<%u,%u>, <v,c>=<%u,%u>, num_classes=%u, offset=%u (%u * %u + %u), orig_val=%u, rev=%d\n", i, sent_length, current_sent_num, line_count, sent_store_int[current_sent_num].sent[i-1], sent_store_int[current_sent_num].sent[i], word_id_i_minus_1, class_i, cmd_args.num_classes, word_id_i_minus_1 * cmd_args.num_classes + class_i, word_id_i_minus_1, cmd_args.num_classes, class_i, word_class_counts[word_id_i_minus_1 * cmd_args.num_classes + class_i], reverse); fflush(stdout);
-			word_class_counts[word_id_i_minus_1 * cmd_args.num_classes + class_i]++;
 		}
+		free(next_cell);
 	}
+	return memusage;
 }
 
+size_t set_bigram_counts(const struct cmd_args cmd_args, struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const struct_sent_int_info * const sent_store_int, const unsigned long line_count, const word_id_t type_count) {
+	// Every bigram <w_1,w_2> in the corpus becomes a 64-bit key with w_2 in the high bits, so that once the keys are sorted, each w_2's predecessors are next to each other.
+	// Runs of equal keys then give the bigram counts, which are laid out as the (forward) listing of predecessors.  The reverse listing of successors is built from the forward one.
+	// In each row the neighbors are in increasing order of word id, whatever the number of threads.
+	const unsigned int num_chunks = cmd_args.num_threads ? cmd_args.num_threads : 1;
+	const unsigned int word_bits = bigram_word_bits(type_count);
+
+	// Each chunk of sentences writes its keys to its own part of the key array
+	unsigned long * restrict chunk_offsets = calloc(num_chunks + 1, sizeof(unsigned long));
+	#pragma omp parallel for num_threads(num_chunks)
+	for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+		for (unsigned long current_sent_num = line_count * chunk / num_chunks; current_sent_num < line_count * (chunk+1) / num_chunks; current_sent_num++)
+			if (sent_store_int[current_sent_num].length > 1)
+				chunk_offsets[chunk+1] += sent_store_int[current_sent_num].length - 1;
+	}
+	for (unsigned int chunk = 0; chunk < num_chunks; chunk++)
+		chunk_offsets[chunk+1] += chunk_offsets[chunk];
+	const size_t num_keys = chunk_offsets[num_chunks];
+
+	uint64_t * restrict keys   = malloc((num_keys ? num_keys : 1) * sizeof(uint64_t));
+	uint64_t * restrict buffer = malloc((num_keys ? num_keys : 1) * sizeof(uint64_t));
+	if (keys == NULL || buffer == NULL) {
+		fprintf(stderr,  "%s: Error: Unable to allocate enough memory for sorting bigrams.  %'.1f MB needed.  Maybe use a smaller --tune-sents\n", argv_0_basename, 2 * num_keys * sizeof(uint64_t) / (double)1048576); fflush(stderr);
+		exit(13);
+	}
 
-double query_int_sents_in_store(const struct cmd_args cmd_args, const struct_sent_int_info * const sent_store_int, const struct_model_metadata model_metadata, const word_count_t word_counts[const], const wclass_t word2class[const], char * word_list[restrict], const count_arrays_t count_arrays, const word_id_t temp_word, const wclass_t temp_class) {
-	double sum_log_probs = 0.0; // For perplexity calculation
+	#pragma omp parallel for num_threads(num_chunks)
+	for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+		size_t key_i = chunk_offsets[chunk];
+		for (unsigned long current_sent_num = line_count * chunk / num_chunks; current_sent_num < line_count * (chunk+1) / num_chunks; current_sent_num++) {
+			const struct_sent_int_info * const sent_info = &sent_store_int[current_sent_num];
+			for (sentlen_t i = 1; i < sent_info->length; i++) // loop over words in a sentence, starting with the first word after <s>
+				keys[key_i++] = ((uint64_t)sent_info->sent[i] << word_bits) | sent_info->sent[i-1];
+		}
+	}
+	free(chunk_offsets);
 
-	unsigned long current_sent_num;
-	#pragma omp parallel for private(current_sent_num) num_threads(cmd_args.num_threads) reduction(+:sum_log_probs)
-	for (current_sent_num = 0; current_sent_num < model_metadata.line_count; current_sent_num++) {
+	uint64_t * restrict sorted = radix_sort_keys(keys, buffer, num_keys, 2 * word_bits, num_chunks);
+	word_bigram_count_t * restrict run_counts = (word_bigram_count_t *)(sorted == keys ? buffer : keys); // The other array is free now
+	const size_t num_bigrams = count_sorted_keys(sorted, run_counts, num_keys);
+	const size_t memusage = build_bigram_listings(word_bigrams, word_bigrams_rev, sorted, run_counts, num_bigrams, word_bits, type_count);
 
-		register sentlen_t sent_length = sent_store_int[current_sent_num].length;
-		register word_id_t word_id;
-		wclass_t class_sent[STDIN_SENT_MAX_WORDS];
+	free(keys);
+	free(buffer);
+	return memusage;
+}
 
-		// Build array of classes
-		for (sentlen_t i = 0; i < sent_length; i++) { // loop over words
-			word_id = sent_store_int[current_sent_num].sent[i];
-			if (word_id == temp_word) { // This word matches the temp word
-				class_sent[i] = temp_class;
-			} else { // This word doesn't match temp word
-				class_sent[i] = word2class[word_id];
-			}
-		}
+static int compare_bigram_cells(const void * a, const void * b) {
+	const word_id_t word_a = ((const struct_word_bigram_cell *)a)->word, word_b = ((const struct_word_bigram_cell *)b)->word;
+	return (word_a > word_b) - (word_a < word_b);
+}
 
-		float sent_score = 0.0; // Initialize with identity element
+static size_t renumber_bigram_listing(const struct cmd_args cmd_args, struct_word_bigram_listing * restrict word_bigrams, const word_id_t new2old[const], const word_id_t old2new[const]) {
+	// Moves each word's row to its new id, with the new ids of its neighbors, which are then sorted again
+	const word_id_t type_count = word_bigrams->num_words;
+	struct_word_bigram_listing renumbered;
+	const size_t memusage = alloc_bigram_listing(&renumbered, type_count, word_bigrams->num_cells);
+	for (word_id_t new_id = 0; new_id < type_count; new_id++)
+		renumbered.offsets[new_id + 1] = renumbered.offsets[new_id] + word_bigram_length(word_bigrams, new2old[new_id]);
+
+	#pragma omp parallel for num_threads(cmd_args.num_threads) schedule(dynamic, 4096)
+	for (word_id_t new_id = 0; new_id < type_count; new_id++) {
+		const struct_word_bigram_cell * restrict cells = word_bigram_cells(word_bigrams, new2old[new_id]);
+		const size_t length = word_bigram_length(word_bigrams, new2old[new_id]);
+		struct_word_bigram_cell * restrict new_cells = renumbered.cells + renumbered.offsets[new_id];
+		for (size_t i = 0; i < length; i++)
+			new_cells[i] = (struct_word_bigram_cell){ .word = old2new[cells[i].word], .count = cells[i].count };
+		qsort(new_cells, length, sizeof(struct_word_bigram_cell), compare_bigram_cells);
+	}
 
-		const struct_sent_int_info * const sent_info = &sent_store_int[current_sent_num];
+	free_bigram_counts(word_bigrams);
+	*word_bigrams = renumbered;
+	return memusage;
+}
 
+size_t renumber_bigram_counts(const struct cmd_args cmd_args, struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const word_id_t new2old[const], const word_id_t old2new[const]) {
+	// Gives the bigram listings new word ids, without the sentence store or the corpus.  The result is the same as counting the renumbered bigrams again
+	size_t memusage = renumber_bigram_listing(cmd_args, word_bigrams, new2old, old2new);
+	if (word_bigrams_rev)
+		memusage += renumber_bigram_listing(cmd_args, word_bigrams_rev, new2old, old2new);
+	return memusage;
+}
 
-		for (sentlen_t i = 1; i < sent_length; i++) {
-			const word_id_t word_i = sent_info->sent[i];
-			const wclass_t class_i = class_sent[i];
-			//wclass_t class_i_entry[CLASSLEN] = {0};
-			//class_i_entry[0] = class_i;
-			const word_count_t word_i_count = word_counts[word_i];
-			//const wclass_count_t class_i_count = map_find_count_fixed_width(class_map, class_i_entry);
-			const wclass_count_t class_i_count = count_arrays[0][class_i];
-			//float word_i_count_for_next_freq_score = word_i_count ? word_i_count : 0.2; // Using a very small value for unknown words messes up distribution
-			if (cmd_args.verbose > 3) {
-				printf("qry_snts_n_stor: i=%d\tcnt=%d\tcls=%u\tcls_cnt=%d\tw_id=%u\tw=%s\n", i, word_i_count, class_i, class_i_count, word_i, word_list[word_i]);
-				fflush(stdout);
-				if (class_i_count < word_i_count) { // Shouldn't happen
-					printf("Error: class_%hu_count=%u < word_id[%u]_count=%u\n", class_i, class_i_count, word_i, word_i_count); fflush(stderr);
-					exit(5);
+size_t stream_bigram_counts(const struct cmd_args cmd_args, struct_corpus_stream * restrict stream, struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const word_id_t type_count, const word_id_t remap[const]) { // Uses global ngram_map
+	// Like set_bigram_counts(), but reading the corpus again a block at a time instead of going through the sentence store.  The sorted, counted keys of each block
+	// are merged into the ones so far, so this needs memory for the distinct bigrams, not for all of them.  If remap isn't NULL, it gives new ids for the words
+	const unsigned int num_chunks = cmd_args.num_threads ? cmd_args.num_threads : 1;
+	const unsigned int word_bits = bigram_word_bits(type_count);
+	const word_id_t start_id = remap ? remap[map_find_int(&ngram_map, "<s>")]  : map_find_int(&ngram_map, "<s>");
+	const word_id_t end_id   = remap ? remap[map_find_int(&ngram_map, "</s>")] : map_find_int(&ngram_map, "</s>");
+	const word_id_t unk_id   = map_find_int(&ngram_map, UNKNOWN_WORD);
+	uint64_t * restrict merged_keys = NULL;
+	word_bigram_count_t * restrict merged_counts = NULL;
+	size_t num_merged = 0;
+
+	rewind_corpus_stream(stream);
+	while (read_corpus_block(stream)) {
+		const struct_corpus * const block = &stream->block;
+
+		// A line of n bytes has at most (n+1)/2 words, so each chunk of lines gets that much room for its keys, plus one more key per line for </s>
+		size_t * restrict chunk_offsets = calloc(num_chunks + 1, sizeof(size_t));
+		for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+			const unsigned long line_start = block->num_lines * chunk / num_chunks, line_end = block->num_lines * (chunk+1) / num_chunks;
+			chunk_offsets[chunk+1] = chunk_offsets[chunk] + (block->line_starts[line_end] - block->line_starts[line_start] + 1) / 2 + 2 * (line_end - line_start);
+		}
+		uint64_t * restrict keys   = malloc((chunk_offsets[num_chunks] + 1) * sizeof(uint64_t));
+		uint64_t * restrict buffer = malloc((chunk_offsets[num_chunks] + 1) * sizeof(uint64_t));
+		if (keys == NULL || buffer == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for sorting bigrams\n", argv_0_basename); fflush(stderr);
+			exit(13);
+		}
+		size_t * restrict chunk_num_keys = calloc(num_chunks, sizeof(size_t));
+
+		#pragma omp parallel for num_threads(num_chunks)
+		for (unsigned int chunk = 0; chunk < num_chunks; chunk++) {
+			const char * words[STDIN_SENT_MAX_WORDS];
+			size_t word_lengths[STDIN_SENT_MAX_WORDS];
+			size_t key_i = chunk_offsets[chunk];
+			for (unsigned long line_i = block->num_lines * chunk / num_chunks; line_i < block->num_lines * (chunk+1) / num_chunks; line_i++) {
+				const sentlen_t num_words = tokenize_corpus_line(block, line_i, words, word_lengths, false);
+				word_id_t prev_id = start_id;
+				for (sentlen_t w_i = 0; w_i < num_words; w_i++) {
+					const struct_map_word * restrict entry = map_lookup(&ngram_map, words[w_i], word_lengths[w_i], map_hash(words[w_i], word_lengths[w_i]));
+					word_id_t word_id = entry ? entry->word_id : unk_id; // Filtered words become <unk>
+					if (remap)
+						word_id = remap[word_id];
+					keys[key_i++] = ((uint64_t)word_id << word_bits) | prev_id;
+					prev_id = word_id;
 				}
+				keys[key_i++] = ((uint64_t)end_id << word_bits) | prev_id;
 			}
+			chunk_num_keys[chunk] = key_i - chunk_offsets[chunk];
+		}
 
-			// Class prob is transition prob * emission prob
-			const float emission_prob = word_i_count ? (float)word_i_count / (float)class_i_count :  1 / (float)class_i_count;
-
-
-			// Calculate transition probs
-			// The array for probs/weights is:  w_{i-2}  w_{i-1}  w_i  w_{i+1}  w_{i+2}
-			float weights_class[] = {0.4, 0.16, 0.01, 0.1, 0.33};
-			//float weights_class[] = {0.0, 0.0, 1.0, 0.0, 0.0};
-			//float weights_class[] = {0.0, 0.99, 0.01, 0.0, 0.0};
-			//float weights_class[] = {0.8, 0.19, 0.01, 0.0, 0.0};
-			//float weights_class[] = {0.69, 0.15, 0.01, 0.15, 0.0};
-			float order_probs[5] = {0};
-			order_probs[2] = class_i_count / (float)model_metadata.token_count; // unigram probs
-			float sum_weights = weights_class[2]; // unigram prob will always occur
-			float sum_probs = weights_class[2] * order_probs[2]; // unigram prob will always occur
-
-			//const float transition_prob = class_ngram_prob(cmd_args, count_arrays, class_map, i, class_i, class_i_count, class_sent, CLASSLEN, model_metadata, weights_class);
-			if ((cmd_args.max_array > 2) && (i > 1)) { // Need at least "<s> w_1" in history
-				order_probs[0] = count_arrays[2][ array_offset(&class_sent[i-2], 3, cmd_args.num_classes) ] / (float)count_arrays[1][ array_offset(&class_sent[i-1], 2, cmd_args.num_classes) ]; // trigram probs
-				order_probs[0] = isnan(order_probs[0]) ? 0.0f : order_probs[0]; // If the bigram history is 0, result will be a -nan
-				sum_weights += weights_class[0];
-				sum_probs += weights_class[0] * order_probs[0];
+		size_t num_keys = 0;
+		for (unsigned int chunk = 0; chunk < num_chunks; chunk++) { // Close the gaps between chunks
+			memmove(keys + num_keys, keys + chunk_offsets[chunk], chunk_num_keys[chunk] * sizeof(uint64_t));
+			num_keys += chunk_num_keys[chunk];
+		}
+		free(chunk_offsets);
+		free(chunk_num_keys);
+
+		uint64_t * restrict sorted = radix_sort_keys(keys, buffer, num_keys, 2 * word_bits, num_chunks);
+		word_bigram_count_t * restrict run_counts = (word_bigram_count_t *)(sorted == keys ? buffer : keys);
+		const size_t num_bigrams = count_sorted_keys(sorted, run_counts, num_keys);
+
+		// Merge this block's bigrams into the ones so far
+		uint64_t * restrict new_keys = malloc((num_merged + num_bigrams + 1) * sizeof(uint64_t));
+		word_bigram_count_t * restrict new_counts = malloc((num_merged + num_bigrams + 1) * sizeof(word_bigram_count_t));
+		if (new_keys == NULL || new_counts == NULL) {
+			fprintf(stderr,  "%s: Error: Unable to allocate enough memory for %'zu distinct bigrams\n", argv_0_basename, num_merged + num_bigrams); fflush(stderr);
+			exit(13);
+		}
+		size_t merged_i = 0, block_i = 0, new_i = 0;
+		while (merged_i < num_merged  ||  block_i < num_bigrams) {
+			if (block_i == num_bigrams  ||  (merged_i < num_merged  &&  merged_keys[merged_i] < sorted[block_i])) {
+				new_keys[new_i] = merged_keys[merged_i];
+				new_counts[new_i++] = merged_counts[merged_i++];
+			} else if (merged_i == num_merged  ||  sorted[block_i] < merged_keys[merged_i]) {
+				new_keys[new_i] = sorted[block_i];
+				new_counts[new_i++] = run_counts[block_i++];
 			} else {
-				weights_class[0] = 0.0;
+				new_keys[new_i] = sorted[block_i];
+				new_counts[new_i++] = merged_counts[merged_i++] + run_counts[block_i++];
 			}
+		}
+		free(merged_keys);
+		free(merged_counts);
+		merged_keys   = new_keys;
+		merged_counts = new_counts;
+		num_merged    = new_i;
+		free(keys);
+		free(buffer);
+	}
 
-			// We'll always have at least "<s>" in history.  And we'll always have Vienna.
-			order_probs[1] = count_arrays[1][ array_offset(&class_sent[i-1], 2, cmd_args.num_classes) ] / (float)count_arrays[0][ array_offset(&class_sent[i], 1, cmd_args.num_classes) ]; // bigram probs
-			//printf("order_probs[1] = %u / %u; [%hu,%hu] \n", count_arrays[1][ array_offset(&class_sent[i], 2, cmd_args.num_classes) ], count_arrays[0][ array_offset(&class_sent[i], 1, cmd_args.num_classes)], class_sent[i-1], class_sent[i]);
-			sum_weights += weights_class[1];
-			sum_probs += weights_class[1] * order_probs[1];
+	const size_t memusage = build_bigram_listings(word_bigrams, word_bigrams_rev, merged_keys, merged_counts, num_merged, word_bits, type_count);
+	free(merged_keys);
+	free(merged_counts);
+	return memusage;
+}
 
-			if (i < sent_length-1) { // Need at least "</s>" to the right
-				order_probs[3] = count_arrays[1][ array_offset(&class_sent[i], 2, cmd_args.num_classes) ] / (float)count_arrays[0][ array_offset(&class_sent[i+1], 1, cmd_args.num_classes) ]; // future bigram probs
-				sum_weights += weights_class[3];
-				sum_probs += weights_class[3] * order_probs[3];
-			}
+void free_bigram_counts(struct_word_bigram_listing * restrict word_bigrams) {
+	free(word_bigrams->block);
+	memset(word_bigrams, 0, sizeof(struct_word_bigram_listing));
+}
 
-			if ((cmd_args.max_array > 2) && (i < sent_length-2)) { // Need at least "w </s>" to the right
-			order_probs[4] = count_arrays[2][ array_offset(&class_sent[i], 3, cmd_args.num_classes) ] / (float)count_arrays[1][ array_offset(&class_sent[i+1], 2, cmd_args.num_classes) ]; // future trigram probs
-			order_probs[4] = isnan(order_probs[4]) ? 0.0f : order_probs[4]; // If the bigram history is 0, result will be a -nan
-				sum_weights += weights_class[4];
-				sum_probs += weights_class[4] * order_probs[4];
-			} else {
-				weights_class[4] = 0.0;
+void build_word_class_counts(const struct cmd_args cmd_args, struct_word_class_counts * restrict word_class_counts, const wclass_t word2class[const], const struct_word_bigram_listing * restrict word_bigrams, const bool reverse) {
+	// Each distinct bigram <v,w> adds its count to <v,class(w)>, or for the reversed counts to <class(v),w>.  That's one update per distinct bigram rather than per token
+	for (word_id_t word_2 = 0; word_2 < word_bigrams->num_words; word_2++) {
+		const struct_word_bigram_cell * restrict cells = word_bigram_cells(word_bigrams, word_2);
+		const size_t length = word_bigram_length(word_bigrams, word_2);
+		for (size_t i = 0; i < length; i++) {
+			const word_id_t word_1 = cells[i].word;
+			if (reverse) // Reversed: <c,v>
+				word_class_count_set(word_class_counts, word_2, word2class[word_1], word_class_count_find(word_class_counts, word_2, word2class[word_1]) + cells[i].count);
+			else // Normal <v,c>
+				word_class_count_set(word_class_counts, word_1, word2class[word_2], word_class_count_find(word_class_counts, word_1, word2class[word_2]) + cells[i].count);
+		}
+	}
+}
+
+
+double query_int_sents_in_store(const struct cmd_args cmd_args, const struct_sent_int_info * const sent_store_int, const struct_model_metadata model_metadata, const word_count_t word_counts[const], const wclass_t word2class[const], char * word_list[restrict], const count_arrays_t count_arrays, const word_id_t temp_word, const wclass_t temp_class) {
+	// The store is split into chunks of sentences, which the calling thread team picks up as tasks.  Summing the chunks afterwards in order
+	// gives the same total for any number of threads.
+	const unsigned long num_chunks = (model_metadata.line_count + TASK_SENTS - 1) / TASK_SENTS;
+	double * restrict chunk_log_probs = malloc(sizeof(double) * (num_chunks ? num_chunks : 1));
+
+	#pragma omp taskloop
+	for (unsigned long chunk = 0; chunk < num_chunks; chunk++) {
+		const unsigned long chunk_end = (chunk+1) * TASK_SENTS < model_metadata.line_count ? (chunk+1) * TASK_SENTS : model_metadata.line_count;
+		double chunk_log_prob = 0.0;
+
+		for (unsigned long current_sent_num = chunk * TASK_SENTS; current_sent_num < chunk_end; current_sent_num++) {
+
+			register sentlen_t sent_length = sent_store_int[current_sent_num].length;
+			register word_id_t word_id;
+			wclass_t class_sent[STDIN_SENT_MAX_WORDS];
+
+			// Build array of classes
+			for (sentlen_t i = 0; i < sent_length; i++) { // loop over words
+				word_id = sent_store_int[current_sent_num].sent[i];
+				if (word_id == temp_word) { // This word matches the temp word
+					class_sent[i] = temp_class;
+				} else { // This word doesn't match temp word
+					class_sent[i] = word2class[word_id];
+				}
 			}
 
-			const float transition_prob = sum_probs / sum_weights;
-			const float class_prob = emission_prob * transition_prob;
+			float sent_score = 0.0; // Initialize with identity element
+
+			const struct_sent_int_info * const sent_info = &sent_store_int[current_sent_num];
+
+
+			for (sentlen_t i = 1; i < sent_length; i++) {
+				const word_id_t word_i = sent_info->sent[i];
+				const wclass_t class_i = class_sent[i];
+				//wclass_t class_i_entry[CLASSLEN] = {0};
+				//class_i_entry[0] = class_i;
+				const word_count_t word_i_count = word_counts[word_i];
+				//const wclass_count_t class_i_count = map_find_count_fixed_width(class_map, class_i_entry);
+				const wclass_count_t class_i_count = count_arrays[0][class_i];
+				//float word_i_count_for_next_freq_score = word_i_count ? word_i_count : 0.2; // Using a very small value for unknown words messes up distribution
+				if (cmd_args.verbose > 3) {
+					printf("qry_snts_n_stor: i=%d\tcnt=%d\tcls=%u\tcls_cnt=%d\tw_id=%u\tw=%s\n", i, word_i_count, class_i, class_i_count, word_i, word_list[word_i]);
+					fflush(stdout);
+					if (class_i_count < word_i_count) { // Shouldn't happen
+						printf("Error: class_%hu_count=%u < word_id[%u]_count=%u\n", class_i, class_i_count, word_i, word_i_count); fflush(stderr);
+						exit(5);
+					}
+				}
 
+				// Class prob is transition prob * emission prob
+				const float emission_prob = word_i_count ? (float)word_i_count / (float)class_i_count :  1 / (float)class_i_count;
+
+
+				// Calculate transition probs
+				// The array for probs/weights is:  w_{i-2}  w_{i-1}  w_i  w_{i+1}  w_{i+2}
+				float weights_class[] = {0.4, 0.16, 0.01, 0.1, 0.33};
+				//float weights_class[] = {0.0, 0.0, 1.0, 0.0, 0.0};
+				//float weights_class[] = {0.0, 0.99, 0.01, 0.0, 0.0};
+				//float weights_class[] = {0.8, 0.19, 0.01, 0.0, 0.0};
+				//float weights_class[] = {0.69, 0.15, 0.01, 0.15, 0.0};
+				float order_probs[5] = {0};
+				order_probs[2] = class_i_count / (float)model_metadata.token_count; // unigram probs
+				float sum_weights = weights_class[2]; // unigram prob will always occur
+				float sum_probs = weights_class[2] * order_probs[2]; // unigram prob will always occur
+
+				//const float transition_prob = class_ngram_prob(cmd_args, count_arrays, class_map, i, class_i, class_i_count, class_sent, CLASSLEN, model_metadata, weights_class);
+				if ((cmd_args.max_array > 2) && (i > 1)) { // Need at least "<s> w_1" in history
+					order_probs[0] = count_arrays[2][ array_offset(&class_sent[i-2], 3, cmd_args.num_classes) ] / (float)count_arrays[1][ array_offset(&class_sent[i-1], 2, cmd_args.num_classes) ]; // trigram probs
+					order_probs[0] = isnan(order_probs[0]) ? 0.0f : order_probs[0]; // If the bigram history is 0, result will be a -nan
+					sum_weights += weights_class[0];
+					sum_probs += weights_class[0] * order_probs[0];
+				} else {
+					weights_class[0] = 0.0;
+				}
+
+				// We'll always have at least "<s>" in history.  And we'll always have Vienna.
+				order_probs[1] = count_arrays[1][ array_offset(&class_sent[i-1], 2, cmd_args.num_classes) ] / (float)count_arrays[0][ array_offset(&class_sent[i], 1, cmd_args.num_classes) ]; // bigram probs
+				//printf("order_probs[1] = %u / %u; [%hu,%hu] \n", count_arrays[1][ array_offset(&class_sent[i], 2, cmd_args.num_classes) ], count_arrays[0][ array_offset(&class_sent[i], 1, cmd_args.num_classes)], class_sent[i-1], class_sent[i]);
+				sum_weights += weights_class[1];
+				sum_probs += weights_class[1] * order_probs[1];
 
-			if (cmd_args.verbose > 2) {
-				printf(" w_id=%u, w_i_cnt=%g, class_i=%u, class_i_count=%i, emission_prob=%g, transition_prob=%g, class_prob=%g, log2=%g, sum_probs=%g, sum_weights=%g\n", word_i, (float)word_i_count, class_i, class_i_count, emission_prob, transition_prob, class_prob, log2f(class_prob), sum_probs, sum_weights);
-				printf("transition_probs:\t");
-				fprint_arrayf(stdout, order_probs, 5, ","); fflush(stdout);
-				if (class_i_count > model_metadata.token_count) { // Shouldn't happen
-					printf("Error: prob of order max_ngram_used > 1;  %u/%lu\n", class_i_count, model_metadata.token_count); fflush(stderr);
-					exit(6);
+				if (i < sent_length-1) { // Need at least "</s>" to the right
+					order_probs[3] = count_arrays[1][ array_offset(&class_sent[i], 2, cmd_args.num_classes) ] / (float)count_arrays[0][ array_offset(&class_sent[i+1], 1, cmd_args.num_classes) ]; // future bigram probs
+					sum_weights += weights_class[3];
+					sum_probs += weights_class[3] * order_probs[3];
 				}
-				if (! ((class_prob >= 0) && (class_prob <= 1))) {
-					printf("Error: prob is not within [0,1]  %g\n", class_prob); fflush(stderr);
-					exit(11);
+
+				if ((cmd_args.max_array > 2) && (i < sent_length-2)) { // Need at least "w </s>" to the right
+				order_probs[4] = count_arrays[2][ array_offset(&class_sent[i], 3, cmd_args.num_classes) ] / (float)count_arrays[1][ array_offset(&class_sent[i+1], 2, cmd_args.num_classes) ]; // future trigram probs
+				order_probs[4] = isnan(order_probs[4]) ? 0.0f : order_probs[4]; // If the bigram history is 0, result will be a -nan
+					sum_weights += weights_class[4];
+					sum_probs += weights_class[4] * order_probs[4];
+				} else {
+					weights_class[4] = 0.0;
+				}
+
+				const float transition_prob = sum_probs / sum_weights;
+				const float class_prob = emission_prob * transition_prob;
+
+
+				if (cmd_args.verbose > 2) {
+					printf(" w_id=%u, w_i_cnt=%g, class_i=%u, class_i_count=%i, emission_prob=%g, transition_prob=%g, class_prob=%g, log2=%g, sum_probs=%g, sum_weights=%g\n", word_i, (float)word_i_count, class_i, class_i_count, emission_prob, transition_prob, class_prob, log2f(class_prob), sum_probs, sum_weights);
+					printf("transition_probs:\t");
+					fprint_arrayf(stdout, order_probs, 5, ","); fflush(stdout);
+					if (class_i_count > model_metadata.token_count) { // Shouldn't happen
+						printf("Error: prob of order max_ngram_used > 1;  %u/%lu\n", class_i_count, model_metadata.token_count); fflush(stderr);
+						exit(6);
+					}
+					if (! ((class_prob >= 0) && (class_prob <= 1))) {
+						printf("Error: prob is not within [0,1]  %g\n", class_prob); fflush(stderr);
+						exit(11);
+					}
 				}
-			}
 
-			sent_score += log2((double)class_prob); // Increment running sentence total;  we can use doubles for global-level scores
+				sent_score += log2((double)class_prob); // Increment running sentence total;  we can use doubles for global-level scores
 
-		} // for i loop
+			} // for i loop
 
-		sum_log_probs += sent_score; // Increment running test set total, for perplexity
-	} // Done querying current sentence
+			chunk_log_prob += sent_score; // Increment running chunk total, for perplexity
+		} // Done querying current sentence
+		chunk_log_probs[chunk] = chunk_log_prob;
+	}
+
+	double sum_log_probs = 0.0; // For perplexity calculation
+	for (unsigned long chunk = 0; chunk < num_chunks; chunk++)
+		sum_log_probs += chunk_log_probs[chunk];
+	free(chunk_log_probs);
 	return sum_log_probs;
 }
 
@@ -25,13 +25,17 @@
 #define STDIN_SENT_MAX_CHARS 40000
 #define STDIN_SENT_MAX_WORDS 1024
 #define MAX_WORD_LEN 255
-#define MAX_WORD_PREDECESSORS 1000000
 #define ENTROPY_TERMS_MAX 10000000
+#define ENTROPY_TERMS_SMALL 4096 // Exact n*log2(n) terms kept by the compact entropy evaluator.  Must be a power of 2
+#define TASK_MIN_COST 32768 // Least amount of work (roughly, <v,c> cells to score) worth handing to another thread as a task
+#define TASK_SENTS 4096     // Sentences per task when going through the sentence store
+#define CANDIDATE_CLASSES_SHARE 8 // Score just a word's candidate classes when its neighbors' <v,c> rows have at most 1/this of num_classes entries
 
 enum class_algos {EXCHANGE, BROWN, EXCHANGE_BROWN};
 enum print_word_vectors {NO_VEC, TEXT_VEC, BINARY_VEC};
 
 #include "clustercat-data.h" // bad. chicken-and-egg typedef deps
+#include "clustercat-word-class-counts.h"
 
 typedef unsigned short sentlen_t; // Number of words in a sentence
 #define SENT_LEN_MAX USHRT_MAX
@@ -52,28 +56,115 @@ typedef struct {
 	sentlen_t length;
 } struct_sent_int_info;
 
+typedef struct { // The files given with --in, in the order they're read.  None means stdin
+	char * * names;
+	size_t num_files;
+} struct_corpus_files;
+
+typedef struct { // One of several files in a corpus.  Its lines' offsets in line_starts count from start
+	const char * text;
+	size_t start;
+	size_t length;
+	bool mapped;
+} struct_corpus_part;
+
+typedef struct { // The training corpus, read-only.  A file given with --in is memory-mapped, and stdin is read into one buffer
+	const char * restrict text;
+	size_t * restrict line_starts; // Byte offset of each line, plus the end of the last line
+	size_t length;
+	unsigned long num_lines;
+	unsigned long first_line;      // Line number of the first line, when this is a block of a streamed corpus
+	bool mapped;
+	struct_corpus_part * parts;    // With more than one file, their texts, one after another in line_starts' offsets.  Then text is NULL
+	size_t num_parts;
+} struct_corpus;
+
+typedef struct { // Reads the corpus a block of lines at a time, for --stream.  Stdin is copied to a temporary file as it's read, so that it can be read again
+	const struct_corpus_files * files; // No files for stdin.  They're read one after another, as if they were one file
+	size_t file_i;
+	size_t file_bytes;             // Passed on so far from the current file
+	char last_char;                // The last one passed on, so that a file without a final newline doesn't run into the next one
+	void * gz;                     // gzFile.  It passes plain text through as is
+	void * zstd;                   // ZSTD_DStream, for zstd-compressed input
+	unsigned char * source_buffer; // Bytes from gz that haven't been passed on or decompressed yet
+	size_t source_pos;
+	size_t source_length;
+	bool zstd_mid_frame;           // So that truncated input is an error
+	FILE * file;                   // Stdin's spool, once it's being read again
+	FILE * spool;
+	char * buffer;
+	size_t capacity;
+	size_t length;                 // Bytes in buffer
+	size_t carry;                  // Bytes at the start of buffer that belong to the next block
+	unsigned long max_lines;
+	unsigned long lines_read;
+	struct_corpus block;
+} struct_corpus_stream;
+
+typedef struct { // A copy of one line in a struct_corpus_sample
+	char * text;
+	size_t length;
+	unsigned long line;
+} struct_sample_line;
+
+typedef struct { // A uniform random sample of a streamed corpus' lines, for --tune-sample.  Li's Algorithm L jumps straight to the next line that goes in, so the rest cost nothing
+	struct_sample_line * lines;
+	unsigned long size;            // Lines wanted
+	unsigned long num_lines;
+	unsigned long capacity;
+	unsigned long next_line;       // Line number of the next line that goes in
+	double w;
+	uint64_t rng;
+	size_t text_bytes;
+} struct_corpus_sample;
+
+typedef struct { // One thread's part of the corpus, while parsing it
+	struct_map_word_table vocab;    // The part's own word counts.  Each word_id is a local id, in order of first occurrence, which is also the entries' order
+	unsigned long line_start;
+	unsigned long line_end;
+	unsigned long num_sents_counted;
+	unsigned long token_count;
+	word_id_t num_types;
+} struct_corpus_shard;
+
 typedef struct {
 	unsigned long token_count;
 	unsigned long line_count;
 	word_id_t     type_count;
+	word_id_t     start_sent_id;   // <s>, which starts every sentence
 } struct_model_metadata;
 
-// typedef {...} struct_word_bigram; // see clustercat-map.h
+typedef struct { // One neighbor of a word in a bigram listing, with the count of their bigram.  Kept together so that a walk over a word's neighbors reads one stream
+	word_id_t word;
+	word_bigram_count_t count;
+} struct_word_bigram_cell;
+
+typedef struct { // Compressed sparse rows:  the neighbors of word w are cells[offsets[w]] ... cells[offsets[w+1]-1].  Both arrays live in one 64-byte aligned block
+	size_t * restrict offsets; // num_words + 1 of these
+	struct_word_bigram_cell * restrict cells;
+	void * block;
+	size_t num_cells;
+	word_id_t num_words;
+} struct_word_bigram_listing;
+
+static inline size_t word_bigram_length(const struct_word_bigram_listing * restrict listing, const word_id_t word) {
+	return listing->offsets[word+1] - listing->offsets[word];
+}
 
-typedef struct { // This is for an array pointing to this struct having a pointer to an array of successors to a given word, as well as the length of that array
-	word_id_t * words;
-	word_bigram_count_t * counts;
-	unsigned long length;
-} struct_word_bigram_entry;
+static inline const struct_word_bigram_cell * word_bigram_cells(const struct_word_bigram_listing * restrict listing, const word_id_t word) {
+	return listing->cells + listing->offsets[word];
+}
 
 char *argv_0_basename; // Allow for global access to filename
 
 struct cmd_args {
 	unsigned long   max_tune_sents;
+	word_id_t       word_block;       // Number of words evaluated together against a frozen snapshot in deterministic parallel exchange.  0 == off
 	wclass_t        num_classes;
 	unsigned short  min_count : 12;
 	signed char     verbose : 4;      // Negative values increasingly suppress normal output
 	unsigned short  tune_cycles : 8;
+	unsigned short  verify_every : 8; // Re-tally the whole corpus and query its log-likelihood every this many cycles.  0 == never
 	signed char     class_offset: 4;
 	unsigned short  num_threads : 8;
 	unsigned char   rev_alternate: 3; // How often to alternate using reverse pex.  0 == never, 1 == after every one normal pex cycles, ...
@@ -82,23 +173,31 @@ struct cmd_args {
 	unsigned char   print_word_vectors : 2; // enum print_word_vectors
 	bool print_freqs;
 	bool unidirectional;
+	bool entropy_table;               // Look up all n*log2(n) terms in a full ENTROPY_TERMS_MAX table
+	bool reorder_words;               // Renumber rare words so that ones with the same dominant neighbor are next to each other
+	bool stream;                      // Read the corpus twice instead of keeping a sentence store
+	bool tune_sample;                 // Count words over the whole corpus, but keep a random sample of --tune-sents lines as the sentence store
 };
 
-size_t sent_buffer2sent_store_int(struct_map_word **ngram_map, char * restrict sent_buffer[restrict], struct_sent_int_info sent_store_int[restrict], const unsigned long num_sents_in_store);
-void populate_word_ids(struct_map_word **ngram_map, char * restrict unique_words[const], const word_id_t type_count);
-void build_word_count_array(struct_map_word **ngram_map, char * restrict unique_words[const], word_count_t word_counts[restrict], const word_id_t type_count);
+void add_special_words(void);
+unsigned long parse_corpus(const struct_corpus * restrict corpus, struct_sent_int_info sent_store_int[restrict], struct_corpus_shard shards[restrict], const unsigned int num_shards);
+void free_shard_vocabs(struct_corpus_shard shards[restrict], const unsigned int num_shards);
+size_t integerize_sent_store(const struct_map_word_table * restrict ngram_map, struct_corpus_shard shards[restrict], const unsigned int num_shards, struct_sent_int_info sent_store_int[restrict]);
+size_t integerize_corpus(const struct_map_word_table * restrict ngram_map, const struct_corpus * restrict corpus, const unsigned int num_threads, struct_sent_int_info sent_store_int[restrict]);
+void populate_word_ids(struct_map_word_table * restrict ngram_map, char * restrict unique_words[const], const word_id_t type_count);
+void build_word_count_array(const struct_map_word_table * restrict ngram_map, char * restrict unique_words[const], word_count_t word_counts[restrict], const word_id_t type_count);
 
-void increment_ngram_variable_width(struct_map_word **ngram_map, char * restrict sent[const], const short * restrict word_lengths, short start_position, const sentlen_t i);
 void increment_ngram_fixed_width(const struct cmd_args cmd_args, count_arrays_t count_arrays, wclass_t class_sent[const], short start_position, const sentlen_t i);
 void tally_class_counts_in_store(const struct cmd_args cmd_args, const struct_sent_int_info * const sent_store_int, const struct_model_metadata model_metadata, const wclass_t word2class[const], count_arrays_t count_arrays);
+void tally_class_counts_in_listing(const struct cmd_args cmd_args, const struct_word_bigram_listing * restrict word_bigrams, const struct_model_metadata model_metadata, const wclass_t word2class[const], count_arrays_t count_arrays);
 void tally_int_sents_in_store(const struct cmd_args cmd_args, const struct_sent_int_info * const sent_store_int, const struct_model_metadata model_metadata, const wclass_t word2class[const], count_arrays_t count_arrays, const word_id_t temp_word, const wclass_t temp_class);
-unsigned long process_str_sents_in_buffer(char * restrict sent_buffer[], const unsigned long num_sents_in_buffer);
-unsigned long process_str_sent(char * restrict sent_str);
-word_id_t filter_infrequent_words(const struct cmd_args cmd_args, struct_model_metadata * restrict model_metadata, struct_map_word ** ngram_map);
-void tokenize_sent(char * restrict sent_str, struct_sent_info *sent_info);
+word_id_t filter_infrequent_words(const struct cmd_args cmd_args, struct_model_metadata * restrict model_metadata, struct_map_word_table * restrict ngram_map);
 void init_clusters(const struct cmd_args cmd_args, word_id_t vocab_size, wclass_t word2class[restrict], const word_count_t word_counts[const], char * word_list[restrict]);
-size_t set_bigram_counts(const struct cmd_args cmd_args, struct_word_bigram_entry * restrict word_bigrams, const struct_sent_int_info * const sent_store_int, const unsigned long line_count, const bool reverse);
-void build_word_class_counts(const struct cmd_args cmd_args, word_class_count_t * restrict word_class_counts, const wclass_t word2class[const], const struct_sent_int_info * const sent_store_int, const unsigned long line_count, const bool reverse);
+size_t set_bigram_counts(const struct cmd_args cmd_args, struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const struct_sent_int_info * const sent_store_int, const unsigned long line_count, const word_id_t type_count);
+size_t stream_bigram_counts(const struct cmd_args cmd_args, struct_corpus_stream * restrict stream, struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const word_id_t type_count, const word_id_t remap[const]);
+size_t renumber_bigram_counts(const struct cmd_args cmd_args, struct_word_bigram_listing * restrict word_bigrams, struct_word_bigram_listing * restrict word_bigrams_rev, const word_id_t new2old[const], const word_id_t old2new[const]);
+void free_bigram_counts(struct_word_bigram_listing * restrict word_bigrams);
+void build_word_class_counts(const struct cmd_args cmd_args, struct_word_class_counts * restrict word_class_counts, const wclass_t word2class[const], const struct_word_bigram_listing * restrict word_bigrams, const bool reverse);
 double query_int_sents_in_store(const struct cmd_args cmd_args, const struct_sent_int_info * const sent_store_int, const struct_model_metadata model_metadata, const word_count_t word_counts[const], const wclass_t word2class[const], char * word_list[restrict], const count_arrays_t count_arrays, const word_id_t temp_word, const wclass_t temp_class);
 
 void init_count_arrays(const struct cmd_args cmd_args, count_arrays_t count_arrays);